@@ -24,6 +24,7 @@
 #include <windows.h>
 #include <GL/gl.h>
 #include "benchmark.h"
+#include "benchtime.h"
 
 static char *map_GL_enum_to_string(unsigned int num);
 
@@ -184,74 +185,24 @@ class bench_base {
 public:
     virtual bool run_one_test(void) = 0;
     double run_benchmark(FILE *log);
+    BENCH_TIMING m_timing;
 };
 
-#define TEST_LENGTH_SECONDS 10
-#define MINIMUM_REPS_REQUIRED 10
+static bool run_bench_base(void *data)
+{
+    return ((bench_base *)data)->run_one_test();
+}
+
+// Returns runs per second from the median run, or -1 if a run failed.
+// m_timing says how much to trust it.
 double bench_base::run_benchmark(FILE * /* log */)
 {
-    int i;
-    DWORD prevTime, curTime;
-    int repsPerSecond;
-    int repCount;
-    double elapsed;
-
-    //
-    // Do one second's worth of testing to guess how often to check
-    // the clock so we can reduce the overhead of the clock check during
-    // the real timing test.
-    //
-    prevTime = timeGetTime();
     glGetError(); // flush errors
-    repCount = 0;
-    do {
-
-	if(!run_one_test())
-	    return -1;
-
-	repCount ++;
-
-	curTime = timeGetTime();
-	if(prevTime > curTime) {
-	    // XXX grantham - Probably should test this to make sure it works
-	    curTime += (1U << 31);
-	    prevTime -= (1U<< 31);
-	}
-	elapsed = (curTime - prevTime) / 1000.0;
-
-    } while(elapsed < 1.0);
-
-    // Give 10% for clock overhead
-    repsPerSecond = (int)(repCount/elapsed*1.1);
-
-    if(repsPerSecond == 0)
-	// Oy - this means we only ran one test, so one rep took more than 
-	// one second.  We really should increase our test length to get
-	// better timing samples but I have forgotten everything I learned
-	// about statistics, so I don't know what "better" is.
-	repsPerSecond = 1;
-
-    prevTime = timeGetTime();
-    repCount = 0; 
-    do {
-
-	for(i = 0; i < repsPerSecond; i++)
-	    run_one_test();
-
-	repCount += repsPerSecond;
-
-	curTime = timeGetTime();
-	if(prevTime > curTime) {
-	    // XXX grantham - Probably should test this to make sure it works
-	    curTime += (1U << 31);
-	    prevTime -= (1U << 31);
-	}
-	elapsed = (curTime - prevTime) / 1000.0;
 
-    // Really, this should be "} while(not statistically significant);"
-    } while(repCount < MINIMUM_REPS_REQUIRED || elapsed < TEST_LENGTH_SECONDS);
+    if(!time_bench_function(run_bench_base, this, NULL, &m_timing))
+	return -1;
 
-    return repCount / (float)elapsed;
+    return 1000 / m_timing.median_ms;
 }
 
 #ifndef GL_RGB5_A1
@@ -328,7 +279,8 @@ void bench_test_teximage_config(FILE *log, GLenum int_fmt, GLenum fmt,
     if(tps == -1)
 	fprintf(log, "error encountered\n");
     else
-        fprintf(log, " %f Mtexels/sec\n", tps / 1e6);
+        fprintf(log, " %f Mtexels/sec (+/- %.1f%%)\n", tps / 1e6,
+		100 * bench.m_timing.interval_ms / bench.m_timing.mean_ms);
 
     delete[] buffer;
 }
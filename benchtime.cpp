@@ -0,0 +1,262 @@
+/*
+ * BenchTime.cpp
+ *
+ * Times a function the way the benchmarks all want it timed.  After the
+ * warm-up, short runs are grouped so each sample is long next to the
+ * clock, and samples are taken until the 95% confidence interval of the
+ * mean is a small fraction of it.  Samples far from the median (by the
+ * median absolute deviation) are left out first, since they're almost
+ * always another thread or the disk getting in the way.
+ *
+ */
+
+#include <windows.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "benchtime.h"
+
+// the most samples a test can keep
+#define BENCH_MAXIMUM_SAMPLES       1000
+
+// modified z-score past which a sample is an outlier (Iglewicz and
+// Hoaglin).  0.6745 makes the deviation comparable to a standard one.
+#define BENCH_OUTLIER_SCORE         3.5
+#define BENCH_MAD_SCALE             0.6745
+
+// Student's t for 95% on both sides, by degrees of freedom.  past the
+// end of the table it's close enough to the normal's.
+static double t_95[] = {
+    12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+    2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+    2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042,
+};
+#define T_95_COUNT                  ((int)(sizeof(t_95)/sizeof(t_95[0])))
+#define T_95_NORMAL                 1.960
+
+LONGLONG get_bench_nanoseconds()
+{
+    static LARGE_INTEGER frequency;
+    static LONGLONG last;
+    LARGE_INTEGER count;
+
+    if (frequency.QuadPart == 0) {
+        QueryPerformanceFrequency(&frequency);
+    }
+    QueryPerformanceCounter(&count);
+
+    // in two parts so that the multiply doesn't overflow
+    LONGLONG seconds = count.QuadPart/frequency.QuadPart;
+    LONGLONG rest = count.QuadPart%frequency.QuadPart;
+    LONGLONG now = seconds*1000000000 + rest*1000000000/frequency.QuadPart;
+
+    // some multiprocessor boards have counters that don't quite agree
+    if (now < last) {
+        now = last;
+    }
+    last = now;
+
+    return now;
+}
+
+void get_default_bench_policy(BENCH_POLICY *policy)
+{
+    policy->warm_up_runs = 2;
+    policy->warm_up_ms = 100;
+    policy->minimum_samples = 10;
+    policy->maximum_samples = BENCH_MAXIMUM_SAMPLES;
+    policy->minimum_ms = 200;
+    policy->maximum_ms = 3000;
+    policy->relative_interval = 0.01;
+    policy->sample_ms = 1;
+    policy->cool_down_ms = 50;
+}
+
+static int
+compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+static double
+get_median(double *sorted, int count)
+{
+    return count % 2 == 1 ? sorted[count/2] :
+        (sorted[count/2 - 1] + sorted[count/2])/2;
+}
+
+// fills in "timing" from the first "count" of "sample", which are in
+// milliseconds per run.  "sorted" and "deviation" are room for as many.
+static void
+compute_bench_timing(double *sample, int count, double *sorted,
+        double *deviation, BENCH_TIMING *timing)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        sorted[i] = sample[i];
+    }
+    qsort(sorted, count, sizeof(sorted[0]), compare_doubles);
+
+    double median = get_median(sorted, count);
+
+    for (i = 0; i < count; i++) {
+        deviation[i] = fabs(sorted[i] - median);
+    }
+    qsort(deviation, count, sizeof(deviation[0]), compare_doubles);
+
+    double limit = BENCH_OUTLIER_SCORE*get_median(deviation, count)/
+        BENCH_MAD_SCALE;
+
+    // keep the ones near the median, which are together in "sorted"
+    int first = 0;
+    int last = count;
+    while (first < last && median - sorted[first] > limit) {
+        first++;
+    }
+    while (last > first && sorted[last - 1] - median > limit) {
+        last--;
+    }
+
+    double *kept = sorted + first;
+    int kept_count = last - first;
+    double total = 0;
+
+    for (i = 0; i < kept_count; i++) {
+        total += kept[i];
+    }
+    double mean = total/kept_count;
+
+    double squares = 0;
+    for (i = 0; i < kept_count; i++) {
+        squares += (kept[i] - mean)*(kept[i] - mean);
+    }
+
+    timing->samples = count;
+    timing->outliers = count - kept_count;
+    timing->min_ms = kept[0];
+    timing->median_ms = get_median(kept, kept_count);
+    timing->mean_ms = mean;
+    timing->p95_ms = kept[(int)ceil(kept_count*0.95) - 1];
+    timing->max_ms = kept[kept_count - 1];
+
+    if (kept_count < 2) {
+        timing->interval_ms = mean;
+    } else {
+        int freedom = kept_count - 1;
+        double t = freedom <= T_95_COUNT ? t_95[freedom - 1] : T_95_NORMAL;
+
+        timing->interval_ms = t*sqrt(squares/freedom/kept_count);
+    }
+}
+
+bool time_bench_function(BENCH_FUNCTION function, void *data,
+        BENCH_POLICY *policy, BENCH_TIMING *timing)
+{
+    BENCH_POLICY default_policy;
+    double sample[BENCH_MAXIMUM_SAMPLES];
+    double sorted[BENCH_MAXIMUM_SAMPLES];
+    double deviation[BENCH_MAXIMUM_SAMPLES];
+    int count = 0;
+    double total_ms = 0;
+    bool success = true;
+    int i;
+
+    if (policy == NULL) {
+        get_default_bench_policy(&default_policy);
+        policy = &default_policy;
+    }
+
+    int maximum_samples = policy->maximum_samples;
+    if (maximum_samples > BENCH_MAXIMUM_SAMPLES) {
+        maximum_samples = BENCH_MAXIMUM_SAMPLES;
+    }
+    int minimum_samples = policy->minimum_samples;
+    if (minimum_samples > maximum_samples) {
+        minimum_samples = maximum_samples;
+    }
+
+    // stay on one processor so the clock does too
+    HANDLE thread = GetCurrentThread();
+    DWORD process_mask, system_mask;
+    DWORD old_mask = 0;
+    if (GetProcessAffinityMask(GetCurrentProcess(), &process_mask,
+                &system_mask) && process_mask != 0) {
+
+        old_mask = SetThreadAffinityMask(thread,
+                process_mask & (~process_mask + 1));
+    }
+
+    // the warm-up also says how many runs make a sample
+    LONGLONG start = get_bench_nanoseconds();
+    LONGLONG elapsed = 0;
+    int warm_up_runs = 0;
+    while (warm_up_runs < policy->warm_up_runs ||
+            elapsed < policy->warm_up_ms*1000000) {
+
+        if (!function(data)) {
+            success = false;
+            goto done;
+        }
+        warm_up_runs++;
+        elapsed = get_bench_nanoseconds() - start;
+    }
+
+    timing->runs_per_sample = 1;
+    if (warm_up_runs > 0 && elapsed > 0) {
+        double run_ms = elapsed/1e6/warm_up_runs;
+
+        if (run_ms < policy->sample_ms) {
+            timing->runs_per_sample = (int)ceil(policy->sample_ms/run_ms);
+        }
+    }
+
+    timing->converged = false;
+    while (count < maximum_samples) {
+        start = get_bench_nanoseconds();
+        for (i = 0; i < timing->runs_per_sample; i++) {
+            if (!function(data)) {
+                success = false;
+                goto done;
+            }
+        }
+        elapsed = get_bench_nanoseconds() - start;
+
+        sample[count] = elapsed/1e6/timing->runs_per_sample;
+        total_ms += elapsed/1e6;
+        count++;
+
+        if (count < minimum_samples || total_ms < policy->minimum_ms) {
+            continue;
+        }
+
+        compute_bench_timing(sample, count, sorted, deviation, timing);
+        if (timing->interval_ms <=
+                policy->relative_interval*timing->mean_ms) {
+
+            timing->converged = true;
+            break;
+        }
+        if (total_ms >= policy->maximum_ms) {
+            break;
+        }
+    }
+
+    if (!timing->converged) {
+        compute_bench_timing(sample, count, sorted, deviation, timing);
+    }
+
+    if (policy->cool_down_ms > 0) {
+        Sleep((DWORD)policy->cool_down_ms);
+    }
+
+done:
+    if (old_mask != 0) {
+        SetThreadAffinityMask(thread, old_mask);
+    }
+
+    return success;
+}
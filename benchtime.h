@@ -0,0 +1,68 @@
+/*
+ * BenchTime.h
+ *
+ * The timing loop the benchmarks share: a nanosecond clock, a warm-up,
+ * samples until the confidence interval of the mean is narrow, outliers
+ * left out, and a rest before the next test.
+ *
+ */
+
+#ifndef __BENCHTIME_H__
+#define __BENCHTIME_H__
+
+
+#include <windows.h>
+
+// returns false if the run failed, which stops the timing
+typedef bool (*BENCH_FUNCTION)(void *data);
+
+struct BENCH_POLICY {
+    // untimed runs first, at least this many and this long
+    int warm_up_runs;
+    double warm_up_ms;
+
+    // the timed samples stop once there are at least the minimum number
+    // of them, they took at least the minimum time and the interval is
+    // narrow enough, or at either maximum
+    int minimum_samples;
+    int maximum_samples;
+    double minimum_ms;
+    double maximum_ms;
+
+    // narrow enough is this fraction of the mean on each side
+    double relative_interval;
+
+    // runs shorter than this are timed several to a sample, so that the
+    // clock's resolution and overhead don't matter
+    double sample_ms;
+
+    // a rest afterwards, so the next test doesn't start with this one's
+    // writes still going out or the processor hot
+    double cool_down_ms;
+};
+
+// all per run, over the samples that weren't outliers
+struct BENCH_TIMING {
+    int runs_per_sample;
+    int samples;            // all of them
+    int outliers;           // left out of the rest
+    double min_ms;
+    double median_ms;
+    double mean_ms;
+    double p95_ms;
+    double max_ms;
+    double interval_ms;     // half the width of the 95% interval of the mean
+    bool converged;         // narrow enough before the maximums
+};
+
+// from the performance counter, never goes backwards
+LONGLONG get_bench_nanoseconds();
+
+void get_default_bench_policy(BENCH_POLICY *policy);
+
+// "policy" can be NULL for the default.  returns false if a run failed.
+bool time_bench_function(BENCH_FUNCTION function, void *data,
+        BENCH_POLICY *policy, BENCH_TIMING *timing);
+
+
+#endif /* __BENCHTIME_H__ */
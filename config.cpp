@@ -18,12 +18,17 @@
 #include "resource.h"
 #include "geteventname.h"
 #include "key.h"
+#include "scaletile.h"
 
 #define REGISTRY_KEY                "Control Panel\\Screen Saver.Jessu"
 #define REGISTRY_DIR_VALUE          "ImageDirectory"
 #define REGISTRY_REGKEY_VALUE       "RegistrationKey"
 #define REGISTRY_LESSMEM_VALUE      "UseLessMemory"
 #define REGISTRY_SHOWNAME_VALUE     "ShowFilenames"
+#define REGISTRY_FASTSTART_VALUE    "FastStart"
+#define REGISTRY_FILTER_VALUE       "ScaleFilter"
+#define REGISTRY_LINEAR_VALUE       "LinearLight"
+#define REGISTRY_COMPRESS_VALUE     "CompressTextures"
 #define REGISTRY_INSTALLDIR_VALUE   "InstallDir"
 
 #define DEFAULT_DIR                 "C:\\My Documents"
@@ -241,6 +246,36 @@ get_show_filenames()
     return get_int(REGISTRY_SHOWNAME_VALUE, 0) != 0;
 }
 
+bool
+get_fast_start()
+{
+    return get_int(REGISTRY_FASTSTART_VALUE, 1) != 0;
+}
+
+int
+get_scale_filter()
+{
+    int filter = get_int(REGISTRY_FILTER_VALUE, SCALE_FILTER_LANCZOS3);
+
+    if (filter < 0 || filter >= SCALE_FILTER_COUNT) {
+        filter = SCALE_FILTER_LANCZOS3;
+    }
+
+    return filter;
+}
+
+bool
+get_linear_light()
+{
+    return get_int(REGISTRY_LINEAR_VALUE, 0) != 0;
+}
+
+bool
+get_compress_textures()
+{
+    return get_int(REGISTRY_COMPRESS_VALUE, 0) != 0;
+}
+
 static void
 set_pictures_directory(char *dir)
 {
@@ -265,6 +300,30 @@ set_show_filenames(int show_filenames)
     set_int(REGISTRY_SHOWNAME_VALUE, show_filenames);
 }
 
+static void
+set_fast_start(int fast_start)
+{
+    set_int(REGISTRY_FASTSTART_VALUE, fast_start);
+}
+
+static void
+set_scale_filter_setting(int filter)
+{
+    set_int(REGISTRY_FILTER_VALUE, filter);
+}
+
+static void
+set_linear_light_setting(int linear)
+{
+    set_int(REGISTRY_LINEAR_VALUE, linear);
+}
+
+static void
+set_compress_textures_setting(int compress)
+{
+    set_int(REGISTRY_COMPRESS_VALUE, compress);
+}
+
 bool
 is_registered(void)
 {
@@ -355,6 +414,7 @@ DlgProc(HWND hDlg, UINT message, WPARAM wParam, LPARAM /* lParam */)
     char cur_folder[MAX_PATH];
     char key[MAX_KEY_LENGTH];
     int result;
+    int i;
 
 #if 0
     fprintf(debug_output, "DlgProc: dlg %x message \"%s\"\n", hDlg,
@@ -367,6 +427,16 @@ DlgProc(HWND hDlg, UINT message, WPARAM wParam, LPARAM /* lParam */)
             SetDlgItemText(hDlg, IDC_KEY, get_key());
             CheckDlgButton(hDlg, IDC_LESS_MEMORY, get_less_memory());
             CheckDlgButton(hDlg, IDC_SHOW_FILENAMES, get_show_filenames());
+            CheckDlgButton(hDlg, IDC_FAST_START, get_fast_start());
+            CheckDlgButton(hDlg, IDC_LINEAR_LIGHT, get_linear_light());
+            CheckDlgButton(hDlg, IDC_COMPRESS_TEXTURES,
+                    get_compress_textures());
+            for (i = 0; i < SCALE_FILTER_COUNT; i++) {
+                SendDlgItemMessage(hDlg, IDC_SCALE_FILTER, CB_ADDSTRING, 0,
+                        (LPARAM)get_scale_filter_name(i));
+            }
+            SendDlgItemMessage(hDlg, IDC_SCALE_FILTER, CB_SETCURSEL,
+                    get_scale_filter(), 0);
             break;
 
         case WM_COMMAND:
@@ -396,6 +466,16 @@ DlgProc(HWND hDlg, UINT message, WPARAM wParam, LPARAM /* lParam */)
                                 IsDlgButtonChecked(hDlg, IDC_LESS_MEMORY));
                         set_show_filenames(
                                 IsDlgButtonChecked(hDlg, IDC_SHOW_FILENAMES));
+                        set_fast_start(
+                                IsDlgButtonChecked(hDlg, IDC_FAST_START));
+                        set_linear_light_setting(
+                                IsDlgButtonChecked(hDlg, IDC_LINEAR_LIGHT));
+                        set_compress_textures_setting(
+                                IsDlgButtonChecked(hDlg,
+                                    IDC_COMPRESS_TEXTURES));
+                        set_scale_filter_setting(
+                                SendDlgItemMessage(hDlg, IDC_SCALE_FILTER,
+                                    CB_GETCURSEL, 0, 0));
                         EndDialog(hDlg, IDC_OK);
                     }
                     break;
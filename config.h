@@ -34,5 +34,9 @@ char *get_pictures_directory(void);
 bool is_registered(void);
 int get_less_memory();
 bool get_show_filenames();
+bool get_fast_start();
+int get_scale_filter();
+bool get_linear_light();
+bool get_compress_textures();
 
 #endif /* __CONFIG_H__ */
@@ -0,0 +1,32 @@
+/*
+ * Cpu.cpp
+ *
+ * Asks Windows about the processor once and remembers.  Threads that
+ * ask at the same time the first time get the same answer, so there's no
+ * lock.
+ *
+ */
+
+#include <windows.h>
+
+#include "cpu.h"
+
+static bool checked = false;
+static bool sse2 = false;
+static bool sse2_allowed = true;
+
+bool has_sse2()
+{
+    if (!checked) {
+        sse2 = IsProcessorFeaturePresent(PF_XMMI64_INSTRUCTIONS_AVAILABLE)
+            != 0;
+        checked = true;
+    }
+
+    return sse2 && sse2_allowed;
+}
+
+void set_sse2_allowed(bool allowed)
+{
+    sse2_allowed = allowed;
+}
@@ -0,0 +1,37 @@
+/*
+ * Cpu.h
+ *
+ * What the processor can do, for the code that has faster versions of
+ * its inner loops.
+ *
+ */
+
+#ifndef __CPU_H__
+#define __CPU_H__
+
+
+#include <windows.h>
+
+// use SSE2 for the scaling, the mipmaps, the texel formats and the
+// software drawing when the processor has it
+#define USE_SSE2                    1
+
+#if USE_SSE2
+#include <emmintrin.h>
+#endif
+
+// the processor feature isn't in older SDK headers
+#ifndef PF_XMMI64_INSTRUCTIONS_AVAILABLE
+#define PF_XMMI64_INSTRUCTIONS_AVAILABLE    10
+#endif
+
+// whether to use SSE2: the processor has it and it hasn't been turned
+// off.  only asks Windows the first time.
+bool has_sse2();
+
+// false for the plain versions everywhere, to check the SSE2 ones against.
+// only while nothing else is scaling or drawing.
+void set_sse2_allowed(bool allowed);
+
+
+#endif /* __CPU_H__ */
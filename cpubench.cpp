@@ -0,0 +1,680 @@
+/*
+ * CpuBench.cpp
+ *
+ * Times the processor's share of showing a picture: decoding the JPEG,
+ * scaling rows, the vertical scaler (with the mipmaps), making the
+ * contribution tables, scanning a directory and loading a whole picture
+ * the way the workers do.  The pictures are made up, a few sizes of
+ * gradients, fine stripes and noise written as JPEGs to a temporary
+ * folder, so every machine times the same thing.  Run with
+ * "/cpubench f" to write the results to "f" as JSON.
+ *
+ */
+
+#include <windows.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "cpubench.h"
+#include "benchtime.h"
+#include "fileread.h"
+#include "scaletile.h"
+#include "loaddir.h"
+#include "exif.h"
+#include "jessu.h"
+#include "cpu.h"
+#include "softrender.h"
+
+extern "C" {
+#include "jpeglib.h"
+}
+
+// bump when the tests or their output change, so that results from
+// different versions aren't compared
+#define CPUBENCH_VERSION            4
+
+// the same as the full-screen textures
+#define CPUBENCH_TEXTURE_SIZE       1024
+#define CPUBENCH_MAXIMUM_TILE_SIZE  4096
+
+#define CPUBENCH_JPEG_QUALITY       90
+
+// the frame the software drawing is checked in
+#define CPUBENCH_FRAME_WIDTH        640
+#define CPUBENCH_FRAME_HEIGHT       480
+
+// the folders and files for the directory scan, half of them pictures
+#define CPUBENCH_SCAN_FOLDERS       20
+#define CPUBENCH_SCAN_FILES         200
+
+// VGA, two megapixels and an eight-megapixel camera
+static int image_size[][2] = {
+    { 640, 480 },
+    { 1600, 1200 },
+    { 3264, 2448 },
+};
+#define CPUBENCH_IMAGE_COUNT \
+    ((int)(sizeof(image_size)/sizeof(image_size[0])))
+
+struct CPUBENCH_IMAGE {
+    char filename[MAX_PATH];
+    int width;
+    int height;
+
+    TILE_LAYOUT layout;
+    unsigned char **tile;
+
+    // what the vertical scaler wants for this picture
+    int row_size;
+    int row_tile_size;
+    CLIST *clist;
+    unsigned char *padded_row;
+    unsigned char *row;             // inside "padded_row"
+
+    // what goes in "row" before each scale_row(), which box-filters it
+    // in place
+    unsigned char *source_row;
+    unsigned char *scaled_row;
+    int scaled_row_bytes;
+};
+
+typedef void (*CPUBENCH_TEST)(CPUBENCH_IMAGE *image);
+
+struct CPUBENCH_RUN {
+    CPUBENCH_TEST test;
+    CPUBENCH_IMAGE *image;
+};
+
+static bool first_result;
+static bool first_check;
+
+// a gradient in red and green, a fine pattern in blue and noise in all
+// three, so that it has both smooth and sharp parts and compresses
+// about like a photograph
+static void
+make_synthetic_row(unsigned char *row, int width, int height, int y)
+{
+    unsigned int random = y*2654435761u + 1;
+
+    for (int x = 0; x < width; x++) {
+        random = random*1103515245 + 12345;
+        int noise = (int)((random >> 16) & 15) - 8;
+        int red = x*255/width + noise;
+        int green = y*255/height + noise;
+        int blue = ((x ^ y) & 0x1f)*8 + noise;
+
+        row[x*3 + 0] = (unsigned char)(red < 0 ? 0 : red > 255 ? 255 : red);
+        row[x*3 + 1] = (unsigned char)
+            (green < 0 ? 0 : green > 255 ? 255 : green);
+        row[x*3 + 2] = (unsigned char)
+            (blue < 0 ? 0 : blue > 255 ? 255 : blue);
+    }
+}
+
+static bool
+write_synthetic_jpeg(char *filename, int width, int height)
+{
+    struct jpeg_compress_struct ccinfo;
+    struct jpeg_error_mgr jerr;
+    JSAMPROW row_pointer[1];
+
+    FILE *fp = fopen(filename, "wb");
+    if (fp == NULL) {
+        jessu_printf(THREAD_GL, "Can't write \"%s\" (%s)", filename,
+                jessu_strerror());
+        return false;
+    }
+
+    unsigned char *row = (unsigned char *)jessu_malloc(THREAD_GL,
+            width*3, "cpubench jpeg row");
+    row_pointer[0] = row;
+
+    ccinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&ccinfo);
+    jpeg_stdio_dest(&ccinfo, fp);
+
+    ccinfo.image_width = width;
+    ccinfo.image_height = height;
+    ccinfo.input_components = 3;
+    ccinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&ccinfo);
+    jpeg_set_quality(&ccinfo, CPUBENCH_JPEG_QUALITY, TRUE);
+
+    jpeg_start_compress(&ccinfo, TRUE);
+    for (int y = 0; y < height; y++) {
+        make_synthetic_row(row, width, height, y);
+        jpeg_write_scanlines(&ccinfo, row_pointer, 1);
+    }
+    jpeg_finish_compress(&ccinfo);
+    jpeg_destroy_compress(&ccinfo);
+
+    jessu_free(THREAD_GL, row, "cpubench jpeg row");
+    fclose(fp);
+
+    return true;
+}
+
+static bool
+run_cpubench_test(void *data)
+{
+    CPUBENCH_RUN *run = (CPUBENCH_RUN *)data;
+
+    run->test(run->image);
+
+    return true;
+}
+
+// times "test" and writes a line of JSON about it.  "units" is how many
+// of "unit_name" one run does, for the throughput.  "overhead", if not
+// NULL, does the part of "test" that isn't being measured, and its times
+// are taken off.
+static void
+run_test(FILE *out, char *name, CPUBENCH_IMAGE *image, CPUBENCH_TEST test,
+        double units, char *unit_name, CPUBENCH_TEST overhead)
+{
+    CPUBENCH_RUN run;
+    BENCH_TIMING timing;
+    double overhead_ms = 0;
+
+    run.test = test;
+    run.image = image;
+    time_bench_function(run_cpubench_test, &run, NULL, &timing);
+
+    if (overhead != NULL) {
+        BENCH_TIMING overhead_timing;
+
+        run.test = overhead;
+        time_bench_function(run_cpubench_test, &run, NULL, &overhead_timing);
+        overhead_ms = overhead_timing.median_ms;
+
+        timing.min_ms -= overhead_ms;
+        timing.median_ms -= overhead_ms;
+        timing.mean_ms -= overhead_ms;
+        timing.p95_ms -= overhead_ms;
+    }
+
+    double median = timing.median_ms;
+
+    fprintf(out, "%s    {\"name\": \"%s\", \"width\": %d, \"height\": %d, "
+            "\"samples\": %d, \"runs_per_sample\": %d, \"outliers\": %d, "
+            "\"min_ms\": %.4f, \"median_ms\": %.4f, \"mean_ms\": %.4f, "
+            "\"p95_ms\": %.4f, \"interval_ms\": %.4f, "
+            "\"overhead_ms\": %.4f, "
+            "\"converged\": %s, \"throughput\": %.2f, "
+            "\"throughput_unit\": \"%s per second\"}",
+            first_result ? "" : ",\n", name,
+            image == NULL ? 0 : image->width,
+            image == NULL ? 0 : image->height,
+            timing.samples, timing.runs_per_sample, timing.outliers,
+            timing.min_ms, median, timing.mean_ms, timing.p95_ms,
+            timing.interval_ms, overhead_ms,
+            timing.converged ? "true" : "false",
+            median > 0 ? units*1000/median : 0, unit_name);
+    first_result = false;
+
+    jessu_printf(THREAD_GL, "cpubench %s %dx%d: median %.3f ms, p95 %.3f ms",
+            name, image == NULL ? 0 : image->width,
+            image == NULL ? 0 : image->height, median, timing.p95_ms);
+}
+
+// just the library, into one row
+static void
+test_jpeg_decode(CPUBENCH_IMAGE *image)
+{
+    struct jpeg_decompress_struct dcinfo;
+    struct jpeg_error_mgr jerr;
+    JSAMPROW row_pointer[1];
+
+    FILE *fp = fopen(image->filename, "rb");
+    if (fp == NULL) {
+        return;
+    }
+
+    dcinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_decompress(&dcinfo);
+    jpeg_stdio_src(&dcinfo, fp);
+    jpeg_read_header(&dcinfo, TRUE);
+    jpeg_start_decompress(&dcinfo);
+
+    row_pointer[0] = image->row;
+    while (dcinfo.output_scanline < dcinfo.output_height) {
+        jpeg_read_scanlines(&dcinfo, row_pointer, 1);
+    }
+
+    jpeg_finish_decompress(&dcinfo);
+    jpeg_destroy_decompress(&dcinfo);
+    fclose(fp);
+}
+
+// the same row each time, as many times as the picture has rows
+static void
+test_scale_row(CPUBENCH_IMAGE *image)
+{
+    for (int y = 0; y < image->height; y++) {
+        memcpy(image->row, image->source_row, image->width*BYTES_PER_PIXEL);
+        scale_row(image->clist, image->row, image->scaled_row,
+                image->row_size);
+    }
+}
+
+// the copies test_scale_row() makes, which are taken off its times
+static void
+test_copy_row(CPUBENCH_IMAGE *image)
+{
+    for (int y = 0; y < image->height; y++) {
+        memcpy(image->row, image->source_row, image->width*BYTES_PER_PIXEL);
+    }
+}
+
+static void
+test_contrib_table(CPUBENCH_IMAGE *image)
+{
+    free_scale_row_data(make_scale_row_data(image->width, image->row_size,
+                image->row_tile_size));
+}
+
+// rows that are already scaled across, through to the mip chains
+static void
+test_vertical_scaler(CPUBENCH_IMAGE *image)
+{
+    Vertical_scaler vertical_scaler;
+
+    vertical_scaler.Set_destination_parameters(image->tile, &image->layout);
+    vertical_scaler.Set_mipmaps(true);
+    vertical_scaler.Set_source_parameters(image->width, image->height,
+            ORIENTATION_TOP_LEFT);
+
+    for (int y = 0; y < image->height; y++) {
+        memcpy(vertical_scaler.Get_row_buffer(y), image->scaled_row,
+                image->scaled_row_bytes);
+        vertical_scaler.Process_row(y);
+    }
+}
+
+// the same as a worker's load, from opening the file to the mip chains
+static void
+test_load_picture(CPUBENCH_IMAGE *image)
+{
+    Vertical_scaler vertical_scaler;
+    int width, height;
+
+    vertical_scaler.Set_destination_parameters(image->tile, &image->layout);
+    vertical_scaler.Set_mipmaps(true);
+
+    FILE *fp = fopen(image->filename, "rb");
+    if (fp == NULL) {
+        return;
+    }
+
+    read_image(image->filename, fp, vertical_scaler, &width, &height, NULL,
+            STRIP_THREADS_ALL);
+    fclose(fp);
+}
+
+static char scan_folder[MAX_PATH];
+
+static void
+test_directory_scan(CPUBENCH_IMAGE *)
+{
+    scan_directory(scan_folder);
+}
+
+// a tree of empty files, half of them pictures, under "scan_folder"
+static void
+make_scan_tree(bool remove)
+{
+    char path[MAX_PATH];
+
+    if (!remove) {
+        CreateDirectory(scan_folder, NULL);
+    }
+
+    for (int i = 0; i < CPUBENCH_SCAN_FOLDERS; i++) {
+        char folder[MAX_PATH];
+
+        _snprintf(folder, sizeof(folder), "%s\\%02d", scan_folder, i);
+        if (!remove) {
+            CreateDirectory(folder, NULL);
+        }
+
+        for (int j = 0; j < CPUBENCH_SCAN_FILES; j++) {
+            _snprintf(path, sizeof(path), "%s\\%04d.%s", folder, j,
+                    j % 2 == 0 ? "jpg" : "txt");
+
+            if (remove) {
+                DeleteFile(path);
+            } else {
+                FILE *fp = fopen(path, "wb");
+                if (fp != NULL) {
+                    fclose(fp);
+                }
+            }
+        }
+
+        if (remove) {
+            RemoveDirectory(folder);
+        }
+    }
+
+    if (remove) {
+        RemoveDirectory(scan_folder);
+    }
+}
+
+static unsigned char **
+allocate_tile_set(TILE_LAYOUT *layout)
+{
+    unsigned char **tile = (unsigned char **)jessu_malloc(THREAD_GL,
+            layout->tile_count*sizeof(unsigned char *),
+            "cpubench tile pointers");
+
+    for (int j = 0; j < layout->tile_count; j++) {
+        tile[j] = (unsigned char *)jessu_malloc(THREAD_GL,
+                get_mipmap_bytes(layout->tile_size_x, layout->tile_size_y),
+                "cpubench tile data");
+    }
+
+    return tile;
+}
+
+static void
+free_tile_set(TILE_LAYOUT *layout, unsigned char **tile)
+{
+    for (int j = 0; j < layout->tile_count; j++) {
+        jessu_free(THREAD_GL, tile[j], "cpubench tile data");
+    }
+    jessu_free(THREAD_GL, tile, "cpubench tile pointers");
+}
+
+// whether the first "bytes" of each tile are the same in both sets
+static bool
+tiles_match(TILE_LAYOUT *layout, unsigned char **a, unsigned char **b,
+        int bytes)
+{
+    for (int j = 0; j < layout->tile_count; j++) {
+        if (memcmp(a[j], b[j], bytes) != 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void
+copy_tiles(TILE_LAYOUT *layout, unsigned char **dst, unsigned char **src)
+{
+    int bytes = get_mipmap_bytes(layout->tile_size_x, layout->tile_size_y);
+
+    for (int j = 0; j < layout->tile_count; j++) {
+        memcpy(dst[j], src[j], bytes);
+    }
+}
+
+static void
+write_check(FILE *out, char *name, CPUBENCH_IMAGE *image, bool same)
+{
+    fprintf(out, "%s    {\"name\": \"%s\", \"width\": %d, \"height\": %d, "
+            "\"same\": %s}", first_check ? "" : ",\n", name, image->width,
+            image->height, same ? "true" : "false");
+    first_check = false;
+
+    if (!same) {
+        jessu_printf(THREAD_GL, "cpubench %s %dx%d: SSE2 and plain C differ",
+                name, image->width, image->height);
+    }
+}
+
+// loads the picture into "tile", as a worker does
+static void
+load_tiles(CPUBENCH_IMAGE *image, unsigned char **tile)
+{
+    Vertical_scaler vertical_scaler;
+    int width, height;
+
+    vertical_scaler.Set_destination_parameters(tile, &image->layout);
+    vertical_scaler.Set_mipmaps(true);
+
+    FILE *fp = fopen(image->filename, "rb");
+    if (fp == NULL) {
+        return;
+    }
+
+    read_image(image->filename, fp, vertical_scaler, &width, &height, NULL,
+            STRIP_THREADS_ALL);
+    fclose(fp);
+}
+
+static void
+draw_tiles(CPUBENCH_IMAGE *image, unsigned char **tile, SOFT_FRAME *frame)
+{
+    clear_soft_frame(frame);
+
+    // a bit off the middle and part way through a dissolve, so that the
+    // sampling and blending both have something to do
+    draw_soft_slide(frame, tile, &image->layout, 0.45, 0.55, 1.1,
+            (double)image->width/image->height, 0.7);
+}
+
+// does everything with an SSE2 version both ways and checks that the
+// bytes are the same: the scaling in sRGB and in linear light, the
+// mipmaps, each texel format and the software drawing
+static void
+check_sse2(FILE *out, CPUBENCH_IMAGE *image)
+{
+    TILE_LAYOUT *layout = &image->layout;
+    unsigned char **sse2_tile = allocate_tile_set(layout);
+    unsigned char **plain_tile = allocate_tile_set(layout);
+    int mipmap_bytes = get_mipmap_bytes(layout->tile_size_x,
+            layout->tile_size_y);
+    int levels = get_mipmap_level_count(layout->tile_size_x,
+            layout->tile_size_y);
+    int format;
+    int linear;
+
+    for (linear = 0; linear < 2; linear++) {
+        set_linear_light(linear != 0);
+
+        set_sse2_allowed(true);
+        load_tiles(image, sse2_tile);
+        set_sse2_allowed(false);
+        load_tiles(image, plain_tile);
+
+        write_check(out, linear ? "linear_load_picture" : "load_picture",
+                image, tiles_match(layout, sse2_tile, plain_tile,
+                    mipmap_bytes));
+    }
+    set_linear_light(false);
+
+    // drawn from the same tiles both ways
+    SOFT_FRAME sse2_frame = { 0, 0, NULL };
+    SOFT_FRAME plain_frame = { 0, 0, NULL };
+
+    if (set_soft_frame_size(&sse2_frame, CPUBENCH_FRAME_WIDTH,
+                CPUBENCH_FRAME_HEIGHT) &&
+            set_soft_frame_size(&plain_frame, CPUBENCH_FRAME_WIDTH,
+                CPUBENCH_FRAME_HEIGHT)) {
+
+        set_sse2_allowed(true);
+        draw_tiles(image, sse2_tile, &sse2_frame);
+        set_sse2_allowed(false);
+        draw_tiles(image, sse2_tile, &plain_frame);
+        write_check(out, "draw_soft_slide", image,
+                memcmp(sse2_frame.pixels, plain_frame.pixels,
+                    CPUBENCH_FRAME_WIDTH*CPUBENCH_FRAME_HEIGHT*
+                    BYTES_PER_TEXEL) == 0);
+    }
+    free_soft_frame(&sse2_frame);
+    free_soft_frame(&plain_frame);
+
+    // the texel formats are made in place, so each starts from a copy
+    for (format = TEXEL_FORMAT_A1R5G5B5; format <= TEXEL_FORMAT_DXT1;
+            format++) {
+
+        static char *format_name[] = {
+            NULL, "a1r5g5b5", "r5g6b5", "dxt1",
+        };
+        int j;
+
+        set_sse2_allowed(true);
+        load_tiles(image, image->tile);
+        copy_tiles(layout, sse2_tile, image->tile);
+        for (j = 0; j < layout->tile_count; j++) {
+            convert_texel_format(format, sse2_tile[j], layout->tile_size_x,
+                    layout->tile_size_y, levels);
+        }
+
+        set_sse2_allowed(false);
+        copy_tiles(layout, plain_tile, image->tile);
+        for (j = 0; j < layout->tile_count; j++) {
+            convert_texel_format(format, plain_tile[j], layout->tile_size_x,
+                    layout->tile_size_y, levels);
+        }
+
+        write_check(out, format_name[format], image,
+                tiles_match(layout, sse2_tile, plain_tile,
+                    get_texel_format_mipmap_bytes(format,
+                        layout->tile_size_x, layout->tile_size_y, levels)));
+    }
+
+    set_sse2_allowed(true);
+    free_tile_set(layout, sse2_tile);
+    free_tile_set(layout, plain_tile);
+}
+
+static bool
+set_up_image(CPUBENCH_IMAGE *image, char *folder, int width, int height)
+{
+    image->width = width;
+    image->height = height;
+    _snprintf(image->filename, sizeof(image->filename),
+            "%s\\synthetic_%dx%d.jpg", folder, width, height);
+
+    if (!write_synthetic_jpeg(image->filename, width, height)) {
+        return false;
+    }
+
+    make_tile_layout(&image->layout,
+            CPUBENCH_TEXTURE_SIZE, CPUBENCH_TEXTURE_SIZE,
+            CPUBENCH_MAXIMUM_TILE_SIZE, CPUBENCH_MAXIMUM_TILE_SIZE);
+
+    image->tile = allocate_tile_set(&image->layout);
+
+    // the row sizes come from the scaler, as when loading
+    Vertical_scaler vertical_scaler;
+
+    vertical_scaler.Set_destination_parameters(image->tile, &image->layout);
+    vertical_scaler.Set_source_parameters(width, height,
+            ORIENTATION_TOP_LEFT);
+    image->row_size = vertical_scaler.m_row_size;
+    image->row_tile_size = vertical_scaler.m_row_tile_size;
+
+    image->clist = get_scale_row_data(width, image->row_size,
+            image->row_tile_size);
+
+    int padding = get_scale_row_padding(image->clist);
+    image->padded_row = (unsigned char *)jessu_malloc(THREAD_GL,
+            (width + padding*2)*BYTES_PER_PIXEL, "cpubench row");
+    image->row = image->padded_row + padding*BYTES_PER_PIXEL;
+    image->source_row = (unsigned char *)jessu_malloc(THREAD_GL,
+            width*BYTES_PER_PIXEL, "cpubench source row");
+    make_synthetic_row(image->source_row, width, height, height/2);
+    memcpy(image->row, image->source_row, width*BYTES_PER_PIXEL);
+
+    image->scaled_row_bytes = image->row_size*
+        get_scale_row_pixel_bytes(image->clist);
+    image->scaled_row = (unsigned char *)jessu_malloc(THREAD_GL,
+            image->scaled_row_bytes, "cpubench scaled row");
+    scale_row(image->clist, image->row, image->scaled_row, image->row_size);
+
+    return true;
+}
+
+static void
+free_image(CPUBENCH_IMAGE *image)
+{
+    free_tile_set(&image->layout, image->tile);
+    jessu_free(THREAD_GL, image->padded_row, "cpubench row");
+    jessu_free(THREAD_GL, image->source_row, "cpubench source row");
+    jessu_free(THREAD_GL, image->scaled_row, "cpubench scaled row");
+    release_scale_row_data(image->clist);
+
+    DeleteFile(image->filename);
+}
+
+void
+bench_cpu_pipeline(FILE *out)
+{
+    char folder[MAX_PATH];
+    SYSTEM_INFO system_info;
+    bool check = has_sse2();
+
+    GetTempPath(sizeof(folder), folder);
+    strncat(folder, "jessu_cpubench", sizeof(folder) - strlen(folder) - 1);
+    CreateDirectory(folder, NULL);
+
+    GetSystemInfo(&system_info);
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"version\": %d,\n", CPUBENCH_VERSION);
+    fprintf(out, "  \"processors\": %d,\n",
+            (int)system_info.dwNumberOfProcessors);
+    fprintf(out, "  \"sse2\": %s,\n",
+            has_sse2() ? "true" : "false");
+    fprintf(out, "  \"texture_size\": %d,\n", CPUBENCH_TEXTURE_SIZE);
+    fprintf(out, "  \"results\": [\n");
+    first_result = true;
+
+    int i;
+    for (i = 0; i < CPUBENCH_IMAGE_COUNT; i++) {
+        CPUBENCH_IMAGE image;
+        double megapixels = image_size[i][0]*image_size[i][1]/1e6;
+
+        if (!set_up_image(&image, folder,
+                    image_size[i][0], image_size[i][1])) {
+
+            continue;
+        }
+
+        run_test(out, "jpeg_decode", &image, test_jpeg_decode,
+                megapixels, "megapixels", NULL);
+        run_test(out, "scale_row", &image, test_scale_row,
+                image.height, "rows", test_copy_row);
+        run_test(out, "contrib_table", &image, test_contrib_table,
+                1, "tables", NULL);
+        run_test(out, "vertical_scaler", &image, test_vertical_scaler,
+                megapixels, "megapixels", NULL);
+        run_test(out, "load_picture", &image, test_load_picture,
+                megapixels, "megapixels", NULL);
+
+        free_image(&image);
+    }
+
+    _snprintf(scan_folder, sizeof(scan_folder), "%s\\scan", folder);
+    make_scan_tree(false);
+    run_test(out, "directory_scan", NULL, test_directory_scan,
+            CPUBENCH_SCAN_FOLDERS*CPUBENCH_SCAN_FILES, "files", NULL);
+    make_scan_tree(true);
+
+    fprintf(out, "\n  ],\n");
+
+    // without SSE2 there's nothing to compare
+    fprintf(out, "  \"sse2_checks\": [\n");
+    first_check = true;
+
+    for (i = 0; check && i < CPUBENCH_IMAGE_COUNT; i++) {
+        CPUBENCH_IMAGE image;
+
+        if (!set_up_image(&image, folder,
+                    image_size[i][0], image_size[i][1])) {
+
+            continue;
+        }
+
+        check_sse2(out, &image);
+        free_image(&image);
+    }
+
+    fprintf(out, "\n  ]\n}\n");
+
+    RemoveDirectory(folder);
+}
@@ -0,0 +1,23 @@
+/*
+ * CpuBench.h
+ *
+ * Times the parts of loading a picture that run on the processor, on
+ * pictures it makes up, for comparing builds.
+ *
+ */
+
+#ifndef __CPUBENCH_H__
+#define __CPUBENCH_H__
+
+
+#include <stdio.h>
+
+// writes the median and 95th percentile times of JPEG decoding, row
+// scaling, the vertical scaler, contribution tables, the directory scan
+// and whole loads to "out" as JSON, along with whether the SSE2 versions
+// of the scaling, mipmaps, texel formats and software drawing give the
+// same bytes as the plain ones
+void bench_cpu_pipeline(FILE *out);
+
+
+#endif /* __CPUBENCH_H__ */
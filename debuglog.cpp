@@ -0,0 +1,223 @@
+/*
+ * DebugLog.cpp
+ *
+ * The lines go through a fixed ring of slots, the bounded queue of
+ * Dmitry Vyukov: each slot has a sequence number that says whether it's
+ * free for the producer at that position or full for the consumer, so
+ * any number of threads can add lines with one InterlockedCompareExchange()
+ * and no lock.  The writer thread wakes up every so often, or sooner when
+ * the queue gets half full, and writes and flushes whatever is there.
+ * When the queue is full a line is dropped rather than waiting, and the
+ * writer says how many were.
+ *
+ * Stopping first turns new lines away from the queue, so that they're
+ * written straight out as before the start, then waits for the threads
+ * still putting one in before the last drain.  Otherwise a line added
+ * just as the writer quit would sit in the queue for good.
+ *
+ */
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debuglog.h"
+
+// slots in the queue, a power of two.  this is all the memory it uses.
+#define DEBUG_LOG_SLOTS             1024
+
+// how long lines can wait before the writer gets to them
+#define DEBUG_LOG_WRITE_MILLISECONDS    100
+
+struct DEBUG_LOG_SLOT {
+    // the position this slot is free for, or one past the one it's full
+    // for
+    volatile LONG sequence;
+    char line[DEBUG_LINE_LENGTH];
+};
+
+static DEBUG_LOG_SLOT slot[DEBUG_LOG_SLOTS];
+static volatile LONG enqueue_position;
+static volatile LONG dequeue_position;     // only the writer changes it
+static volatile LONG dropped_lines;
+
+static FILE *output = stdout;     // until there's a file
+static HANDLE writer_thread = NULL;
+static HANDLE wake_writer = NULL;
+static volatile LONG writer_should_quit;
+static volatile LONG accepting_lines;      // the queue takes new lines
+static volatile LONG adding_lines;         // threads in add_debug_line()
+
+// writes the lines in the queue
+static void
+write_debug_lines()
+{
+    bool wrote = false;
+
+    for (;;) {
+        LONG position = dequeue_position;
+        DEBUG_LOG_SLOT *s = &slot[position & (DEBUG_LOG_SLOTS - 1)];
+
+        if (s->sequence != position + 1) {
+            // empty, or a producer hasn't finished the line
+            break;
+        }
+
+        fprintf(output, "%s\n", s->line);
+        wrote = true;
+
+        // free for the producer a lap later
+        dequeue_position = position + 1;
+        InterlockedExchange((LONG *)&s->sequence,
+                position + DEBUG_LOG_SLOTS);
+    }
+
+    LONG dropped = InterlockedExchange((LONG *)&dropped_lines, 0);
+    if (dropped != 0) {
+        fprintf(output, "------- %ld lines dropped\n", dropped);
+        wrote = true;
+    }
+
+    if (wrote) {
+        fflush(output);
+    }
+}
+
+static unsigned long __stdcall
+debug_log_thread(void * /* params */)
+{
+    while (!writer_should_quit) {
+        WaitForSingleObject(wake_writer, DEBUG_LOG_WRITE_MILLISECONDS);
+        write_debug_lines();
+    }
+
+    // whatever came in while we were quitting
+    write_debug_lines();
+
+    return 0;
+}
+
+static void
+stop_debug_log_at_exit()
+{
+    stop_debug_log();
+}
+
+void start_debug_log(FILE *out)
+{
+    DWORD thread_id;
+    int i;
+
+    output = out;
+
+    if (writer_thread != NULL) {
+        return;
+    }
+
+    for (i = 0; i < DEBUG_LOG_SLOTS; i++) {
+        slot[i].sequence = i;
+    }
+    enqueue_position = 0;
+    dequeue_position = 0;
+    dropped_lines = 0;
+    writer_should_quit = 0;
+
+    wake_writer = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (wake_writer == NULL) {
+        return;
+    }
+
+    writer_thread = CreateThread(NULL, 0, debug_log_thread, NULL, 0,
+            &thread_id);
+    if (writer_thread == NULL) {
+        CloseHandle(wake_writer);
+        wake_writer = NULL;
+        return;
+    }
+
+    InterlockedExchange((LONG *)&accepting_lines, 1);
+
+    atexit(stop_debug_log_at_exit);
+}
+
+void stop_debug_log()
+{
+    if (writer_thread != NULL) {
+        // new lines go straight to the file, and the ones on their way
+        // into the queue get there before the writer's last look
+        InterlockedExchange((LONG *)&accepting_lines, 0);
+        while (adding_lines != 0) {
+            Sleep(0);
+        }
+
+        InterlockedExchange((LONG *)&writer_should_quit, 1);
+        SetEvent(wake_writer);
+        WaitForSingleObject(writer_thread, INFINITE);
+
+        CloseHandle(writer_thread);
+        CloseHandle(wake_writer);
+        writer_thread = NULL;
+        wake_writer = NULL;
+    }
+
+    // it's about to be closed
+    output = stdout;
+}
+
+static void
+write_debug_line_now(char *line)
+{
+    fprintf(output, "%s\n", line);
+    fflush(output);
+}
+
+void add_debug_line(char *line)
+{
+    // stop_debug_log() waits for us once we're counted, so check the
+    // flag after
+    InterlockedIncrement((LONG *)&adding_lines);
+    if (!accepting_lines) {
+        InterlockedDecrement((LONG *)&adding_lines);
+        write_debug_line_now(line);
+        return;
+    }
+
+    LONG position = enqueue_position;
+    DEBUG_LOG_SLOT *s;
+
+    for (;;) {
+        s = &slot[position & (DEBUG_LOG_SLOTS - 1)];
+        LONG difference = s->sequence - position;
+
+        if (difference == 0) {
+            // free: take the position if no one else has
+            LONG seen = InterlockedCompareExchange(
+                    (LONG *)&enqueue_position, position + 1, position);
+            if (seen == position) {
+                break;
+            }
+            position = seen;
+        } else if (difference < 0) {
+            // a lap ahead of the writer
+            InterlockedIncrement((LONG *)&dropped_lines);
+            InterlockedDecrement((LONG *)&adding_lines);
+            return;
+        } else {
+            // someone else took it
+            position = enqueue_position;
+        }
+    }
+
+    strncpy(s->line, line, DEBUG_LINE_LENGTH - 1);
+    s->line[DEBUG_LINE_LENGTH - 1] = '\0';
+
+    // full, for the writer
+    InterlockedExchange((LONG *)&s->sequence, position + 1);
+
+    if (position - dequeue_position >= DEBUG_LOG_SLOTS/2) {
+        SetEvent(wake_writer);
+    }
+
+    InterlockedDecrement((LONG *)&adding_lines);
+}
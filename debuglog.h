@@ -0,0 +1,31 @@
+/*
+ * DebugLog.h
+ *
+ * Writes the debugging lines from a thread of its own, so that the
+ * threads printing them never wait for the disk.
+ *
+ */
+
+#ifndef __DEBUGLOG_H__
+#define __DEBUGLOG_H__
+
+
+#include <stdio.h>
+
+// the longest line, with its timestamp and indent.  longer ones are cut.
+#define DEBUG_LINE_LENGTH           256
+
+// until this is called lines are written straight to stdout.  it's
+// stopped on exit() too.
+void start_debug_log(FILE *out);
+
+// writes what's left and stops the thread, before "out" is closed.  the
+// lines after this go to stdout.
+void stop_debug_log();
+
+// "line" without a newline.  from any thread; if the queue is full the
+// line is dropped and counted, and the count is written instead.
+void add_debug_line(char *line);
+
+
+#endif /* __DEBUGLOG_H__ */
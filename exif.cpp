@@ -0,0 +1,273 @@
+/*
+ * Exif.cpp
+ *
+ * Walks the JPEG markers up to the start of the image data, picking up
+ * the image size from the SOF marker and the embedded thumbnail from
+ * the EXIF block in APP1.  See the EXIF 2.2 spec, section 4.5, for the
+ * layout of the TIFF structure inside APP1.
+ *
+ */
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "exif.h"
+#include "jessu.h"
+
+#define MARKER_SOI          0xD8
+#define MARKER_EOI          0xD9
+#define MARKER_SOS          0xDA
+#define MARKER_APP1         0xE1
+
+#define TAG_ORIENTATION     0x0112
+#define TAG_JPEG_OFFSET     0x0201
+#define TAG_JPEG_LENGTH     0x0202
+
+#define TIFF_TYPE_SHORT     3
+#define TIFF_TYPE_LONG      4
+
+// only look at so many IFD entries, in case the file is corrupt
+#define MAX_IFD_ENTRIES     500
+
+struct TIFF_BLOCK {
+    unsigned char *data;    // starts at the "II" or "MM"
+    int length;
+    bool big_endian;
+};
+
+static int
+get_16(TIFF_BLOCK *tiff, int offset)
+{
+    unsigned char *p = tiff->data + offset;
+
+    if (tiff->big_endian) {
+        return (p[0] << 8) | p[1];
+    }
+
+    return (p[1] << 8) | p[0];
+}
+
+static int
+get_32(TIFF_BLOCK *tiff, int offset)
+{
+    unsigned char *p = tiff->data + offset;
+
+    if (tiff->big_endian) {
+        return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+    }
+
+    return (p[3] << 24) | (p[2] << 16) | (p[1] << 8) | p[0];
+}
+
+static int
+get_ifd_value(TIFF_BLOCK *tiff, int entry)
+{
+    // values that fit in four bytes are stored in the entry itself
+    if (get_16(tiff, entry + 2) == TIFF_TYPE_SHORT) {
+        return get_16(tiff, entry + 8);
+    }
+
+    return get_32(tiff, entry + 8);
+}
+
+static void
+parse_tiff(TIFF_BLOCK *tiff, EXIF_INFO *info, bool want_thumbnail)
+{
+    int ifd;
+    int count;
+    int i;
+
+    if (tiff->length < 8) {
+        return;
+    }
+
+    if (tiff->data[0] == 'M' && tiff->data[1] == 'M') {
+        tiff->big_endian = true;
+    } else if (tiff->data[0] == 'I' && tiff->data[1] == 'I') {
+        tiff->big_endian = false;
+    } else {
+        return;
+    }
+
+    if (get_16(tiff, 2) != 42) {
+        return;
+    }
+
+    // IFD0 describes the main image
+    ifd = get_32(tiff, 4);
+    if (ifd < 8 || ifd + 2 > tiff->length) {
+        return;
+    }
+
+    count = get_16(tiff, ifd);
+    if (count > MAX_IFD_ENTRIES || ifd + 2 + count*12 + 4 > tiff->length) {
+        return;
+    }
+
+    for (i = 0; i < count; i++) {
+        int entry = ifd + 2 + i*12;
+
+        if (get_16(tiff, entry) == TAG_ORIENTATION) {
+            int orientation = get_ifd_value(tiff, entry);
+
+            if (orientation >= ORIENTATION_TOP_LEFT &&
+                    orientation <= ORIENTATION_LEFT_BOTTOM) {
+
+                info->orientation = orientation;
+            }
+        }
+    }
+
+    if (!want_thumbnail) {
+        return;
+    }
+
+    // IFD1 describes the thumbnail
+    ifd = get_32(tiff, ifd + 2 + count*12);
+    if (ifd < 8 || ifd + 2 > tiff->length) {
+        return;
+    }
+
+    count = get_16(tiff, ifd);
+    if (count > MAX_IFD_ENTRIES || ifd + 2 + count*12 > tiff->length) {
+        return;
+    }
+
+    int thumbnail_offset = 0;
+    int thumbnail_length = 0;
+
+    for (i = 0; i < count; i++) {
+        int entry = ifd + 2 + i*12;
+
+        switch (get_16(tiff, entry)) {
+            case TAG_JPEG_OFFSET:
+                thumbnail_offset = get_ifd_value(tiff, entry);
+                break;
+
+            case TAG_JPEG_LENGTH:
+                thumbnail_length = get_ifd_value(tiff, entry);
+                break;
+        }
+    }
+
+    if (thumbnail_offset <= 0 || thumbnail_length <= 2 ||
+            thumbnail_offset > tiff->length - thumbnail_length) {
+
+        return;
+    }
+
+    unsigned char *thumbnail = tiff->data + thumbnail_offset;
+    if (thumbnail[0] != 0xFF || thumbnail[1] != MARKER_SOI) {
+        // some cameras put an uncompressed TIFF thumbnail here
+        return;
+    }
+
+    info->thumbnail = (unsigned char *)jessu_malloc(THREAD_WORKER,
+            thumbnail_length, "exif thumbnail");
+    memcpy(info->thumbnail, thumbnail, thumbnail_length);
+    info->thumbnail_length = thumbnail_length;
+}
+
+static bool
+is_sof_marker(int marker)
+{
+    // C4 (DHT), C8 (JPG), and CC (DAC) share the range but aren't frames
+    return marker >= 0xC0 && marker <= 0xCF &&
+        marker != 0xC4 && marker != 0xC8 && marker != 0xCC;
+}
+
+bool
+read_exif_info(FILE *fp, EXIF_INFO *info, bool want_thumbnail)
+{
+    long start = ftell(fp);
+    bool is_jpeg = false;
+    bool seen_exif = false;
+
+    info->image_width = 0;
+    info->image_height = 0;
+    info->orientation = ORIENTATION_TOP_LEFT;
+    info->thumbnail = NULL;
+    info->thumbnail_length = 0;
+
+    if (getc(fp) != 0xFF || getc(fp) != MARKER_SOI) {
+        goto done;
+    }
+
+    is_jpeg = true;
+
+    // walk the markers until we have the size.  the EXIF block, if any,
+    // must come right after SOI, so once we've seen the frame header
+    // there's nothing more for us.
+    while (info->image_width == 0) {
+        int c;
+        int marker;
+        int length;
+
+        c = getc(fp);
+        if (c != 0xFF) {
+            break;
+        }
+
+        // any number of 0xFF fill bytes may precede the marker
+        do {
+            marker = getc(fp);
+        } while (marker == 0xFF);
+
+        if (marker == EOF || marker == MARKER_SOS || marker == MARKER_EOI) {
+            break;
+        }
+
+        length = getc(fp) << 8;
+        length |= getc(fp);
+        length -= 2;  // includes itself
+        if (length < 0) {
+            break;
+        }
+
+        if (marker == MARKER_APP1 && !seen_exif) {
+            unsigned char *data = (unsigned char *)jessu_malloc(THREAD_WORKER,
+                    length, "exif block");
+
+            if ((int)fread(data, 1, length, fp) == length && length > 6 &&
+                    memcmp(data, "Exif\0\0", 6) == 0) {
+
+                TIFF_BLOCK tiff;
+
+                tiff.data = data + 6;
+                tiff.length = length - 6;
+                parse_tiff(&tiff, info, want_thumbnail);
+                seen_exif = true;
+            }
+
+            jessu_free(THREAD_WORKER, data, "exif block");
+        } else if (is_sof_marker(marker) && length >= 5) {
+            getc(fp);  // sample precision
+            info->image_height = getc(fp) << 8;
+            info->image_height |= getc(fp);
+            info->image_width = getc(fp) << 8;
+            info->image_width |= getc(fp);
+        } else {
+            if (fseek(fp, length, SEEK_CUR) != 0) {
+                break;
+            }
+        }
+    }
+
+done:
+    // the JPEG library wants to start at the top
+    fseek(fp, start, SEEK_SET);
+
+    return is_jpeg;
+}
+
+void
+free_exif_info(EXIF_INFO *info)
+{
+    if (info->thumbnail != NULL) {
+        jessu_free(THREAD_WORKER, info->thumbnail, "exif thumbnail");
+        info->thumbnail = NULL;
+    }
+    info->thumbnail_length = 0;
+}
@@ -0,0 +1,49 @@
+/*
+ * Exif.h
+ *
+ * Pulls the few things we care about out of a JPEG file's headers
+ * without decoding the image itself.
+ *
+ */
+
+#ifndef __EXIF_H__
+#define __EXIF_H__
+
+
+#include <stdio.h>
+
+// values of the Orientation tag.  the name says where row 0 and column 0
+// of the stored image belong when it's displayed.
+#define ORIENTATION_TOP_LEFT        1   // normal
+#define ORIENTATION_TOP_RIGHT       2   // mirrored left-to-right
+#define ORIENTATION_BOTTOM_RIGHT    3   // upside-down
+#define ORIENTATION_BOTTOM_LEFT     4   // mirrored top-to-bottom
+#define ORIENTATION_LEFT_TOP        5   // transposed
+#define ORIENTATION_RIGHT_TOP       6   // needs turning 90 degrees clockwise
+#define ORIENTATION_RIGHT_BOTTOM    7   // transverse
+#define ORIENTATION_LEFT_BOTTOM     8   // needs turning 90 degrees counter-cw
+
+// for the last four, rows of the file become columns on the screen
+#define ORIENTATION_IS_TRANSPOSED(o)    ((o) >= ORIENTATION_LEFT_TOP)
+
+struct EXIF_INFO {
+    /* size of the full image from the SOF marker, or 0 if not found */
+    int image_width;
+    int image_height;
+
+    /* from IFD0, ORIENTATION_TOP_LEFT if missing */
+    int orientation;
+
+    /* the embedded JPEG thumbnail from IFD1, or NULL if there is none */
+    unsigned char *thumbnail;
+    int thumbnail_length;
+};
+
+// leaves "fp" where it found it.  returns false if this doesn't look
+// like a JPEG file at all.  the thumbnail is only copied out if
+// "want_thumbnail" is true.
+bool read_exif_info(FILE *fp, EXIF_INFO *info, bool want_thumbnail);
+void free_exif_info(EXIF_INFO *info);
+
+
+#endif /* __EXIF_H__ */
@@ -62,10 +62,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <setjmp.h>
+#include <math.h>
 
 #include "fileread.h"
 #include "jessu.h"
 #include "scaletile.h"
+#include "exif.h"
+#include "stagetime.h"
+#include "tracefile.h"
 
 extern "C" {
 #include "jpeglib.h"
@@ -74,6 +78,13 @@ extern "C" {
 // 200 pixels in both directions
 #define MINIMUM_SIZE        200
 
+// don't use an embedded preview whose shape is more than this far off
+// from the real image's.  some cameras letterbox their thumbnails.
+#define PREVIEW_RATIO_SLOP  0.05
+
+// how often to show a better version of a progressive image
+#define REFINE_MILLISECONDS 1000
+
 struct JPEGReadException {
     char m_error_message[JMSG_LENGTH_MAX];
 
@@ -82,7 +93,10 @@ struct JPEGReadException {
     }
 };
 
-static char *current_filename = NULL;
+// each worker thread decodes its own picture, so these are per thread
+static __declspec(thread) char *current_filename = NULL;
+static __declspec(thread) unsigned char *row_buffer_data = NULL;
+static __declspec(thread) int row_buffer_size;
 
 static void
 dummy_exit(j_common_ptr cinfo)
@@ -90,39 +104,286 @@ dummy_exit(j_common_ptr cinfo)
     throw JPEGReadException(cinfo);
 }
 
+/*
+ * Data source for decoding a JPEG that's already in memory (the EXIF
+ * thumbnail).  Version 6b of the library only comes with a stdio source.
+ */
+
+static void
+memory_init_source(j_decompress_ptr /* cinfo */)
+{
+    // nothing
+}
+
+static boolean
+memory_fill_input_buffer(j_decompress_ptr cinfo)
+{
+    // we ran off the end of the data.  insert a fake EOI marker so
+    // that the library finishes with what it has.
+    static JOCTET fake_eoi[2] = { 0xFF, JPEG_EOI };
+
+    cinfo->src->next_input_byte = fake_eoi;
+    cinfo->src->bytes_in_buffer = 2;
+
+    return TRUE;
+}
+
+static void
+memory_skip_input_data(j_decompress_ptr cinfo, long num_bytes)
+{
+    if (num_bytes <= 0) {
+        return;
+    }
+
+    if ((size_t)num_bytes > cinfo->src->bytes_in_buffer) {
+        memory_fill_input_buffer(cinfo);
+    } else {
+        cinfo->src->next_input_byte += num_bytes;
+        cinfo->src->bytes_in_buffer -= num_bytes;
+    }
+}
+
+static void
+memory_term_source(j_decompress_ptr /* cinfo */)
+{
+    // nothing
+}
+
+static void
+jpeg_memory_src(j_decompress_ptr cinfo, unsigned char *data, int length)
+{
+    if (cinfo->src == NULL) {
+        cinfo->src = (struct jpeg_source_mgr *)(*cinfo->mem->alloc_small)(
+                (j_common_ptr)cinfo, JPOOL_PERMANENT,
+                sizeof(struct jpeg_source_mgr));
+    }
+
+    cinfo->src->init_source = memory_init_source;
+    cinfo->src->fill_input_buffer = memory_fill_input_buffer;
+    cinfo->src->skip_input_data = memory_skip_input_data;
+    cinfo->src->resync_to_restart = jpeg_resync_to_restart;
+    cinfo->src->term_source = memory_term_source;
+    cinfo->src->next_input_byte = data;
+    cinfo->src->bytes_in_buffer = length;
+}
+
 static unsigned char *
 get_row_buffer(int size)
 {
-    static unsigned char *buffer = NULL;
-    static int current_size;
-
-    if (buffer == NULL) {
-        buffer = (unsigned char *)jessu_malloc(THREAD_WORKER,
+    if (row_buffer_data == NULL) {
+        row_buffer_data = (unsigned char *)jessu_malloc(THREAD_WORKER,
                 size, "jpeg row buffer");
-        current_size = size;
+        row_buffer_size = size;
     } else {
-        if (size > current_size) {
-            buffer = (unsigned char *)jessu_realloc(THREAD_WORKER,
-                    buffer, size, "jpeg row buffer");
-            current_size = size;
+        if (size > row_buffer_size) {
+            row_buffer_data = (unsigned char *)jessu_realloc(THREAD_WORKER,
+                    row_buffer_data, size, "jpeg row buffer");
+            row_buffer_size = size;
         }
     }
 
-    return buffer;
+    return row_buffer_data;
 }
 
-static int
-read_jpeg(FILE *jpegFile, Vertical_scaler &vertical_scaler,
+static void
+get_upright_size(int stored_width, int stored_height, int orientation,
         int *width, int *height)
+{
+    if (ORIENTATION_IS_TRANSPOSED(orientation)) {
+        *width = stored_height;
+        *height = stored_width;
+    } else {
+        *width = stored_width;
+        *height = stored_height;
+    }
+}
+
+static void
+gray_to_rgb(unsigned char *row, int width)
+{
+    for (int j = width - 1; j >= 0; j--) {
+        JSAMPLE s = row[j];
+        row[j*3 + 0] = s;
+        row[j*3 + 1] = s;
+        row[j*3 + 2] = s;
+    }
+}
+
+// decodes one output pass into the tiles.  returns false on a short read.
+// "decode_ticks" is decoding already done for this pass (reading in the
+// scans, say), to be counted with it.
+static bool
+read_rows(struct jpeg_decompress_struct *dcinfo, unsigned char *row_buffer,
+        CLIST *clist, Vertical_scaler &vertical_scaler,
+        STAGE_CLOCK decode_ticks)
+{
+    unsigned int i;
+    JSAMPROW rowPtr[1];
+    STAGE_CLOCK scale_ticks = 0;
+
+    rowPtr[0] = row_buffer;
+
+    /* read JPEG image rows */
+    for (i = 0; i < dcinfo->output_height; i++) {
+        loading_jpeg_progress = i*100/dcinfo->output_height;
+
+        if (i % 200 == 0) {
+            // give other threads a chance.  is this really necessary?
+            jessu_printf(THREAD_WORKER, "reading line %d", i);
+            Sleep(0);
+        }
+
+        STAGE_CLOCK start = get_stage_clock();
+
+        if (jpeg_read_scanlines(dcinfo, rowPtr, 1) != 1) {
+            jessu_printf(THREAD_WORKER, "Failed reading JPEG row %d.", i);
+            return false;
+        }
+
+        /* check for grayscale */
+        if (dcinfo->num_components == 1) {
+            /* convert to color */
+            gray_to_rgb(row_buffer, dcinfo->output_width);
+        }
+
+        STAGE_CLOCK decoded = get_stage_clock();
+
+        // we go bottom up because we use texcoord t=0 at bottom, t=1 at
+        // top (could easily load top down and just reverse texcoord t's)
+        unsigned char *target_row = vertical_scaler.Get_row_buffer(i);
+
+        // scale horizontally to texture size
+        scale_row(clist, row_buffer, target_row,
+                vertical_scaler.m_row_size);
+
+        decode_ticks += decoded - start;
+        scale_ticks += get_stage_clock() - decoded;
+
+        // scale vertically to texture size (the scaler times itself)
+        vertical_scaler.Process_row(i);
+    }
+
+    add_stage_ticks(STAGE_DECODE, decode_ticks);
+    add_stage_ticks(STAGE_HORIZONTAL_SCALE, scale_ticks);
+
+    return true;
+}
+
+// does an output pass of everything up to "scan_number" in buffered-image
+// mode
+static bool
+read_scans(struct jpeg_decompress_struct *dcinfo, int scan_number,
+        unsigned char *row_buffer, CLIST *clist,
+        Vertical_scaler &vertical_scaler, STAGE_CLOCK decode_ticks)
+{
+    jessu_printf(THREAD_WORKER, "output pass for scan %d", scan_number);
+
+    jpeg_start_output(dcinfo, scan_number);
+    vertical_scaler.Restart();
+
+    if (!read_rows(dcinfo, row_buffer, clist, vertical_scaler,
+                decode_ticks)) {
+
+        return false;
+    }
+
+    jpeg_finish_output(dcinfo);
+
+    return true;
+}
+
+// reads all the scans of a progressive image, showing coarse versions
+// through "sink" whenever it wants them.  "decode_ticks" is as for
+// read_rows().
+static bool
+read_progressive(struct jpeg_decompress_struct *dcinfo,
+        unsigned char *row_buffer, CLIST *clist,
+        Vertical_scaler &vertical_scaler, Partial_image_sink *sink,
+        STAGE_CLOCK decode_ticks)
+{
+    int completed_scan = 0;
+    bool published = false;
+    DWORD last_publish_time = 0;
+
+    for (;;) {
+        // reading the scans in counts toward the next output pass
+        STAGE_CLOCK start = get_stage_clock();
+        int status = jpeg_consume_input(dcinfo);
+        decode_ticks += get_stage_clock() - start;
+
+        if (status == JPEG_SUSPENDED) {
+            // can't happen with a stdio source
+            return false;
+        }
+
+        if (status == JPEG_REACHED_EOI) {
+            break;
+        }
+
+        if (status == JPEG_SCAN_COMPLETED) {
+            completed_scan = dcinfo->input_scan_number;
+            continue;
+        }
+
+        // only think about it between scans so that we never show a
+        // half-finished one
+        if (status != JPEG_REACHED_SOS || completed_scan == 0) {
+            continue;
+        }
+
+        // each pass costs as much as decoding a baseline image, so
+        // don't do them back to back
+        if (published &&
+                timeGetTime() - last_publish_time < REFINE_MILLISECONDS) {
+
+            continue;
+        }
+
+        if (!sink->Wants_partial_image()) {
+            continue;
+        }
+
+        if (!read_scans(dcinfo, completed_scan, row_buffer, clist,
+                    vertical_scaler, decode_ticks)) {
+
+            return false;
+        }
+        decode_ticks = 0;
+
+        sink->Publish_partial_image();
+        published = true;
+        last_publish_time = timeGetTime();
+    }
+
+    if (published) {
+        sink->Wait_until_writable();
+    }
+
+    return read_scans(dcinfo, dcinfo->input_scan_number, row_buffer, clist,
+            vertical_scaler, decode_ticks);
+}
+
+// reads from "jpegFile", or from "data" if it's not NULL.  previews are
+// allowed to be smaller than MINIMUM_SIZE.  "orientation" comes from the
+// EXIF block; the returned width and height are of the image turned
+// upright.
+static int
+read_jpeg(FILE *jpegFile, unsigned char *data, int data_length,
+        bool is_preview, int orientation, Vertical_scaler &vertical_scaler,
+        int *width, int *height, Partial_image_sink *sink)
 {
     struct jpeg_error_mgr jerr;
     struct jpeg_decompress_struct dcinfo;
-    unsigned int i;
     unsigned char *row_buffer;
-    CLIST *clist;
+    CLIST *clist = NULL;
+    int padding;
     bool decompress_created = false;
+    bool progressive;
     int error;
     int success = false;
+    STAGE_CLOCK header_start;
+    STAGE_CLOCK decode_start;
+    STAGE_CLOCK decode_ticks;
 
     /* create error handler */
     jpeg_std_error(&jerr);
@@ -140,74 +401,67 @@ read_jpeg(FILE *jpegFile, Vertical_scaler &vertical_scaler,
         dcinfo.output_components = 3;
         dcinfo.out_color_space = JCS_RGB;
 
-        /* use jpegFile for reading image */
-        jpeg_stdio_src(&dcinfo, jpegFile);
+        /* use jpegFile or data for reading image */
+        if (data != NULL) {
+            jpeg_memory_src(&dcinfo, data, data_length);
+        } else {
+            jpeg_stdio_src(&dcinfo, jpegFile);
+        }
 
         /* read JFIF header */
+        header_start = get_stage_clock();
         error = jpeg_read_header(&dcinfo, FALSE);
+        record_stage_time(STAGE_HEADER, header_start);
         if (error != JPEG_HEADER_OK) {
             jessu_printf(THREAD_WORKER, "Bad JPEG header");
             goto error_exit;
         }
 
+        // with progressive images the first scans are enough to show
+        // something, so decode the scans one at a time
+        progressive = sink != NULL && jpeg_has_multiple_scans(&dcinfo);
+        dcinfo.buffered_image = progressive;
+
+        // for a progressive image read all at once, this decodes it
+        decode_start = get_stage_clock();
         jpeg_start_decompress(&dcinfo);
+        decode_ticks = get_stage_clock() - decode_start;
 
         // don't show the image if it's too small (usually a thumbnail
         // generated by some program) because it looks awful when blown up.
-        if (dcinfo.image_width < MINIMUM_SIZE &&
+        if (!is_preview && dcinfo.image_width < MINIMUM_SIZE &&
                 dcinfo.image_height < MINIMUM_SIZE) {
 
             goto error_exit;
         }
 
-        *width = dcinfo.image_width;
-        *height = dcinfo.image_height;
-        vertical_scaler.Set_source_parameters(*width, *height);
+        vertical_scaler.Set_source_parameters(dcinfo.image_width,
+                dcinfo.image_height, orientation);
+        get_upright_size(dcinfo.image_width, dcinfo.image_height,
+                orientation, width, height);
 
-        // temporary buffer just for this row
-        row_buffer = get_row_buffer(*width*3);
-        JSAMPROW rowPtr[1];
-        rowPtr[0] = row_buffer;
+        clist = get_scale_row_data(dcinfo.image_width,
+                vertical_scaler.m_row_size, vertical_scaler.m_row_tile_size);
 
-        clist = get_scale_row_data(*width, vertical_scaler.m_texture_size_x,
-                vertical_scaler.m_tile_size_x);
+        // temporary buffer just for this row, with room for the scaler
+        // to reflect the ends
+        padding = get_scale_row_padding(clist);
+        row_buffer = get_row_buffer((dcinfo.image_width + padding*2)*3) +
+            padding*3;
 
-        /* read JPEG image rows */
-        for (i = 0; i < dcinfo.image_height; i++) {
-            loading_jpeg_progress = i*100/dcinfo.image_height;
+        if (progressive) {
+            jessu_printf(THREAD_WORKER, "progressive image");
+            if (!read_progressive(&dcinfo, row_buffer, clist,
+                        vertical_scaler, sink, decode_ticks)) {
 
-            if (i % 200 == 0) {
-                // give other threads a chance.  is this really necessary?
-                jessu_printf(THREAD_WORKER, "reading line %d", i);
-                Sleep(0);
+                goto error_exit;
             }
+        } else {
+            if (!read_rows(&dcinfo, row_buffer, clist, vertical_scaler,
+                        decode_ticks)) {
 
-            if (jpeg_read_scanlines(&dcinfo, rowPtr, 1) != 1) {
-                fprintf(debug_output, "Failed reading JPEG row %d.\n", i);
-                return 0;
+                goto error_exit;
             }
-
-            /* check for grayscale */
-            if (dcinfo.num_components == 1) {
-                /* convert to color */
-                for (int j = dcinfo.image_width - 1; j >= 0; j--) {
-                    JSAMPLE s = row_buffer[j];
-                    row_buffer[j*3 + 0] = s;
-                    row_buffer[j*3 + 1] = s;
-                    row_buffer[j*3 + 2] = s;
-                }
-            }
-
-            // we go bottom up because we use texcoord t=0 at bottom, t=1 at
-            // top (could easily load top down and just reverse texcoord t's)
-            unsigned char *target_row = vertical_scaler.Get_row_buffer(i);
-
-            // scale horizontally to texture size
-            scale_row(clist, row_buffer, target_row,
-                    vertical_scaler.m_texture_size_x);
-
-            // scale vertically to texture size 
-            vertical_scaler.Process_row(i);
         }
 
         jpeg_finish_decompress(&dcinfo);
@@ -222,6 +476,8 @@ read_jpeg(FILE *jpegFile, Vertical_scaler &vertical_scaler,
     }
 
 error_exit:
+    release_scale_row_data(clist);
+
     if (decompress_created) {
         jpeg_destroy_decompress(&dcinfo);
         decompress_created = false;
@@ -230,22 +486,851 @@ error_exit:
     return success;
 }
 
-int
-read_image(char *name, FILE *fp, Vertical_scaler &vertical_scaler,
-        int *width, int *height)
+/*
+ * Decoding in strips.  A baseline JPEG with restart markers can be cut at
+ * any restart marker that falls at the start of an MCU row, and each piece
+ * decoded on its own by handing the library the headers with the height
+ * changed, followed by that piece of the scan.  Big images are decoded this
+ * way on several threads, and the rows are handed to the vertical scaler
+ * in order as the strips come in.
+ */
+
+// only bother for images at least this big
+#define STRIP_MINIMUM_PIXELS    (8*1000*1000)
+
+#define STRIP_MAXIMUM_THREADS   8
+
+// aim for this many strips per thread so that the threads finish at
+// about the same time, but don't make them taller than STRIP_MAXIMUM_ROWS
+// because each strip in flight keeps its scaled rows around.
+#define STRIPS_PER_THREAD       4
+#define STRIP_MAXIMUM_ROWS      512
+
+// decoded strips waiting for the vertical scaler, per thread
+#define STRIPS_IN_FLIGHT_PER_THREAD     2
+
+// how much of the scan to hand the library at once
+#define STRIP_SOURCE_BUFFER_SIZE        65536
+
+// a strip thread's JPEG library instance, source and row buffer, for
+// pictures up to about 8000 pixels wide
+#define STRIP_THREAD_BYTES              (1024*1024)
+
+enum STRIP_RESULT {
+    STRIP_RESULT_OK,
+    STRIP_RESULT_FAILED,
+    STRIP_RESULT_UNSUITABLE     // decode it the normal way
+};
+
+struct JPEG_LAYOUT {
+    unsigned char *file;
+    int header_length;          // everything before the entropy-coded data
+    int height_offset;          // of the height in the SOF marker
+    int width, height;
+    int mcu_height;             // in pixels
+    int mcus_per_row;
+    int mcu_rows;
+    int restart_interval;       // in MCUs
+    int data_end;               // offset of the marker that ends the scan
+
+    // offset of the data of every "rows_per_boundary"th MCU row, each of
+    // which starts a restart interval
+    int rows_per_boundary;
+    int boundary_count;
+    int *boundary;
+};
+
+struct STRIP {
+    int first_row;              // in pixels
+    int row_count;
+    unsigned char *rows;        // scaled horizontally
+    bool failed;
+    HANDLE done;                // auto-reset, set when "rows" is filled in
+};
+
+struct STRIP_JOB {
+    char *filename;             // for messages from the strip threads
+    JPEG_LAYOUT *layout;
+    CLIST *clist;
+    int row_size;
+    int strip_mcu_rows;
+    int strip_count;
+    STRIP *strip;               // "strip_count" strips share "slot_count"
+    int slot_count;
+    volatile LONG next_strip;
+    volatile LONG abort;
+    HANDLE free_slots;          // semaphore
+};
+
+// feeds the library the patched headers, then a range of the scan with the
+// restart markers renumbered to start at zero, then EOI.
+struct STRIP_SOURCE {
+    struct jpeg_source_mgr pub;
+    unsigned char *data;
+    int data_length;
+    int data_position;
+    int restart_adjust;
+    bool last_was_ff;
+    JOCTET buffer[STRIP_SOURCE_BUFFER_SIZE];
+};
+
+static int
+gcd(int a, int b)
+{
+    while (b != 0) {
+        int t = a % b;
+        a = b;
+        b = t;
+    }
+
+    return a;
+}
+
+static bool
+is_sequential_huffman_sof(int marker)
+{
+    // baseline and extended sequential.  progressive, lossless, and
+    // arithmetic-coded frames can't be cut up this way.
+    return marker == 0xC0 || marker == 0xC1;
+}
+
+// fills in "layout" if the file is a baseline JPEG that can be cut
+// into strips
+static bool
+find_jpeg_layout(unsigned char *file, int length, JPEG_LAYOUT *layout)
+{
+    int pos = 2;
+    int frame_components = 0;
+    int max_h = 1;
+    int max_v = 1;
+    int i;
+
+    layout->file = file;
+    layout->header_length = 0;
+    layout->height_offset = 0;
+    layout->restart_interval = 0;
+    layout->boundary = NULL;
+
+    if (length < 4 || file[0] != 0xFF || file[1] != 0xD8) {
+        return false;
+    }
+
+    // walk the markers up to the scan
+    while (layout->header_length == 0) {
+        if (pos + 4 > length || file[pos] != 0xFF) {
+            return false;
+        }
+
+        while (pos < length - 3 && file[pos] == 0xFF) {
+            pos++;
+        }
+
+        int marker = file[pos];
+        int segment_length = (file[pos + 1] << 8) | file[pos + 2];
+        unsigned char *segment = file + pos + 3;
+
+        if (segment_length < 2 || segment_length > length - pos - 1) {
+            return false;
+        }
+
+        if (is_sequential_huffman_sof(marker)) {
+            if (segment_length < 8) {
+                return false;
+            }
+
+            layout->height_offset = pos + 4;
+            layout->height = (segment[1] << 8) | segment[2];
+            layout->width = (segment[3] << 8) | segment[4];
+            frame_components = segment[5];
+
+            if (frame_components == 0 ||
+                    segment_length < 8 + 3*frame_components) {
+
+                return false;
+            }
+
+            for (i = 0; i < frame_components; i++) {
+                int h = segment[6 + i*3 + 1] >> 4;
+                int v = segment[6 + i*3 + 1] & 0x0F;
+
+                if (h > max_h) {
+                    max_h = h;
+                }
+                if (v > max_v) {
+                    max_v = v;
+                }
+            }
+        } else if (marker >= 0xC2 && marker <= 0xCF &&
+                marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+
+            return false;
+        } else if (marker == 0xDD) {
+            // DRI
+            if (segment_length < 4) {
+                return false;
+            }
+            layout->restart_interval = (segment[0] << 8) | segment[1];
+        } else if (marker == 0xDA) {
+            // SOS.  we need a single scan with all the components in it.
+            if (layout->height_offset == 0 ||
+                    segment[0] != frame_components) {
+
+                return false;
+            }
+            layout->header_length = pos + 1 + segment_length;
+        } else if (marker == 0xD9) {
+            return false;
+        }
+
+        pos += 1 + segment_length;
+    }
+
+    if (layout->restart_interval == 0 || layout->width == 0 ||
+            layout->height == 0) {
+
+        return false;
+    }
+
+    // a scan with one component has one block per MCU whatever its
+    // sampling factors
+    int mcu_width;
+    if (frame_components == 1) {
+        mcu_width = 8;
+        layout->mcu_height = 8;
+    } else {
+        mcu_width = 8*max_h;
+        layout->mcu_height = 8*max_v;
+    }
+
+    layout->mcus_per_row = (layout->width + mcu_width - 1)/mcu_width;
+    layout->mcu_rows = (layout->height + layout->mcu_height - 1)/
+        layout->mcu_height;
+
+    // the fewest MCU rows after which a restart interval starts a row
+    layout->rows_per_boundary = layout->restart_interval/
+        gcd(layout->restart_interval, layout->mcus_per_row);
+    if (layout->rows_per_boundary > layout->mcu_rows/2) {
+        return false;
+    }
+
+    layout->boundary_count = (layout->mcu_rows - 1)/
+        layout->rows_per_boundary + 1;
+    int intervals_per_boundary = layout->rows_per_boundary*
+        layout->mcus_per_row/layout->restart_interval;
+    int interval_count = (layout->mcus_per_row*layout->mcu_rows +
+            layout->restart_interval - 1)/layout->restart_interval;
+
+    layout->boundary = (int *)jessu_malloc(THREAD_WORKER,
+            layout->boundary_count*sizeof(int), "strip boundaries");
+    layout->boundary[0] = layout->header_length;
+
+    // find all the restart markers, checking that they're all there
+    int interval = 1;
+    pos = layout->header_length;
+    for (;;) {
+        if (pos >= length - 1) {
+            goto fail;
+        }
+
+        unsigned char *p = (unsigned char *)memchr(file + pos, 0xFF,
+                length - pos - 1);
+
+        if (p == NULL) {
+            // never found the end of the scan
+            goto fail;
+        }
+
+        pos = p - file;
+        int c = file[pos + 1];
+
+        if (c == 0x00) {
+            // stuffed zero
+            pos += 2;
+        } else if (c == 0xFF) {
+            // fill byte
+            pos++;
+        } else if (c >= 0xD0 && c <= 0xD7) {
+            if (c - 0xD0 != (interval - 1) % 8 || interval >= interval_count) {
+                goto fail;
+            }
+
+            if (interval % intervals_per_boundary == 0) {
+                layout->boundary[interval/intervals_per_boundary] = pos + 2;
+            }
+
+            interval++;
+            pos += 2;
+        } else {
+            // any other marker ends the scan
+            layout->data_end = pos;
+            break;
+        }
+    }
+
+    if (interval != interval_count) {
+        goto fail;
+    }
+
+    return true;
+
+fail:
+    jessu_free(THREAD_WORKER, layout->boundary, "strip boundaries");
+    layout->boundary = NULL;
+
+    return false;
+}
+
+static void
+strip_init_source(j_decompress_ptr /* cinfo */)
+{
+    // nothing
+}
+
+static boolean
+strip_fill_input_buffer(j_decompress_ptr cinfo)
+{
+    STRIP_SOURCE *source = (STRIP_SOURCE *)cinfo->src;
+    int length = source->data_length - source->data_position;
+
+    if (length <= 0) {
+        // end of our part of the scan, or the library wants more than
+        // there is.  either way, finish the image.
+        static JOCTET eoi[2] = { 0xFF, JPEG_EOI };
+
+        source->pub.next_input_byte = eoi;
+        source->pub.bytes_in_buffer = 2;
+
+        return TRUE;
+    }
+
+    if (length > STRIP_SOURCE_BUFFER_SIZE) {
+        length = STRIP_SOURCE_BUFFER_SIZE;
+    }
+
+    JOCTET *buffer = source->buffer;
+    memcpy(buffer, source->data + source->data_position, length);
+    source->data_position += length;
+
+    // renumber the restart markers.  in the scan 0xFF is always followed
+    // by a stuffed zero, another 0xFF, or a marker.
+    for (int i = 0; i < length; i++) {
+        if (source->last_was_ff && buffer[i] >= 0xD0 && buffer[i] <= 0xD7) {
+            buffer[i] = 0xD0 + ((buffer[i] - 0xD0 - source->restart_adjust) & 7);
+        }
+        source->last_was_ff = buffer[i] == 0xFF;
+    }
+
+    source->pub.next_input_byte = buffer;
+    source->pub.bytes_in_buffer = length;
+
+    return TRUE;
+}
+
+static void
+strip_skip_input_data(j_decompress_ptr cinfo, long num_bytes)
+{
+    while (num_bytes > (long)cinfo->src->bytes_in_buffer) {
+        num_bytes -= cinfo->src->bytes_in_buffer;
+        strip_fill_input_buffer(cinfo);
+    }
+
+    if (num_bytes > 0) {
+        cinfo->src->next_input_byte += num_bytes;
+        cinfo->src->bytes_in_buffer -= num_bytes;
+    }
+}
+
+static void
+strip_term_source(j_decompress_ptr /* cinfo */)
+{
+    // nothing
+}
+
+// decodes strip number "n" into its slot.  each strip is decoded starting
+// one MCU row early and ending one late so that chroma upsampling across
+// the cut comes out the same as for the whole image.
+static bool
+decode_strip(STRIP_JOB *job, int n, STRIP *strip, unsigned char *row_buffer)
+{
+    JPEG_LAYOUT *layout = job->layout;
+    struct jpeg_error_mgr jerr;
+    struct jpeg_decompress_struct dcinfo;
+    STRIP_SOURCE *source;
+    unsigned char *header;
+    bool decompress_created = false;
+    bool success = false;
+    int rows_per_boundary = layout->rows_per_boundary;
+    Trace_span span("decode_strip");
+
+    // the strip's own headers count as decoding
+    STAGE_CLOCK decode_start = get_stage_clock();
+    STAGE_CLOCK scale_ticks = 0;
+
+    int first_mcu_row = n*job->strip_mcu_rows;
+    int end_mcu_row = first_mcu_row + job->strip_mcu_rows;
+    if (end_mcu_row > layout->mcu_rows) {
+        end_mcu_row = layout->mcu_rows;
+    }
+
+    int first_boundary = first_mcu_row/rows_per_boundary;
+    if (first_boundary > 0) {
+        first_boundary--;
+    }
+    int decode_mcu_row = first_boundary*rows_per_boundary;
+
+    int decode_end_mcu_row = end_mcu_row + 1;
+    if (decode_end_mcu_row > layout->mcu_rows) {
+        decode_end_mcu_row = layout->mcu_rows;
+    }
+    int end_boundary = (decode_end_mcu_row + rows_per_boundary - 1)/
+        rows_per_boundary;
+
+    int data_start = layout->boundary[first_boundary];
+    int data_end = end_boundary < layout->boundary_count ?
+        layout->boundary[end_boundary] - 2 : layout->data_end;
+
+    int decode_first_row = decode_mcu_row*layout->mcu_height;
+    int decode_height = decode_end_mcu_row*layout->mcu_height;
+    if (decode_height > layout->height) {
+        decode_height = layout->height;
+    }
+    decode_height -= decode_first_row;
+
+    strip->first_row = first_mcu_row*layout->mcu_height;
+    strip->row_count = end_mcu_row*layout->mcu_height;
+    if (strip->row_count > layout->height) {
+        strip->row_count = layout->height;
+    }
+    strip->row_count -= strip->first_row;
+    int skip_rows = strip->first_row - decode_first_row;
+
+    // same headers but only as tall as what we decode
+    header = (unsigned char *)jessu_malloc(THREAD_WORKER,
+            layout->header_length, "strip header");
+    memcpy(header, layout->file, layout->header_length);
+    header[layout->height_offset] = decode_height >> 8;
+    header[layout->height_offset + 1] = decode_height & 0xFF;
+
+    source = (STRIP_SOURCE *)jessu_malloc(THREAD_WORKER,
+            sizeof(STRIP_SOURCE), "strip source");
+    source->pub.init_source = strip_init_source;
+    source->pub.fill_input_buffer = strip_fill_input_buffer;
+    source->pub.skip_input_data = strip_skip_input_data;
+    source->pub.resync_to_restart = jpeg_resync_to_restart;
+    source->pub.term_source = strip_term_source;
+    source->pub.next_input_byte = header;
+    source->pub.bytes_in_buffer = layout->header_length;
+    source->data = layout->file + data_start;
+    source->data_length = data_end - data_start;
+    source->data_position = 0;
+    source->restart_adjust = (first_boundary*rows_per_boundary*
+            layout->mcus_per_row/layout->restart_interval) % 8;
+    source->last_was_ff = false;
+
+    jpeg_std_error(&jerr);
+    jerr.error_exit = dummy_exit;
+    dcinfo.err = &jerr;
+
+    try {
+        jpeg_create_decompress(&dcinfo);
+        decompress_created = true;
+        dcinfo.src = &source->pub;
+
+        jpeg_read_header(&dcinfo, TRUE);
+        jpeg_start_decompress(&dcinfo);
+
+        JSAMPROW rowPtr[1];
+        rowPtr[0] = row_buffer;
+        int row_bytes = job->row_size*get_scale_row_pixel_bytes(job->clist);
+
+        for (int i = 0; i < skip_rows + strip->row_count; i++) {
+            if (job->abort) {
+                goto done;
+            }
+
+            if (jpeg_read_scanlines(&dcinfo, rowPtr, 1) != 1) {
+                jessu_printf(THREAD_WORKER, "Failed reading strip %d", n);
+                goto done;
+            }
+
+            if (i < skip_rows) {
+                continue;
+            }
+
+            if (dcinfo.num_components == 1) {
+                gray_to_rgb(row_buffer, dcinfo.output_width);
+            }
+
+            STAGE_CLOCK scale_start = get_stage_clock();
+            scale_row(job->clist, row_buffer,
+                    strip->rows + (i - skip_rows)*row_bytes, job->row_size);
+            scale_ticks += get_stage_clock() - scale_start;
+        }
+
+        // don't bother finishing, the rest is the context row and
+        // whatever follows it in the file
+        success = true;
+
+        add_stage_ticks(STAGE_DECODE,
+                get_stage_clock() - decode_start - scale_ticks);
+        add_stage_ticks(STAGE_HORIZONTAL_SCALE, scale_ticks);
+
+    } catch (const JPEGReadException &exception) {
+        jessu_printf(THREAD_WORKER,
+                "JPEG library could not read strip %d of \"%s\" (%s)",
+                n, job->filename, exception.m_error_message);
+    }
+
+done:
+    if (decompress_created) {
+        jpeg_destroy_decompress(&dcinfo);
+    }
+
+    jessu_free(THREAD_WORKER, source, "strip source");
+    jessu_free(THREAD_WORKER, header, "strip header");
+
+    return success;
+}
+
+static unsigned long __stdcall
+strip_thread(void *param)
+{
+    STRIP_JOB *job = (STRIP_JOB *)param;
+    int padding = get_scale_row_padding(job->clist);
+    unsigned char *padded_row_buffer = (unsigned char *)jessu_malloc(
+            THREAD_WORKER, (job->layout->width + padding*2)*3,
+            "strip row buffer");
+    unsigned char *row_buffer = padded_row_buffer + padding*3;
+
+    set_trace_thread_name("strip");
+
+    for (;;) {
+        WaitForSingleObject(job->free_slots, INFINITE);
+
+        int n = InterlockedIncrement(&job->next_strip) - 1;
+        if (n >= job->strip_count || job->abort) {
+            // pass it on so that the other threads find out too
+            ReleaseSemaphore(job->free_slots, 1, NULL);
+            break;
+        }
+
+        STRIP *strip = &job->strip[n % job->slot_count];
+        strip->failed = !decode_strip(job, n, strip, row_buffer);
+        SetEvent(strip->done);
+    }
+
+    jessu_free(THREAD_WORKER, padded_row_buffer, "strip row buffer");
+    free_linear_row();
+    end_trace_thread();
+
+    return 0;
+}
+
+static int
+get_processor_count()
+{
+    SYSTEM_INFO system_info;
+
+    GetSystemInfo(&system_info);
+
+    return system_info.dwNumberOfProcessors;
+}
+
+double get_strip_decoding_bytes(int strip_threads, int row_size,
+        int pixel_bytes)
+{
+    if (strip_threads > STRIP_MAXIMUM_THREADS) {
+        strip_threads = STRIP_MAXIMUM_THREADS;
+    }
+    if (strip_threads < 2) {
+        return 0;
+    }
+
+    // the slots are the same for each thread whether one picture has
+    // them all or several share them
+    double slot_bytes = (double)STRIP_MAXIMUM_ROWS*row_size*pixel_bytes;
+
+    return strip_threads*(STRIPS_IN_FLIGHT_PER_THREAD*slot_bytes +
+            STRIP_THREAD_BYTES);
+}
+
+static STRIP_RESULT
+read_jpeg_in_strips(char *name, EXIF_INFO *exif,
+        Vertical_scaler &vertical_scaler, int *width, int *height,
+        int strip_threads)
+{
+    HANDLE file;
+    HANDLE mapping;
+    unsigned char *data;
+    DWORD length_high;
+    int length;
+    JPEG_LAYOUT layout;
+    STRIP_JOB job;
+    HANDLE thread[STRIP_MAXIMUM_THREADS];
+    int thread_count;
+    int started_count;
+    int i;
+    STRIP_RESULT result = STRIP_RESULT_UNSUITABLE;
+
+    thread_count = strip_threads;
+    if (thread_count == STRIP_THREADS_ALL) {
+        thread_count = get_processor_count();
+    }
+    if (thread_count > STRIP_MAXIMUM_THREADS) {
+        thread_count = STRIP_MAXIMUM_THREADS;
+    }
+
+    if (thread_count < 2 ||
+            (double)exif->image_width*exif->image_height < STRIP_MINIMUM_PIXELS) {
+
+        return STRIP_RESULT_UNSUITABLE;
+    }
+
+    file = CreateFile(name, GENERIC_READ, FILE_SHARE_READ, NULL,
+            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return STRIP_RESULT_UNSUITABLE;
+    }
+
+    length = GetFileSize(file, &length_high);
+    if (length_high != 0 || length <= 0) {
+        CloseHandle(file);
+        return STRIP_RESULT_UNSUITABLE;
+    }
+
+    // may fail in a crowded address space, in which case it's just slow
+    mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping == NULL) {
+        CloseHandle(file);
+        return STRIP_RESULT_UNSUITABLE;
+    }
+
+    data = (unsigned char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (data == NULL) {
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return STRIP_RESULT_UNSUITABLE;
+    }
+
+    STAGE_CLOCK header_start = get_stage_clock();
+    bool found = find_jpeg_layout(data, length, &layout);
+    record_stage_time(STAGE_HEADER, header_start);
+
+    if (!found) {
+        jessu_printf(THREAD_WORKER, "can't decode \"%s\" in strips", name);
+        goto unmap;
+    }
+
+    job.filename = name;
+    job.layout = &layout;
+
+    // the strips start at boundaries, so they're a multiple of them tall
+    job.strip_mcu_rows = layout.mcu_rows/(thread_count*STRIPS_PER_THREAD);
+    if (job.strip_mcu_rows > STRIP_MAXIMUM_ROWS/layout.mcu_height) {
+        job.strip_mcu_rows = STRIP_MAXIMUM_ROWS/layout.mcu_height;
+    }
+    job.strip_mcu_rows -= job.strip_mcu_rows % layout.rows_per_boundary;
+    if (job.strip_mcu_rows < layout.rows_per_boundary) {
+        job.strip_mcu_rows = layout.rows_per_boundary;
+    }
+
+    job.strip_count = (layout.mcu_rows + job.strip_mcu_rows - 1)/
+        job.strip_mcu_rows;
+    if (job.strip_count < 2) {
+        goto free_layout;
+    }
+
+    jessu_printf(THREAD_WORKER, "decoding %dx%d in %d strips of %d rows "
+            "on %d threads", layout.width, layout.height, job.strip_count,
+            job.strip_mcu_rows*layout.mcu_height, thread_count);
+
+    vertical_scaler.Set_source_parameters(layout.width, layout.height,
+            exif->orientation);
+    get_upright_size(layout.width, layout.height, exif->orientation,
+            width, height);
+
+    // computed here once, the threads only read it
+    job.clist = get_scale_row_data(layout.width, vertical_scaler.m_row_size,
+            vertical_scaler.m_row_tile_size);
+    job.row_size = vertical_scaler.m_row_size;
+
+    job.slot_count = thread_count*STRIPS_IN_FLIGHT_PER_THREAD;
+    job.strip = new STRIP[job.slot_count];
+    for (i = 0; i < job.slot_count; i++) {
+        job.strip[i].rows = (unsigned char *)jessu_malloc(THREAD_WORKER,
+                job.strip_mcu_rows*layout.mcu_height*job.row_size*
+                get_scale_row_pixel_bytes(job.clist), "strip rows");
+        job.strip[i].done = CreateEvent(NULL, FALSE, FALSE, NULL);
+    }
+
+    job.next_strip = 0;
+    job.abort = 0;
+    job.free_slots = CreateSemaphore(NULL, job.slot_count, job.slot_count,
+            NULL);
+
+    // the threads that do start take all the strips between them
+    started_count = 0;
+    for (i = 0; i < thread_count; i++) {
+        DWORD thread_id;
+
+        thread[started_count] = CreateThread(NULL, 0, strip_thread, &job, 0,
+                &thread_id);
+        if (thread[started_count] == NULL) {
+            jessu_printf(THREAD_WORKER, "Can't start strip thread %d", i);
+        } else {
+            started_count++;
+        }
+    }
+
+    // hand the rows to the vertical scaler in order
+    result = started_count > 0 ? STRIP_RESULT_OK : STRIP_RESULT_UNSUITABLE;
+    for (i = 0; i < job.strip_count && started_count > 0; i++) {
+        STRIP *strip = &job.strip[i % job.slot_count];
+        int row_bytes = job.row_size*get_scale_row_pixel_bytes(job.clist);
+
+        WaitForSingleObject(strip->done, INFINITE);
+        if (strip->failed) {
+            result = STRIP_RESULT_FAILED;
+            break;
+        }
+
+        for (int y = 0; y < strip->row_count; y++) {
+            int src_y = strip->first_row + y;
+
+            loading_jpeg_progress = src_y*100/layout.height;
+            memcpy(vertical_scaler.Get_row_buffer(src_y),
+                    strip->rows + y*row_bytes, row_bytes);
+            vertical_scaler.Process_row(src_y);
+        }
+
+        ReleaseSemaphore(job.free_slots, 1, NULL);
+    }
+
+    // wake up any threads still waiting for a slot
+    job.abort = 1;
+    if (started_count > 0) {
+        ReleaseSemaphore(job.free_slots, started_count, NULL);
+    }
+
+    for (i = 0; i < started_count; i++) {
+        WaitForSingleObject(thread[i], INFINITE);
+        CloseHandle(thread[i]);
+    }
+
+    CloseHandle(job.free_slots);
+    for (i = 0; i < job.slot_count; i++) {
+        CloseHandle(job.strip[i].done);
+        jessu_free(THREAD_WORKER, job.strip[i].rows, "strip rows");
+    }
+    delete[] job.strip;
+    release_scale_row_data(job.clist);
+
+free_layout:
+    jessu_free(THREAD_WORKER, layout.boundary, "strip boundaries");
+
+unmap:
+    UnmapViewOfFile(data);
+    CloseHandle(mapping);
+    CloseHandle(file);
+
+    return result;
+}
+
+static bool
+is_jpeg_filename(char *name)
 {
     int len = strlen(name);
 
-    if ((len >= 4 && stricmp(name + strlen(name) - 4, ".jpg") == 0) ||
-        (len >= 5 && stricmp(name + strlen(name) - 5, ".jpeg") == 0)) {
+    return (len >= 4 && stricmp(name + len - 4, ".jpg") == 0) ||
+        (len >= 5 && stricmp(name + len - 5, ".jpeg") == 0);
+}
+
+int
+read_image(char *name, FILE *fp, Vertical_scaler &vertical_scaler,
+        int *width, int *height, Partial_image_sink *sink,
+        int strip_threads)
+{
+    if (is_jpeg_filename(name)) {
+        EXIF_INFO exif;
 
         current_filename = name;
         jessu_printf(THREAD_WORKER, "reading file %s", name);
-	return read_jpeg(fp, vertical_scaler, width, height);
+
+        // only need the orientation and size
+        if (!read_exif_info(fp, &exif, false)) {
+            exif.orientation = ORIENTATION_TOP_LEFT;
+        }
+
+        // big images go faster on several threads if the file allows
+        STRIP_RESULT result = read_jpeg_in_strips(name, &exif,
+                vertical_scaler, width, height, strip_threads);
+        if (result == STRIP_RESULT_OK) {
+            return TRUE;
+        }
+        if (result == STRIP_RESULT_FAILED) {
+            // the library may still manage it in one go, which starts
+            // the vertical scaler over
+            jessu_printf(THREAD_WORKER, "decoding \"%s\" in one piece", name);
+        }
+
+	return read_jpeg(fp, NULL, 0, false, exif.orientation,
+                vertical_scaler, width, height, sink);
     }
 
-    fprintf(debug_output, "No code to read file \"%s\"\n", name);
+    jessu_printf(THREAD_WORKER, "No code to read file \"%s\"", name);
 
     return FALSE;
 }
 
+int
+read_image_preview(char *name, FILE *fp, Vertical_scaler &vertical_scaler,
+        int *width, int *height)
+{
+    EXIF_INFO exif;
+    int success = false;
+
+    if (!is_jpeg_filename(name) || !read_exif_info(fp, &exif, true)) {
+        return false;
+    }
+
+    if (exif.thumbnail == NULL || exif.image_width < MINIMUM_SIZE ||
+            exif.image_height < MINIMUM_SIZE) {
+
+        jessu_printf(THREAD_WORKER, "no preview in %s", name);
+        free_exif_info(&exif);
+        return false;
+    }
+
+    current_filename = name;
+    jessu_printf(THREAD_WORKER, "reading preview of %s (%d bytes)",
+            name, exif.thumbnail_length);
+
+    // the thumbnail is stored the same way up as the image
+    if (read_jpeg(NULL, exif.thumbnail, exif.thumbnail_length, true,
+                exif.orientation, vertical_scaler, width, height, NULL)) {
+
+        int image_width, image_height;
+
+        get_upright_size(exif.image_width, exif.image_height,
+                exif.orientation, &image_width, &image_height);
+
+        double image_ratio = (double)image_width/image_height;
+        double preview_ratio = (double)*width / *height;
+
+        if (fabs(preview_ratio - image_ratio) > image_ratio*PREVIEW_RATIO_SLOP) {
+            jessu_printf(THREAD_WORKER, "preview is %dx%d but image is %dx%d",
+                    *width, *height, image_width, image_height);
+        } else {
+            // display it with the real image's shape so that nothing
+            // jumps when the full image replaces it
+            *width = image_width;
+            *height = image_height;
+            success = true;
+        }
+    }
+
+    free_exif_info(&exif);
+
+    return success;
+}
+
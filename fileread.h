@@ -25,8 +25,42 @@
 
 #include "scaletile.h"
 
-// fills the tiles as set up by the vertical scaler
+// told about coarse versions of a progressive JPEG while the rest of it
+// is still being decoded.  the tiles are shared with whoever displays them.
+class Partial_image_sink {
+public:
+    // whether a coarse version would be downloaded right away.  if not,
+    // we don't bother making one.  true also means the tiles are free.
+    virtual bool Wants_partial_image() = 0;
+
+    // the tiles hold a complete but coarse version of the image
+    virtual void Publish_partial_image() = 0;
+
+    // blocks until the published tiles have been picked up
+    virtual void Wait_until_writable() = 0;
+};
+
+// for "strip_threads": as many as there are processors
+#define STRIP_THREADS_ALL       0
+
+// fills the tiles as set up by the vertical scaler.  "sink" may be NULL,
+// in which case the tiles are only filled once.  a big image may be
+// decoded in strips on up to "strip_threads" threads; 1 decodes it on
+// this one.
 int read_image(char *name, FILE *fp, Vertical_scaler &vertical_scaler,
+        int *width, int *height, Partial_image_sink *sink,
+        int strip_threads);
+
+// the most memory decoding in strips takes on "strip_threads" threads
+// altogether, however many pictures share them, with rows "row_size"
+// wide after the horizontal scaling and "pixel_bytes" per pixel
+double get_strip_decoding_bytes(int strip_threads, int row_size,
+        int pixel_bytes);
+
+// same but uses the small preview image embedded in the file, if any.
+// returns false if there isn't one.  the width and height are those of
+// the full image.
+int read_image_preview(char *name, FILE *fp, Vertical_scaler &vertical_scaler,
         int *width, int *height);
 
 #endif /* __FILEREAD_H__ */
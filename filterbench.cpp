@@ -0,0 +1,308 @@
+/*
+ * FilterBench.cpp
+ *
+ * Loads pictures with each scaling filter, timing them and measuring how
+ * far each result is from what Lanczos3 makes.  Run with "/filters d"
+ * to pick a filter for a slow machine.  Also times the DXT1 compression
+ * of the Lanczos3 textures and measures what it loses.
+ *
+ */
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "filterbench.h"
+#include "benchtime.h"
+#include "fileread.h"
+#include "scaletile.h"
+#include "jessu.h"
+
+// same as the full-screen textures
+#define BENCH_TILE_SIZE             256
+#define BENCH_TILE_COUNT            4
+#define BENCH_TEXTURE_SIZE          (BENCH_TILE_SIZE*BENCH_TILE_COUNT)
+
+#define BENCH_MAXIMUM_PICTURES      20
+
+// a load is long, so fewer samples and a looser interval than the
+// default
+#define BENCH_LOAD_SAMPLES          3
+#define BENCH_LOAD_MAXIMUM_MS       2000
+#define BENCH_LOAD_INTERVAL         0.02
+
+// what identical pictures count as
+#define BENCH_MAXIMUM_PSNR          99.0
+
+struct BENCH_LOAD {
+    char *filename;
+    unsigned char **tile;
+};
+
+struct BENCH_COMPRESS {
+    unsigned char **tile;
+    unsigned char *blocks;
+};
+
+static unsigned char **
+allocate_bench_tiles()
+{
+    int count = BENCH_TILE_COUNT*BENCH_TILE_COUNT;
+    unsigned char **tile = (unsigned char **)jessu_malloc(THREAD_GL,
+            count*sizeof(unsigned char *), "bench tile pointers");
+
+    for (int i = 0; i < count; i++) {
+        tile[i] = (unsigned char *)jessu_malloc(THREAD_GL,
+                BENCH_TILE_SIZE*BENCH_TILE_SIZE*BYTES_PER_TEXEL,
+                "bench tile data");
+    }
+
+    return tile;
+}
+
+static void
+free_bench_tiles(unsigned char **tile)
+{
+    int count = BENCH_TILE_COUNT*BENCH_TILE_COUNT;
+
+    for (int i = 0; i < count; i++) {
+        jessu_free(THREAD_GL, tile[i], "bench tile data");
+    }
+    jessu_free(THREAD_GL, tile, "bench tile pointers");
+}
+
+// a BENCH_FUNCTION, false if the picture couldn't be loaded
+static bool
+load_bench_picture(void *data)
+{
+    BENCH_LOAD *load = (BENCH_LOAD *)data;
+    Vertical_scaler vertical_scaler;
+    int width, height;
+
+    vertical_scaler.Set_destination_parameters(load->tile,
+            BENCH_TILE_SIZE, BENCH_TILE_SIZE,
+            BENCH_TILE_COUNT, BENCH_TILE_COUNT,
+            BENCH_TEXTURE_SIZE, BENCH_TEXTURE_SIZE);
+
+    FILE *fp = fopen(load->filename, "rb");
+    if (fp == NULL) {
+        return false;
+    }
+
+    int success = read_image(load->filename, fp, vertical_scaler, &width,
+            &height, NULL, STRIP_THREADS_ALL);
+
+    fclose(fp);
+
+    return success != 0;
+}
+
+static double
+compute_psnr(unsigned char **tile, unsigned char **reference)
+{
+    int count = BENCH_TILE_COUNT*BENCH_TILE_COUNT;
+    int texels = BENCH_TILE_SIZE*BENCH_TILE_SIZE;
+    double error = 0;
+
+    for (int i = 0; i < count; i++) {
+        unsigned char *a = tile[i];
+        unsigned char *b = reference[i];
+
+        for (int j = 0; j < texels; j++) {
+            // the alpha is the same for all filters
+            for (int k = 0; k < 3; k++) {
+                int diff = a[k] - b[k];
+                error += diff*diff;
+            }
+            a += BYTES_PER_TEXEL;
+            b += BYTES_PER_TEXEL;
+        }
+    }
+
+    error /= (double)count*texels*3;
+    if (error == 0) {
+        return BENCH_MAXIMUM_PSNR;
+    }
+
+    return 10*log10(255.0*255.0/error);
+}
+
+// a BENCH_FUNCTION
+static bool
+compress_bench_tiles(void *data)
+{
+    BENCH_COMPRESS *compress = (BENCH_COMPRESS *)data;
+    int count = BENCH_TILE_COUNT*BENCH_TILE_COUNT;
+    int tile_blocks_bytes = get_texel_format_level_bytes(TEXEL_FORMAT_DXT1,
+            BENCH_TILE_SIZE, BENCH_TILE_SIZE);
+
+    for (int i = 0; i < count; i++) {
+        compress_dxt1(compress->tile[i], BENCH_TILE_SIZE, BENCH_TILE_SIZE,
+                compress->blocks + i*tile_blocks_bytes);
+    }
+
+    return true;
+}
+
+// like compute_psnr(), but only over the opaque texels of "reference",
+// since the transparent ones come back black.  also counts the texels
+// whose alpha didn't survive.
+static double
+compute_dxt1_psnr(unsigned char *blocks, unsigned char **tile,
+        unsigned char **reference, int *wrong_alpha)
+{
+    int count = BENCH_TILE_COUNT*BENCH_TILE_COUNT;
+    int texels = BENCH_TILE_SIZE*BENCH_TILE_SIZE;
+    int tile_blocks_bytes = get_texel_format_level_bytes(TEXEL_FORMAT_DXT1,
+            BENCH_TILE_SIZE, BENCH_TILE_SIZE);
+    double error = 0;
+    int opaque = 0;
+
+    for (int i = 0; i < count; i++) {
+        unsigned char *a = tile[i];
+        unsigned char *b = reference[i];
+
+        decompress_dxt1(blocks + i*tile_blocks_bytes,
+                BENCH_TILE_SIZE, BENCH_TILE_SIZE, tile[i]);
+
+        for (int j = 0; j < texels; j++) {
+            if ((a[3] >= 128) != (b[3] >= 128)) {
+                (*wrong_alpha)++;
+            }
+            if (b[3] >= 128) {
+                for (int k = 0; k < 3; k++) {
+                    int diff = a[k] - b[k];
+                    error += diff*diff;
+                }
+                opaque++;
+            }
+            a += BYTES_PER_TEXEL;
+            b += BYTES_PER_TEXEL;
+        }
+    }
+
+    error /= (double)opaque*3;
+    if (error == 0) {
+        return BENCH_MAXIMUM_PSNR;
+    }
+
+    return 10*log10(255.0*255.0/error);
+}
+
+void
+bench_scale_filters(char *directory, FILE *log)
+{
+    char pattern[MAX_PATH];
+    char filename[MAX_PATH];
+    WIN32_FIND_DATA find_data;
+    HANDLE find;
+    double total_milliseconds[SCALE_FILTER_COUNT];
+    double total_psnr[SCALE_FILTER_COUNT];
+    double dxt1_milliseconds = 0;
+    double dxt1_psnr = 0;
+    int dxt1_wrong_alpha = 0;
+    int picture_count = 0;
+    int filter;
+    BENCH_POLICY load_policy;
+    BENCH_TIMING timing;
+    BENCH_LOAD load;
+    BENCH_COMPRESS compress;
+
+    unsigned char **reference = allocate_bench_tiles();
+    unsigned char **tile = allocate_bench_tiles();
+    unsigned char *blocks = (unsigned char *)jessu_malloc(THREAD_GL,
+            BENCH_TILE_COUNT*BENCH_TILE_COUNT*
+            get_texel_format_level_bytes(TEXEL_FORMAT_DXT1,
+                BENCH_TILE_SIZE, BENCH_TILE_SIZE),
+            "bench DXT1 blocks");
+
+    for (filter = 0; filter < SCALE_FILTER_COUNT; filter++) {
+        total_milliseconds[filter] = 0;
+        total_psnr[filter] = 0;
+    }
+
+    // the reference load warms up
+    get_default_bench_policy(&load_policy);
+    load_policy.warm_up_runs = 0;
+    load_policy.warm_up_ms = 0;
+    load_policy.minimum_samples = BENCH_LOAD_SAMPLES;
+    load_policy.minimum_ms = 0;
+    load_policy.maximum_ms = BENCH_LOAD_MAXIMUM_MS;
+    load_policy.relative_interval = BENCH_LOAD_INTERVAL;
+
+    load.filename = filename;
+    compress.tile = reference;
+    compress.blocks = blocks;
+
+    _snprintf(pattern, sizeof(pattern), "%s\\*.jpg", directory);
+    find = FindFirstFile(pattern, &find_data);
+    if (find == INVALID_HANDLE_VALUE) {
+        fprintf(log, "No JPEG files in \"%s\"\n", directory);
+        goto done;
+    }
+
+    do {
+        _snprintf(filename, sizeof(filename), "%s\\%s", directory,
+                find_data.cFileName);
+
+        // the reference, also warms up the disk cache
+        set_scale_filter(SCALE_FILTER_LANCZOS3);
+        load.tile = reference;
+        if (!load_bench_picture(&load)) {
+            fprintf(log, "Skipping \"%s\"\n", filename);
+            continue;
+        }
+
+        load.tile = tile;
+        for (filter = 0; filter < SCALE_FILTER_COUNT; filter++) {
+            set_scale_filter(filter);
+            time_bench_function(load_bench_picture, &load, &load_policy,
+                    &timing);
+
+            total_milliseconds[filter] += timing.median_ms;
+            total_psnr[filter] += compute_psnr(tile, reference);
+        }
+
+        // then compress the Lanczos3 one
+        time_bench_function(compress_bench_tiles, &compress, NULL, &timing);
+        dxt1_milliseconds += timing.median_ms;
+        dxt1_psnr += compute_dxt1_psnr(blocks, tile, reference,
+                &dxt1_wrong_alpha);
+
+        picture_count++;
+    } while (picture_count < BENCH_MAXIMUM_PICTURES &&
+            FindNextFile(find, &find_data));
+
+    FindClose(find);
+
+    if (picture_count == 0) {
+        goto done;
+    }
+
+    fprintf(log, "%d pictures from \"%s\", scaled to %dx%d\n\n",
+            picture_count, directory, BENCH_TEXTURE_SIZE, BENCH_TEXTURE_SIZE);
+    fprintf(log, "%-12s %14s %20s\n", "Filter", "ms per picture",
+            "PSNR vs Lanczos3 (dB)");
+    for (filter = 0; filter < SCALE_FILTER_COUNT; filter++) {
+        fprintf(log, "%-12s %14.1f %20.1f\n",
+                get_scale_filter_name(filter),
+                total_milliseconds[filter]/picture_count,
+                total_psnr[filter]/picture_count);
+    }
+
+    fprintf(log, "\nDXT1 compression of the Lanczos3 textures:\n");
+    fprintf(log, "%.1f ms per texture (%.1f million texels per second)\n",
+            dxt1_milliseconds/picture_count,
+            (double)BENCH_TEXTURE_SIZE*BENCH_TEXTURE_SIZE*picture_count/
+            (dxt1_milliseconds > 0 ? dxt1_milliseconds*1000 : 1));
+    fprintf(log, "PSNR %.1f dB over the opaque texels, "
+            "%d texels with the wrong alpha\n",
+            dxt1_psnr/picture_count, dxt1_wrong_alpha);
+
+done:
+    free_bench_tiles(reference);
+    free_bench_tiles(tile);
+    jessu_free(THREAD_GL, blocks, "bench DXT1 blocks");
+}
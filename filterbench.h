@@ -0,0 +1,19 @@
+/*
+ * FilterBench.h
+ *
+ * Compares the scaling filters on real pictures.
+ *
+ */
+
+#ifndef __FILTERBENCH_H__
+#define __FILTERBENCH_H__
+
+
+#include <stdio.h>
+
+// loads the JPEGs in "directory" with each filter and writes a table of
+// load time and PSNR against Lanczos3 to "log"
+void bench_scale_filters(char *directory, FILE *log);
+
+
+#endif /* __FILTERBENCH_H__ */
@@ -0,0 +1,228 @@
+/*
+ * Governor.cpp
+ *
+ * The plan tries the biggest texture first and takes it if at least two
+ * workers (or the one processor's worth) fit in the budget with it,
+ * counting the tile data of every slide and prefetch entry, what each
+ * worker needs for decoding, the strips decoded on other threads and the
+ * filter tables.  Strip threads go before workers, since they only speed
+ * up the big pictures.  Without a budget it's
+ * half of the free memory, so a kiosk with 512 MB gets smaller textures
+ * and fewer pictures in flight than a workstation does.
+ *
+ * While we're going, the GL thread asks every so often whether the
+ * machine is short of memory, by how much of it is in use.  It stays
+ * short until the load is well down again, so we don't flap.
+ *
+ */
+
+#include <windows.h>
+#include <stdio.h>
+
+#include "governor.h"
+#include "jessu.h"
+#include "scaletile.h"
+#include "fileread.h"
+
+// when we go by the free memory, we take this much of it
+#define GOVERNOR_FREE_FRACTION      0.5
+
+// however much or little that is
+#define GOVERNOR_MINIMUM_BUDGET     (16*1024*1024)
+#define GOVERNOR_MAXIMUM_BUDGET     (512*1024*1024)
+
+// what "use less memory" has always come to: a 512 texture
+#define GOVERNOR_LESS_MEMORY_BUDGET (32*1024*1024)
+
+// a worker's file buffer, JPEG library and scaler rows, not counting
+// decoding in strips
+#define GOVERNOR_WORKER_BYTES       (12*1024*1024)
+
+// the filter tables, normally and when the budget is tight
+#define GOVERNOR_CONTRIB_BYTES      (4*1024*1024)
+#define GOVERNOR_SMALL_CONTRIB_BYTES    (1024*1024)
+#define GOVERNOR_SMALL_BUDGET       (64*1024*1024)
+
+// short of memory above the first load (percent of physical memory in
+// use) or below the first free bytes, plenty again below the second load
+// and above the second free bytes
+#define GOVERNOR_SHORT_LOAD         90
+#define GOVERNOR_PLENTY_LOAD        80
+#define GOVERNOR_SHORT_BYTES        (32*1024*1024)
+#define GOVERNOR_PLENTY_BYTES       (64*1024*1024)
+
+#define GOVERNOR_CHECK_MILLISECONDS 1000
+
+static bool is_short = false;
+static DWORD last_check = 0;
+
+static int texture_sizes[] = { 1024, 512, 256 };
+#define TEXTURE_SIZE_COUNT \
+    ((int)(sizeof(texture_sizes)/sizeof(texture_sizes[0])))
+
+static DWORD
+get_free_memory_budget()
+{
+    MEMORYSTATUS status;
+
+    status.dwLength = sizeof(status);
+    GlobalMemoryStatus(&status);
+
+    jessu_printf(THREAD_GL, "Memory: %lu MB of %lu MB free, %lu%% in use",
+            (unsigned long)(status.dwAvailPhys/(1024*1024)),
+            (unsigned long)(status.dwTotalPhys/(1024*1024)),
+            (unsigned long)status.dwMemoryLoad);
+
+    double budget = status.dwAvailPhys*GOVERNOR_FREE_FRACTION;
+    if (budget > GOVERNOR_MAXIMUM_BUDGET) {
+        budget = GOVERNOR_MAXIMUM_BUDGET;
+    }
+
+    return (DWORD)budget;
+}
+
+// bytes the slide show needs with "texture_size", "worker_count" and
+// "strip_threads"
+static double
+get_bytes_needed(MEMORY_NEEDS *needs, int texture_size, int worker_count,
+        int strip_threads, int contrib_cache_bytes)
+{
+    // the slides, plus what they're drawn from in software
+    int slide_sets = needs->soft_render ? 4 : 2;
+    double set_bytes = get_mipmap_bytes(texture_size, texture_size);
+
+    // the strips are scaled to the texture's width as they're decoded
+    return (worker_count + 1 + slide_sets)*set_bytes +
+        (double)worker_count*GOVERNOR_WORKER_BYTES +
+        get_strip_decoding_bytes(strip_threads, texture_size,
+                get_scale_pixel_bytes()) +
+        contrib_cache_bytes;
+}
+
+void make_memory_plan(MEMORY_NEEDS *needs, MEMORY_PLAN *plan)
+{
+    DWORD budget = needs->budget;
+
+    if (budget == 0) {
+        budget = get_free_memory_budget();
+    }
+    if (needs->less_memory && budget > GOVERNOR_LESS_MEMORY_BUDGET) {
+        budget = GOVERNOR_LESS_MEMORY_BUDGET;
+    }
+    if (budget < GOVERNOR_MINIMUM_BUDGET) {
+        budget = GOVERNOR_MINIMUM_BUDGET;
+    }
+
+    int wanted_workers = needs->processor_count;
+    if (wanted_workers > needs->maximum_workers) {
+        wanted_workers = needs->maximum_workers;
+    }
+    if (wanted_workers < 1) {
+        wanted_workers = 1;
+    }
+    int enough_workers = wanted_workers < 2 ? wanted_workers : 2;
+
+    plan->budget = budget;
+    plan->contrib_cache_bytes = budget < GOVERNOR_SMALL_BUDGET ?
+        GOVERNOR_SMALL_CONTRIB_BYTES : GOVERNOR_CONTRIB_BYTES;
+    plan->little_texture_memory = false;
+
+    if (needs->small_window) {
+        // too small to be worth strips
+        plan->texture_size = 128;
+        plan->worker_count = wanted_workers;
+        plan->strip_threads = 1;
+        return;
+    }
+
+    for (int i = 0; i < TEXTURE_SIZE_COUNT; i++) {
+        int texture_size = texture_sizes[i];
+        bool last = i == TEXTURE_SIZE_COUNT - 1;
+
+        // two slides on the card, with room to spare or they get swapped
+        // in and out during the fades.  16-bit texels are half the size.
+        double card_bytes = 2*2*(double)get_mipmap_bytes(texture_size,
+                texture_size);
+        if (!needs->soft_render && needs->texture_memory != 0 && !last &&
+                card_bytes/2 > needs->texture_memory) {
+
+            continue;
+        }
+
+        int worker_count = wanted_workers;
+        int strip_threads = needs->processor_count;
+        while (get_bytes_needed(needs, texture_size, worker_count,
+                    strip_threads, plan->contrib_cache_bytes) > budget) {
+
+            if (strip_threads > 1) {
+                strip_threads--;
+            } else if (worker_count > 1) {
+                worker_count--;
+            } else {
+                break;
+            }
+        }
+
+        bool fits = get_bytes_needed(needs, texture_size, worker_count,
+                strip_threads, plan->contrib_cache_bytes) <= budget;
+        if ((fits && worker_count >= enough_workers) || last) {
+            plan->texture_size = texture_size;
+            plan->worker_count = worker_count;
+            plan->strip_threads = strip_threads;
+            plan->little_texture_memory = !needs->soft_render &&
+                needs->texture_memory != 0 &&
+                card_bytes > needs->texture_memory;
+            break;
+        }
+    }
+
+    jessu_printf(THREAD_GL, "Memory plan: %lu MB budget, %d texture, "
+            "%d workers, %d strip threads, %d KB of filter tables%s",
+            (unsigned long)(budget/(1024*1024)), plan->texture_size,
+            plan->worker_count, plan->strip_threads,
+            plan->contrib_cache_bytes/1024,
+            plan->little_texture_memory ? ", little texture memory" : "");
+}
+
+bool memory_is_short()
+{
+    DWORD now = GetTickCount();
+
+    if (last_check != 0 && now - last_check < GOVERNOR_CHECK_MILLISECONDS) {
+        return is_short;
+    }
+    last_check = now;
+
+    MEMORYSTATUS status;
+    status.dwLength = sizeof(status);
+    GlobalMemoryStatus(&status);
+
+    if (!is_short && (status.dwMemoryLoad >= GOVERNOR_SHORT_LOAD ||
+                status.dwAvailPhys < GOVERNOR_SHORT_BYTES)) {
+
+        jessu_printf(THREAD_GL, "Memory is short: %lu MB free, %lu%% in use",
+                (unsigned long)(status.dwAvailPhys/(1024*1024)),
+                (unsigned long)status.dwMemoryLoad);
+        is_short = true;
+    } else if (is_short && status.dwMemoryLoad <= GOVERNOR_PLENTY_LOAD &&
+            status.dwAvailPhys >= GOVERNOR_PLENTY_BYTES) {
+
+        jessu_printf(THREAD_GL, "Memory is plentiful: %lu MB free, "
+                "%lu%% in use",
+                (unsigned long)(status.dwAvailPhys/(1024*1024)),
+                (unsigned long)status.dwMemoryLoad);
+        is_short = false;
+    }
+
+    return is_short;
+}
+
+void note_memory_short()
+{
+    if (!is_short) {
+        jessu_printf(THREAD_GL, "Windows says memory is short");
+    }
+
+    is_short = true;
+    last_check = GetTickCount();
+}
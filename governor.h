@@ -0,0 +1,51 @@
+/*
+ * Governor.h
+ *
+ * Decides how much memory the slide show can use and what to spend it
+ * on, from a budget or from what the machine has free, and notices when
+ * the machine runs short while we're going.
+ *
+ */
+
+#ifndef __GOVERNOR_H__
+#define __GOVERNOR_H__
+
+
+#include <windows.h>
+
+struct MEMORY_PLAN {
+    DWORD budget;               // bytes
+    int texture_size;
+    int worker_count;
+    int contrib_cache_bytes;
+
+    // threads decoding big pictures in strips, all workers together.  1
+    // for none.
+    int strip_threads;
+
+    // the card can't take 32-bit textures of that size twice over
+    bool little_texture_memory;
+};
+
+struct MEMORY_NEEDS {
+    DWORD budget;               // bytes, or 0 to go by the free memory
+    bool less_memory;           // the "use less memory" option
+    bool small_window;          // the preview in the control panel
+    bool soft_render;
+    int processor_count;
+    int maximum_workers;
+    DWORD texture_memory;       // on the card, or 0 if we can't tell
+};
+
+void make_memory_plan(MEMORY_NEEDS *needs, MEMORY_PLAN *plan);
+
+// call now and then.  true from when the machine gets short of memory
+// until it has plenty again.
+bool memory_is_short();
+
+// Windows says it's short (WM_COMPACTING).  memory_is_short() says so
+// until there's plenty again.
+void note_memory_short();
+
+
+#endif /* __GOVERNOR_H__ */
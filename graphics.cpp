@@ -1803,17 +1803,7 @@ void setup_d3d_rendering(HWND hWnd)
     renderUnits.m_RenderUnits[0].pd3dDevice = NULL;
 #endif
 
-    // create our vertex buffer
-    if (FAILED(g_pd3dDevice->CreateVertexBuffer(
-                    4*sizeof(textured_colored_2d_vertex),
-                    0, D3DFVF_CUSTOMVERTEX,
-                    D3DPOOL_DEFAULT, &g_pVB))) {
-
-        jessu_printf(THREAD_GL, "Failed to create Direct3D vertex buffer");
-        cleanup_d3d();
-        set_error_message("Cannot create vertex buffer");
-        return;
-    }
+    // the vertex buffer for the tiles is made with the textures
 
     // Turn off culling
     g_pd3dDevice->SetRenderState(D3DRS_CULLMODE, D3DCULL_NONE);
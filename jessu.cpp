@@ -19,9 +19,19 @@
 #include "scaletile.h"
 #include "config.h"
 #include "benchmark.h"
+#include "filterbench.h"
+#include "cpubench.h"
+#include "stagetime.h"
+#include "tracefile.h"
+#include "debuglog.h"
+#include "memuse.h"
+#include "tileslab.h"
+#include "governor.h"
 #include "text.hpp"
 #include "jessu.h"
 #include "graphics.hpp"
+#include "softrender.h"
+#include "videofile.h"
 
 #if !USE_D3D
 #  include <GL/gl.h>
@@ -63,6 +73,25 @@
 
 #define USE_SMALL_WINDOW        0       // small normal window for testing
 
+// one texture per slide when the card takes textures that big, otherwise
+// 256x256 tiles
+#define USE_TEXTURE_ATLAS       1
+
+// how much of a slide's texture to download each time through idle()
+#define DOWNLOAD_TEXELS_PER_IDLE    (256*256)
+
+// "/render": the size and rate of the video.  25 frames a second keeps
+// the slide clock on whole milliseconds.
+#define RENDER_WIDTH            1280
+#define RENDER_HEIGHT           720
+#define RENDER_FRAMES_PER_SECOND    25
+
+// give up rendering when no picture turns up for this long
+#define RENDER_WAIT_SECONDS     60
+
+// while a slide waits for its picture, look again at least this often
+#define RENDER_POLL_MILLISECONDS    50
+
 #if PURIFY_MODE || USE_SMALL_WINDOW
 #define ALLOW_TOPMOST           0
 #else
@@ -74,6 +103,7 @@
 #define PER_FRAME_OUTPUT        0           // verbose!
 #define MALLOC_DEBUGGING        0
 #define OUTPUT_FILENAME         "\\jessu.log"
+#define FILTERS_FILENAME        "\\jessu_filters.txt"
 
 #define EVAL_MAX_IMAGES         10
 
@@ -152,6 +182,29 @@ struct SLIDE_INFO {
      */
     int being_displayed;
 
+    /*
+     * The "refine_pending" flag is set when the tiles just made ready
+     * are only a quick stand-in for the picture (the EXIF preview or a
+     * coarse pass of a progressive JPEG).  The slot won't be given the
+     * next picture until the better version has arrived (or failed).
+     */
+    int refine_pending;
+
+    /*
+     * The "texture_is_refinement" flag goes along with "texture_ready"
+     * and tells the GL thread that the tiles are a better version of
+     * the picture it already has, so it can download them even though
+     * the slide may already be on the screen.  This happens after an
+     * EXIF preview and after each coarse pass of a progressive JPEG.
+     */
+    int texture_is_refinement;
+
+    /* The file that's in "tile" (NOT ALLOCATED) */
+    char *filename;
+
+    /* The place of that file in the order of pictures, or -1 */
+    int sequence;
+
     /* This is the nice filename that's displayed if the user presses "f" */
     char beautiful_filename[MAX_PATH];
     char next_beautiful_filename[MAX_PATH];
@@ -184,6 +237,8 @@ struct SLIDE_INFO {
     /* texture tiles */
     unsigned char **tile;  /* row-major order */
     int tile_number;       /* number of tiles that have been downloaded */
+    int tile_row;          /* rows of the full-size level downloaded, and
+                              one more once the mipmaps are */
 
 #if USE_D3D
     /* This is an array of textures for Direct3D */
@@ -192,8 +247,16 @@ struct SLIDE_INFO {
     unsigned int *texture_id;
 #endif
 
+    /* what gets drawn when rendering in software, downloaded into
+       like the textures */
+    unsigned char **soft_tile;
+
     SLIDE_INFO() {
         filename_notice = NULL;
+        filename = NULL;
+        sequence = -1;
+        tile = NULL;
+        soft_tile = NULL;
     }
 
     ~SLIDE_INFO() {
@@ -203,20 +266,86 @@ struct SLIDE_INFO {
 
 static SLIDE_INFO slide[2];
 
+/*
+ * Pictures are decoded ahead of time by a pool of worker threads, each
+ * into its own prefetch entry with its own set of tiles.  When a slide's
+ * slot frees up, the next picture in order is moved into it by swapping
+ * the tile arrays, so the order doesn't depend on which worker finishes
+ * first.  Everything here is protected by "prefetch_lock".
+ */
+enum PREFETCH_STATE {
+    PREFETCH_EMPTY,
+    PREFETCH_LOADING,
+    PREFETCH_READY,
+    PREFETCH_FAILED
+};
+
+struct PREFETCH_ENTRY {
+    PREFETCH_STATE state;
+
+    /* Order in which the pictures are shown */
+    int sequence;
+
+    /* Load the EXIF preview instead of the picture */
+    int preview;
+
+    /* This is a better version of a picture that's already in a slide */
+    int is_refinement;
+
+    /* A better version of this one will follow */
+    int refine_pending;
+
+    char *filename;             /* NOT ALLOCATED */
+    MISC_INFO *misc_info;
+    char beautiful_filename[MAX_PATH];
+    int width, height;
+    unsigned char **tile;
+};
+
+// never more than this many workers, however many processors there are
+#define MAXIMUM_WORKER_THREADS      4
+
+// how long an idle worker waits before looking for something to do
+#define WORKER_IDLE_MILLISECONDS    100
+
+static int processor_count;
+static int worker_count;
+static int prefetch_count;      // one more than "worker_count"
+static PREFETCH_ENTRY prefetch[MAXIMUM_WORKER_THREADS + 1];
+static CRITICAL_SECTION prefetch_lock;
+static int next_load_sequence;      // given to the next picture loaded
+static int loading_limit;           // pictures loaded at once
+static int strip_thread_limit;      // threads decoding in strips at once
+static int next_display_sequence;   // the next picture to go in a slide
+
+// the EXIF preview is showing and the real picture still needs loading
+static int refine_wanted_sequence = -1;
+static char *refine_wanted_filename;
+
 static int g_worker_thread_should_quit;
 
+// set when a picture goes into a slide's slot, for the video rendering
+// to wait on
+static HANDLE picture_ready_event;
+
 static char *directory = NULL;
 
-static int tile_count;
-static int tile_count_x;
-static int tile_count_y;
-static int tile_size_x;
-static int tile_size_y;
-static int texture_size_x;
-static int texture_size_y;
+static TILE_LAYOUT tile_layout;
+static int tile_levels;     // mipmap levels, including the full-size one
+static int tile_bytes;      // the whole mip chain
+
+// where the tile data for the slides and prefetch entries comes from
+static TILE_SLAB tile_slab;
+
+// "/budget": the bytes we can use, or 0 to go by the free memory
+static DWORD memory_budget = 0;
+static MEMORY_PLAN memory_plan;
+static bool memory_was_short = false;
+static int tile_format;     // TEXEL_FORMAT_, what the card gets
 
-static float tile_edge_texel_low_bias;
-static float tile_edge_texel_high_bias;
+// the width of the tile apron in texture coordinates
+static float tile_apron_s;
+static float tile_apron_t;
 
 static int g_frame_count = 0;
 static bool g_show_lines = false;
@@ -246,6 +375,23 @@ bool in_fullscreen;   // in_screensaver || in_slideshow
 static char *slideshow_file = NULL;
 static bool do_benchmark = false;
 
+// "/render": the slide show goes to this file, with no window, on a
+// clock that moves a frame at a time
+static char *render_filename = NULL;
+static int render_seconds;
+static DWORD render_time;   // milliseconds since the first frame
+
+// "/stages": the stage times go to this file at the end and when 'T' is
+// pressed
+static char *stages_filename = NULL;
+
+// "/trace": the timeline of the threads goes to this file, also at the
+// end and on 'T'
+static char *trace_filename = NULL;
+
+// "/memory": where the memory goes, at the end and when 'M' is pressed
+static char *memory_filename = NULL;
+
 static int loading_jpeg;
 static int scaling_image;
 static int downloading_texture;
@@ -259,6 +405,7 @@ static double actual_paused_delta_y;
 static float speed = 1;
 
 static bool display_filename = false;
+static bool fast_start = false;
 static char base_directory[MAX_PATH];
 
 #if ALWAYS_PRINT_DEBUGGING
@@ -283,6 +430,11 @@ static HDC gl_device;
 static HGLRC gl_context = NULL;
 #endif
 
+// draw the slides with softrender.cpp instead of the graphics board,
+// with /soft or when the board can't be set up
+static bool soft_render = false;
+static SOFT_FRAME soft_frame;
+
 static bool quit_requested = false;
 static bool paint_scheduled = false;
 
@@ -322,6 +474,20 @@ hide_cursor(void)
     }
 }
 
+static bool
+rendering_is_set_up(void)
+{
+    if (soft_render) {
+        return true;
+    }
+
+#if USE_D3D
+    return g_pD3D != NULL;
+#else
+    return gl_context != NULL;
+#endif
+}
+
 #if !USE_D3D
 static void cleanup_gl()
 {
@@ -344,8 +510,6 @@ probe_rendering_capabilities(void)
     }
 
     // Nothing yet to probe from D3D
-    tile_edge_texel_low_bias = TILE_SHRINK;
-    tile_edge_texel_high_bias = TILE_SHRINK;
 
 #else
     if (gl_context == NULL) {
@@ -378,13 +542,12 @@ probe_rendering_capabilities(void)
                         has_SGIS_texture_edge_clamp ||
                         has_SGI_texture_edge_clamp;
 
+    /*
+     * The tile aprons keep bilinear filtering off the edge, but the small
+     * mipmap levels can still reach past it, so clamp to the edge when
+     * we can.
+     */
     if (has_clamp_to_edge) {
-
-        /* If has clamp, don't do texel edge hack, just use clamp-to-edge. */
-
-        tile_edge_texel_low_bias = 0.0f;
-        tile_edge_texel_high_bias = 0.0f;
-
         /*
          * Since Microsoft's headers in VC 6.0 don't have GL_CLAMP_TO_EDGE,
          * just use the value.
@@ -392,105 +555,318 @@ probe_rendering_capabilities(void)
         texture_wrap_mode = 0x812f; // GL_CLAMP_TO_EDGE
 
     } else {
-
-        /*
-         * Include texel edge bias to cover up black lines caused
-         * by rasterizers that apparently rasterize slightly off
-         * spec.  Pray it doesn't show up too obviously in pictures.
-         * Low-resolution screens may show a discontinuity between
-         * tiles.
-         */
-
-        tile_edge_texel_low_bias = 0.5f;
-        tile_edge_texel_high_bias = 0.5f;
-
         texture_wrap_mode = GL_CLAMP;
-
     }
 
     if (print_debugging) {
         jessu_printf(THREAD_GL, "has_clamp_to_edge: %d", has_clamp_to_edge);
-        jessu_printf(THREAD_GL,
-                "tile_edge_texel_low_bias: %g", tile_edge_texel_low_bias);
-        jessu_printf(THREAD_GL,
-                "tile_edge_texel_high_bias: %g", tile_edge_texel_high_bias);
         jessu_printf(THREAD_GL, "texture_wrap_mode: %x", texture_wrap_mode);
     }
 #endif
 }
 
+#if USE_D3D
+static bool
+card_takes_texture_format(D3DFORMAT format)
+{
+    D3DDEVICE_CREATION_PARAMETERS parameters;
+    D3DDISPLAYMODE mode;
+
+    g_pd3dDevice->GetCreationParameters(&parameters);
+    g_pd3dDevice->GetDisplayMode(&mode);
+
+    return SUCCEEDED(g_pD3D->CheckDeviceFormat(parameters.AdapterOrdinal,
+                parameters.DeviceType, mode.Format, 0, D3DRTYPE_TEXTURE,
+                format));
+}
+#endif
+
+// the tiles for every slide and prefetch entry, all from "tile_slab".
+// any that were set up before go back first.  returns false if there
+// isn't the memory.
+static bool
+allocate_tiles()
+{
+    int i;
+
+    for (i = 0; i < prefetch_count; i++) {
+        if (prefetch[i].tile != NULL) {
+            put_tile_set(&tile_slab, prefetch[i].tile);
+            prefetch[i].tile = NULL;
+        }
+    }
+    for (i = 0; i < 2; i++) {
+        if (slide[i].tile != NULL) {
+            put_tile_set(&tile_slab, slide[i].tile);
+            slide[i].tile = NULL;
+        }
+        if (slide[i].soft_tile != NULL) {
+            put_tile_set(&tile_slab, slide[i].soft_tile);
+            slide[i].soft_tile = NULL;
+        }
+    }
+
+    int set_count = prefetch_count + 2;
+    if (soft_render) {
+        set_count += 2;
+    }
+
+    if (!set_tile_slab_size(&tile_slab, set_count, tile_layout.tile_count,
+                tile_bytes)) {
+
+        return false;
+    }
+
+    for (i = 0; i < prefetch_count; i++) {
+        prefetch[i].tile = get_tile_set(&tile_slab);
+    }
+    for (i = 0; i < 2; i++) {
+        slide[i].tile = get_tile_set(&tile_slab);
+        if (soft_render) {
+            slide[i].soft_tile = get_tile_set(&tile_slab);
+        }
+    }
+
+    return true;
+}
+
+#if USE_D3D
+// puts the quads for all the tiles, in the same order as the textures,
+// in "g_pVB".  they never change: the slide's position goes in the view
+// transform and its fade in the texture factor.
+static bool
+make_tile_vertex_buffer()
+{
+    int vertex_count = tile_layout.tile_count*4;
+
+    if (FAILED(g_pd3dDevice->CreateVertexBuffer(
+                    vertex_count*sizeof(textured_colored_2d_vertex),
+                    D3DUSAGE_WRITEONLY, D3DFVF_CUSTOMVERTEX,
+                    D3DPOOL_MANAGED, &g_pVB))) {
+
+        jessu_printf(THREAD_GL, "Failed to create Direct3D vertex buffer");
+        return false;
+    }
+
+    textured_colored_2d_vertex *vertices;
+    if (FAILED(g_pVB->Lock(0, 0, (BYTE **)&vertices, 0))) {
+        jessu_printf(THREAD_GL, "Cannot lock vertex structure");
+        return false;
+    }
+
+    for (int j = 0; j < tile_layout.tile_count; j++) {
+        float x1, y1, x2, y2;
+
+        get_tile_position(&tile_layout, j, &x1, &y1, &x2, &y2);
+
+        vertices[0].Color4f(1.0f, 1.0f, 1.0f, 1.0f);
+        vertices[0].TexCoord2f(0 + tile_apron_s, 1 - tile_apron_t);
+        vertices[0].Vertex2f(x1, y1);
+
+        vertices[1].Color4f(1.0f, 1.0f, 1.0f, 1.0f);
+        vertices[1].TexCoord2f(1 - tile_apron_s, 1 - tile_apron_t);
+        vertices[1].Vertex2f(x2, y1);
+
+        vertices[2].Color4f(1.0f, 1.0f, 1.0f, 1.0f);
+        vertices[2].TexCoord2f(1 - tile_apron_s, 0 + tile_apron_t);
+        vertices[2].Vertex2f(x2, y2);
+
+        vertices[3].Color4f(1.0f, 1.0f, 1.0f, 1.0f);
+        vertices[3].TexCoord2f(0 + tile_apron_s, 0 + tile_apron_t);
+        vertices[3].Vertex2f(x1, y2);
+
+        vertices += 4;
+    }
+
+    g_pVB->Unlock();
+
+    return true;
+}
+#endif
+
 static void
 set_up_textures(int small_window, int use_less_memory)
 {
-#if USE_D3D
-    if (g_pD3D == NULL) {
+    if (!rendering_is_set_up()) {
         return;
     }
-#else
-    if (gl_context == NULL) {
-        return;
+
+    int texture_size;
+    int maximum_tile_size_x, maximum_tile_size_y;
+    MEMORY_NEEDS needs;
+
+    // the texture size and how many pictures are in flight at once come
+    // from the memory we have
+    needs.budget = memory_budget;
+    needs.less_memory = use_less_memory != 0;
+    needs.small_window = small_window != 0;
+    needs.soft_render = soft_render;
+    needs.processor_count = processor_count;
+    needs.maximum_workers = MAXIMUM_WORKER_THREADS;
+    needs.texture_memory = 0;
+#if USE_D3D
+    if (!soft_render) {
+        needs.texture_memory = g_pd3dDevice->GetAvailableTextureMem();
     }
 #endif
+    make_memory_plan(&needs, &memory_plan);
 
-    if (small_window) {
-        tile_size_x = 128;
-        tile_size_y = 128;
-        texture_size_x = 128;
-        texture_size_y = 128;
+    texture_size = memory_plan.texture_size;
+    worker_count = memory_plan.worker_count;
+    prefetch_count = worker_count + 1;
+    loading_limit = worker_count;
+    strip_thread_limit = memory_plan.strip_threads;
+    set_contrib_cache_maximum(memory_plan.contrib_cache_bytes);
+
+    if (soft_render) {
+        // the software renderer takes any size, and one tile is the
+        // least work
+        maximum_tile_size_x = texture_size;
+        maximum_tile_size_y = texture_size;
     } else {
+#if USE_D3D
+        D3DCAPS8 d3dCaps;
+        g_pd3dDevice->GetDeviceCaps( &d3dCaps );
+
+        jessu_printf(THREAD_GL, "Max texture size: %dx%d\n",
+                (int)d3dCaps.MaxTextureWidth,
+                (int)d3dCaps.MaxTextureHeight);
+
+        maximum_tile_size_x = (int)d3dCaps.MaxTextureWidth;
+        maximum_tile_size_y = (int)d3dCaps.MaxTextureHeight;
+#else
+        GLint maximum_texture_size;
+        glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maximum_texture_size);
+
+        maximum_tile_size_x = maximum_texture_size;
+        maximum_tile_size_y = maximum_texture_size;
+#endif
+
+#if !USE_TEXTURE_ATLAS
         // Direct3D tips says that 256x256 textures are the fastest:
-        tile_size_x = 256;
-        tile_size_y = 256;
-        if (use_less_memory) {
-            // uses 1/8 as much memory
-            texture_size_x = 512;
-            texture_size_y = 512;
-        } else {
-            texture_size_x = 1024;
-            texture_size_y = 1024;
+        if (maximum_tile_size_x > 256) {
+            maximum_tile_size_x = 256;
+        }
+        if (maximum_tile_size_y > 256) {
+            maximum_tile_size_y = 256;
         }
+#endif
     }
 
+    make_tile_layout(&tile_layout, texture_size, texture_size,
+            maximum_tile_size_x, maximum_tile_size_y);
+    jessu_printf(THREAD_GL, "Tiles: %dx%d of %dx%d",
+            tile_layout.tile_count_x, tile_layout.tile_count_y,
+            tile_layout.tile_size_x, tile_layout.tile_size_y);
+
+    tile_apron_s = TILE_APRON/(float)tile_layout.tile_size_x;
+    tile_apron_t = TILE_APRON/(float)tile_layout.tile_size_y;
+
+    // the workers make the mip chains, so they're in the tile data too
+    tile_levels = get_mipmap_level_count(tile_layout.tile_size_x,
+            tile_layout.tile_size_y);
+    tile_bytes = get_mipmap_bytes(tile_layout.tile_size_x,
+            tile_layout.tile_size_y);
+    jessu_printf(THREAD_GL, "Tile data: %d tiles of %d levels, %d KB total",
+            (prefetch_count + 2)*tile_layout.tile_count, tile_levels,
+            (prefetch_count + 2)*tile_layout.tile_count*(tile_bytes/1024));
+
+    /*
+     * The workers turn the tiles into what the card gets.  DXT1 is an
+     * eighth the size of 32-bit texels and 16-bit is half, on the card
+     * and to download.  16-bit is for cards running a 16-bit desktop,
+     * short of texture memory, or without 32-bit textures at all.  The
+     * workers still scale into full-size tile data, so only the card
+     * (and Direct3D's copy of managed textures) saves the memory.
+     */
+    tile_format = TEXEL_FORMAT_A8R8G8B8;
 #if USE_D3D
-    D3DCAPS8 d3dCaps;
-    g_pd3dDevice->GetDeviceCaps( &d3dCaps );
+    if (!soft_render) {
+        D3DDISPLAYMODE mode;
+        g_pd3dDevice->GetDisplayMode(&mode);
 
-    jessu_printf(THREAD_GL, "Max texture size: %dx%d\n",
-            (int)d3dCaps.MaxTextureWidth,
-            (int)d3dCaps.MaxTextureHeight);
+        bool few_bits = mode.Format == D3DFMT_R5G6B5 ||
+            mode.Format == D3DFMT_X1R5G5B5;
 
-    while (tile_size_x > 64 && tile_size_x > (int)d3dCaps.MaxTextureWidth) {
-        tile_size_x /= 2;
-    }
-    while (tile_size_y > 64 && tile_size_y > (int)d3dCaps.MaxTextureHeight) {
-        tile_size_y /= 2;
+        // with room to spare, or the managed textures get swapped in and
+        // out during the fades
+        bool little_memory = memory_plan.little_texture_memory;
+
+        jessu_printf(THREAD_GL, "Available texture memory: %d KB",
+                (int)(g_pd3dDevice->GetAvailableTextureMem()/1024));
+
+        if (get_compress_textures() &&
+                card_takes_texture_format(D3DFMT_DXT1)) {
+
+            tile_format = TEXEL_FORMAT_DXT1;
+        } else if (few_bits || little_memory ||
+                !card_takes_texture_format(D3DFMT_A8R8G8B8)) {
+
+            if (card_takes_texture_format(D3DFMT_A1R5G5B5)) {
+                tile_format = TEXEL_FORMAT_A1R5G5B5;
+            } else if (card_takes_texture_format(D3DFMT_R5G6B5)) {
+                // no alpha, so the picture's edges are hard
+                tile_format = TEXEL_FORMAT_R5G6B5;
+            }
+        }
+
+        switch (tile_format) {
+            case TEXEL_FORMAT_A1R5G5B5:
+                preferred_texture_internal_format = D3DFMT_A1R5G5B5;
+                break;
+
+            case TEXEL_FORMAT_R5G6B5:
+                preferred_texture_internal_format = D3DFMT_R5G6B5;
+                break;
+
+            case TEXEL_FORMAT_DXT1:
+                preferred_texture_internal_format = D3DFMT_DXT1;
+                break;
+
+            default:
+                preferred_texture_internal_format = D3DFMT_A8R8G8B8;
+                break;
+        }
     }
 #endif
+    jessu_printf(THREAD_GL, "Texel format %d: %d KB on the card",
+            tile_format, 2*tile_layout.tile_count*
+            get_texel_format_mipmap_bytes(tile_format,
+                tile_layout.tile_size_x, tile_layout.tile_size_y,
+                tile_levels)/1024);
 
-    tile_count_x = texture_size_x/tile_size_x;
-    tile_count_y = texture_size_y/tile_size_y;
-    tile_count = tile_count_x*tile_count_y;
+    int i;
+    for (i = 0; i < prefetch_count; i++) {
+        prefetch[i].state = PREFETCH_EMPTY;
+    }
 
-    for (int i = 0; i < 2; i++) {
-        slide[i].tile = (unsigned char **)jessu_malloc(THREAD_GL,
-                tile_count*sizeof(unsigned char *), "tile pointers");
+    if (!allocate_tiles()) {
+        set_error_message("Cannot allocate memory for the pictures");
+        return;
+    }
+
+    for (i = 0; i < 2; i++) {
+        if (soft_render) {
+            continue;
+        }
 
 #if USE_D3D
         slide[i].textures = (IDirect3DTexture8 **)jessu_malloc(THREAD_GL,
-                tile_count*sizeof(IDirect3DTexture8 *), "tile textures");
+                tile_layout.tile_count*sizeof(IDirect3DTexture8 *),
+                "tile textures");
 #else
         slide[i].texture_id = (unsigned int *)jessu_malloc(THREAD_GL,
-                tile_count*sizeof(unsigned int), "tile texture id");
-        glGenTextures(tile_count, slide[i].texture_id);
+                tile_layout.tile_count*sizeof(unsigned int),
+                "tile texture id");
+        glGenTextures(tile_layout.tile_count, slide[i].texture_id);
 #endif
 
-        for (int j = 0; j < tile_count; j++) {
-            slide[i].tile[j] = (unsigned char *)jessu_malloc(THREAD_GL,
-                    tile_size_x*tile_size_y*BYTES_PER_TEXEL, "tile data");
-
+        for (int j = 0; j < tile_layout.tile_count; j++) {
 #if USE_D3D
-            HRESULT result = g_pd3dDevice->CreateTexture(tile_size_x,
-                    tile_size_y, 1, 0, preferred_texture_internal_format,
+            HRESULT result = g_pd3dDevice->CreateTexture(
+                    tile_layout.tile_size_x, tile_layout.tile_size_y,
+                    tile_levels, 0,
+                    preferred_texture_internal_format,
                     D3DPOOL_MANAGED, &slide[i].textures[j]);
             if (FAILED(result)) {
                 jessu_printf(THREAD_GL, "CreateTexture failed (%d)",
@@ -506,15 +882,31 @@ set_up_textures(int small_window, int use_less_memory)
                     texture_wrap_mode);
             glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T,
                     texture_wrap_mode);
-            /* we're not doing mipmapping */
-
-            /* glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
-               GL_LINEAR_MIPMAP_LINEAR); */
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+                    GL_LINEAR_MIPMAP_LINEAR);
             glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+            // make room for every level, the downloads fill them in
+            for (int level = 0; level < tile_levels; level++) {
+                int size_x, size_y;
+
+                get_mipmap_level_size(tile_layout.tile_size_x,
+                        tile_layout.tile_size_y, level, &size_x, &size_y);
+                glTexImage2D(GL_TEXTURE_2D, level,
+                        preferred_texture_internal_format, size_x, size_y,
+                        0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+            }
 #endif
         }
     }
+
+#if USE_D3D
+    if (!soft_render && !make_tile_vertex_buffer()) {
+        set_error_message("Cannot create vertex buffer");
+        cleanup_d3d();
+        return;
+    }
+#endif
 }
 
 static double
@@ -580,48 +972,437 @@ make_beautiful_filename(char *in, char *out, int out_len)
     }
 }
 
+// the state of the pipeline for the timeline: pictures being loaded,
+// pictures loaded and waiting for a slot, slots waiting for the GL
+// thread, and the bytes of tiles not yet on the graphics board.  call
+// with "prefetch_lock".
 static void
-load_next_picture(Vertical_scaler &vertical_scaler, SLIDE_INFO *info)
+trace_pipeline()
 {
-try_next_picture:
-    char *filename = get_next_filename(&info->next_misc_info);
+    int loading = 0;
+    int waiting = 0;
+    int slides_ready = 0;
+    int upload_bytes = 0;
+    int i;
 
-    if (print_debugging) {
-        char *s = strrchr(filename, '\\');
-        if (s != NULL) {
-            s++;
-        } else {
-            s = filename;
+    if (!trace_enabled()) {
+        return;
+    }
+
+    for (i = 0; i < prefetch_count; i++) {
+        if (prefetch[i].state == PREFETCH_LOADING) {
+            loading++;
+        } else if (prefetch[i].state == PREFETCH_READY) {
+            waiting++;
+        }
+    }
+
+    for (i = 0; i < 2; i++) {
+        if (slide[i].texture_ready) {
+            slides_ready++;
+            upload_bytes += (tile_layout.tile_count - slide[i].tile_number)*
+                tile_bytes;
+        }
+    }
+
+    trace_counter("pictures_loading", loading);
+    trace_counter("pictures_waiting", waiting);
+    trace_counter("slides_ready", slides_ready);
+    trace_counter("upload_bytes", upload_bytes);
+}
+
+// moves a finished picture (or with "copy", a coarse version of one that's
+// still being decoded) into a slide's slot.  call with "prefetch_lock".
+static void
+publish_picture(PREFETCH_ENTRY *entry, SLIDE_INFO *info, bool copy)
+{
+    if (copy) {
+        for (int j = 0; j < tile_layout.tile_count; j++) {
+            memcpy(info->tile[j], entry->tile[j], tile_bytes);
         }
-        jessu_printf(THREAD_WORKER, "loading \"%s\"", s);
+    } else {
+        unsigned char **tile = info->tile;
+
+        info->tile = entry->tile;
+        entry->tile = tile;
     }
 
-    make_beautiful_filename(filename, info->next_beautiful_filename,
-            sizeof(info->next_beautiful_filename));
-    jessu_printf(THREAD_WORKER, "beauty: \"%s\"",
-            info->next_beautiful_filename);
+    if (!entry->is_refinement) {
+        strcpy(info->next_beautiful_filename, entry->beautiful_filename);
+        info->next_misc_info = entry->misc_info;
+        info->sequence = entry->sequence;
+        next_display_sequence++;
+    }
+
+    info->filename = entry->filename;
+    info->width = entry->width;
+    info->height = entry->height;
+    info->texture_is_refinement = entry->is_refinement;
+    info->refine_pending = copy || entry->refine_pending;
+
+    jessu_printf(THREAD_WORKER, "picture %d%s is ready for %d",
+            entry->sequence, copy ? " (coarse)" : "", info - slide);
 
-    FILE *imgFile = fopen(filename, "rb");
+    /* tell GL thread that it can download this texture */
+    info->texture_ready = 1;
+    if (picture_ready_event != NULL) {
+        SetEvent(picture_ready_event);
+    }
+
+    trace_pipeline();
+}
+
+// the slot that should get the next picture, or NULL if neither can
+// take it yet.  call with "prefetch_lock".
+static SLIDE_INFO *
+find_slide_for_next_picture()
+{
+    for (int i = 0; i < 2; i++) {
+        if (!slide[i].texture_ready && !slide[i].texture_used &&
+                !slide[i].refine_pending) {
+
+            return &slide[i];
+        }
+    }
+
+    return NULL;
+}
+
+// the slot showing the picture "entry" is a better version of, or NULL.
+// call with "prefetch_lock".
+static SLIDE_INFO *
+find_slide_for_refinement(PREFETCH_ENTRY *entry)
+{
+    for (int i = 0; i < 2; i++) {
+        if (slide[i].sequence == entry->sequence) {
+            return &slide[i];
+        }
+    }
+
+    return NULL;
+}
+
+// moves any pictures that are ready into slots that are free.  call with
+// "prefetch_lock".
+static void
+dispatch_pictures()
+{
+    PREFETCH_ENTRY *entry;
+    SLIDE_INFO *info;
+    int i;
+
+    // better versions of pictures already in slides
+    for (i = 0; i < prefetch_count; i++) {
+        entry = &prefetch[i];
+
+        if (!entry->is_refinement || (entry->state != PREFETCH_READY &&
+                    entry->state != PREFETCH_FAILED)) {
+
+            continue;
+        }
+
+        info = find_slide_for_refinement(entry);
+        if (info == NULL) {
+            if (entry->sequence < next_display_sequence) {
+                // the slide has ended (end_of_slide() forgot its
+                // sequence), so it's too late
+                entry->state = PREFETCH_EMPTY;
+            }
+        } else if (entry->state == PREFETCH_FAILED) {
+            // the stand-in will have to do
+            jessu_printf(THREAD_WORKER, "Couldn't refine \"%s\"",
+                    entry->filename);
+            info->refine_pending = 0;
+            entry->state = PREFETCH_EMPTY;
+        } else if (!info->texture_ready && !info->texture_used) {
+            publish_picture(entry, info, false);
+            entry->state = PREFETCH_EMPTY;
+        }
+    }
+
+    // new pictures, in order
+    for (;;) {
+        entry = NULL;
+        for (i = 0; i < prefetch_count; i++) {
+            if (prefetch[i].state != PREFETCH_EMPTY &&
+                    !prefetch[i].is_refinement &&
+                    prefetch[i].sequence == next_display_sequence) {
+
+                entry = &prefetch[i];
+                break;
+            }
+        }
+
+        if (entry == NULL || entry->state == PREFETCH_LOADING) {
+            break;
+        }
+
+        if (entry->state == PREFETCH_FAILED) {
+            entry->state = PREFETCH_EMPTY;
+            next_display_sequence++;
+            continue;
+        }
+
+        info = find_slide_for_next_picture();
+        if (info == NULL) {
+            break;
+        }
+
+        publish_picture(entry, info, false);
+        entry->state = PREFETCH_EMPTY;
+    }
+}
+
+/*
+ * Hands coarse passes of a progressive JPEG to the GL thread while a
+ * worker keeps decoding.  Only bothers when the display is waiting for
+ * this picture, since otherwise the GL thread wouldn't download them
+ * anyway.  The passes are copied into the slot so the worker can keep
+ * writing its own tiles.
+ */
+class Prefetch_refiner : public Partial_image_sink {
+public:
+    Prefetch_refiner(PREFETCH_ENTRY *entry) {
+        m_entry = entry;
+    }
+
+    bool Wants_partial_image() {
+        // the video waits for the whole picture instead
+        if (render_filename != NULL) {
+            return false;
+        }
+
+        EnterCriticalSection(&prefetch_lock);
+        bool wants = Find_slide() != NULL;
+        LeaveCriticalSection(&prefetch_lock);
+
+        return wants;
+    }
+
+    void Publish_partial_image() {
+        EnterCriticalSection(&prefetch_lock);
+
+        SLIDE_INFO *info = Find_slide();
+        if (info != NULL) {
+            publish_picture(m_entry, info, true);
+
+            // anything after this is a better version of the same picture
+            m_entry->is_refinement = 1;
+        }
+
+        LeaveCriticalSection(&prefetch_lock);
+    }
+
+    void Wait_until_writable() {
+        // the slot has a copy, our tiles are always ours
+    }
+
+private:
+    SLIDE_INFO *Find_slide() {
+        SLIDE_INFO *info;
+
+        if (m_entry->is_refinement) {
+            info = find_slide_for_refinement(m_entry);
+            if (info != NULL && !info->texture_ready && !info->texture_used) {
+                return info;
+            }
+        } else if (m_entry->sequence == next_display_sequence) {
+            info = find_slide_for_next_picture();
+            if (info != NULL && !info->texture_downloaded) {
+                return info;
+            }
+        }
+
+        return NULL;
+    }
+
+    PREFETCH_ENTRY *m_entry;
+};
+
+// how many threads a big picture may be decoded on in strips.  the
+// workers each have a processor already, so the processors (or as many
+// strip threads as the memory plan allows) are shared among the pictures
+// being loaded rather than each one taking all of them.  call with
+// "prefetch_lock".
+static int
+get_strip_thread_count()
+{
+    int loading = 0;
+
+    for (int i = 0; i < prefetch_count; i++) {
+        if (prefetch[i].state == PREFETCH_LOADING) {
+            loading++;
+        }
+    }
+    if (loading < 1) {
+        loading = 1;
+    }
+
+    return strip_thread_limit/loading;
+}
+
+static bool
+load_picture(Vertical_scaler &vertical_scaler, PREFETCH_ENTRY *entry)
+{
+    Trace_span span(entry->preview ? "load_preview" : "load_picture");
+    Prefetch_refiner refiner(entry);
+
+    STAGE_CLOCK start = get_stage_clock();
+    trace_begin("file_open");
+    FILE *imgFile = fopen(entry->filename, "rb");
+    trace_end("file_open");
+    record_stage_time(STAGE_FILE_OPEN, start);
     if (imgFile == NULL) {
         jessu_printf(THREAD_WORKER, "Can't open \"%s\" for reading",
-                filename);
-        _sleep(100);
-        goto try_next_picture;
+                entry->filename);
+        return false;
+    }
+
+    int success;
+    if (entry->preview) {
+        success = read_image_preview(entry->filename, imgFile,
+                vertical_scaler, &entry->width, &entry->height);
+    } else {
+        EnterCriticalSection(&prefetch_lock);
+        int strip_threads = get_strip_thread_count();
+        LeaveCriticalSection(&prefetch_lock);
+
+        success = read_image(entry->filename, imgFile, vertical_scaler,
+                &entry->width, &entry->height, &refiner, strip_threads);
     }
 
-    if (!read_image(filename, imgFile, vertical_scaler,
-                &info->width, &info->height)) {
+    fclose(imgFile);
+
+    if (success) {
+        jessu_printf(THREAD_WORKER, "%d by %d%s", entry->width,
+                entry->height, entry->preview ? " (preview)" : "");
+    }
+
+    return success != 0;
+}
+
+// finds an empty entry and decides what goes in it, or returns NULL if
+// there's nothing to do
+static PREFETCH_ENTRY *
+claim_prefetch_entry()
+{
+    PREFETCH_ENTRY *entry = NULL;
+    int loading = 0;
+    int i;
+
+    EnterCriticalSection(&prefetch_lock);
 
+    dispatch_pictures();
+
+    for (i = 0; i < prefetch_count; i++) {
+        if (prefetch[i].state == PREFETCH_LOADING) {
+            loading++;
+        }
+    }
+
+    // fewer at once when memory is short
+    for (i = 0; i < prefetch_count && loading < loading_limit; i++) {
+        if (prefetch[i].state == PREFETCH_EMPTY) {
+            entry = &prefetch[i];
+            break;
+        }
+    }
+
+    if (entry != NULL) {
+        entry->state = PREFETCH_LOADING;
+        entry->refine_pending = 0;
+        entry->misc_info = NULL;
+
+        if (refine_wanted_sequence >= 0) {
+            // the real version of the preview that's showing
+            entry->sequence = refine_wanted_sequence;
+            entry->filename = refine_wanted_filename;
+            entry->preview = 0;
+            entry->is_refinement = 1;
+            refine_wanted_sequence = -1;
+        } else {
+            entry->sequence = next_load_sequence++;
+            entry->filename = get_next_filename(&entry->misc_info);
+            entry->is_refinement = 0;
+
+            // show the embedded preview of the very first picture while
+            // we load the real one, so the screen isn't black while we
+            // decode.
+            entry->preview = fast_start && entry->sequence == 0;
+        }
+
+        trace_pipeline();
+    }
+
+    LeaveCriticalSection(&prefetch_lock);
+
+    return entry;
+}
+
+static void
+load_prefetch_entry(Vertical_scaler &vertical_scaler, PREFETCH_ENTRY *entry)
+{
+    if (print_debugging) {
+        char *s = strrchr(entry->filename, '\\');
+        if (s != NULL) {
+            s++;
+        } else {
+            s = entry->filename;
+        }
+        jessu_printf(THREAD_WORKER, "loading \"%s\" as picture %d", s,
+                entry->sequence);
+    }
+
+    if (!entry->is_refinement) {
+        make_beautiful_filename(entry->filename, entry->beautiful_filename,
+                sizeof(entry->beautiful_filename));
+        jessu_printf(THREAD_WORKER, "beauty: \"%s\"",
+                entry->beautiful_filename);
+    }
+
+    vertical_scaler.Set_destination_parameters(entry->tile, &tile_layout);
+    vertical_scaler.Set_mipmaps(true);
+    vertical_scaler.Set_texel_format(tile_format);
+
+    if (entry->preview) {
+        if (load_picture(vertical_scaler, entry)) {
+            EnterCriticalSection(&prefetch_lock);
+            entry->refine_pending = 1;
+            entry->state = PREFETCH_READY;
+            refine_wanted_sequence = entry->sequence;
+            refine_wanted_filename = entry->filename;
+            trace_pipeline();
+            LeaveCriticalSection(&prefetch_lock);
+            return;
+        }
+
+        // no usable preview, just load the real thing
+        entry->preview = 0;
+    }
+
+    bool success = load_picture(vertical_scaler, entry);
+
+    EnterCriticalSection(&prefetch_lock);
+    entry->state = success ? PREFETCH_READY : PREFETCH_FAILED;
+    trace_pipeline();
+    LeaveCriticalSection(&prefetch_lock);
+
+    if (!success) {
         jessu_printf(THREAD_WORKER, "Couldn't load an image from \"%s\"",
-                filename);
-        fclose(imgFile);
+                entry->filename);
         _sleep(100);
-        goto try_next_picture;
     }
+}
 
-    fclose(imgFile);
+// the clock the slides move by, in milliseconds
+static DWORD
+get_slide_time()
+{
+    if (render_filename != NULL) {
+        return render_time;
+    }
 
-    jessu_printf(THREAD_WORKER, "%d by %d", info->width, info->height);
+    return timeGetTime();
 }
 
 void
@@ -633,7 +1414,7 @@ start_slide(int i)
 
     jessu_printf(THREAD_GL, "starting slide %d", i);
 
-    slide[i].time = timeGetTime();
+    slide[i].time = get_slide_time();
 
     /* x = 0 is left, y = 0 is bottom */
 
@@ -704,6 +1485,27 @@ end_of_slide(int i)
     info->time_to_start = 0;
     info->texture_downloaded = 0;
 
+    // a better version of this picture is too late now.  forgetting the
+    // sequence makes dispatch_pictures() drop it when it arrives instead
+    // of putting it in the slot, where it would play a second time.
+    EnterCriticalSection(&prefetch_lock);
+    if (refine_wanted_sequence == info->sequence) {
+        // and not worth starting
+        refine_wanted_sequence = -1;
+    }
+    info->refine_pending = 0;
+    info->sequence = -1;
+    if (info->texture_ready && info->texture_is_refinement) {
+        // one that was still being downloaded
+        info->texture_ready = 0;
+        info->texture_used = 0;
+        info->texture_is_refinement = 0;
+        if (downloading_texture == 1 + i) {
+            downloading_texture = 0;
+        }
+    }
+    LeaveCriticalSection(&prefetch_lock);
+
     if (in_fullscreen) {
         hide_cursor();  // in case it was turned on with mouse movement
     }
@@ -733,7 +1535,7 @@ display_slide(int i)
         y = 0.5 + actual_paused_delta_y;
         scale = 1.0;
     } else {
-        seconds = (timeGetTime() - info->time)/1000.0*speed;
+        seconds = (get_slide_time() - info->time)/1000.0*speed;
 
         if (seconds > slide[i].total_seconds) {
             end_of_slide(i);
@@ -765,12 +1567,17 @@ display_slide(int i)
             i, dissolve, scale);
 #endif
 
+    if (soft_render) {
+        draw_soft_slide(&soft_frame, info->soft_tile, &tile_layout,
+                x, y, scale, info->ratio, dissolve);
+        return;
+    }
+
     // we used to disable blend if dissolve was greater than 0.99,
     // but it turns out we need it all the time so that the edges
-    // of the picture don't wobble.
-#if USE_D3D
-    g_pd3dDevice->SetRenderState(D3DRS_ALPHABLENDENABLE, TRUE);
-#else
+    // of the picture don't wobble.  for D3D it's turned on with the
+    // rest of the state in set_tile_render_state().
+#if !USE_D3D
     glEnable(GL_BLEND);
 #endif
 
@@ -785,153 +1592,21 @@ display_slide(int i)
     slideTrans = m3 * m2 * m1;
     g_pd3dDevice->SetTransform(D3DTS_VIEW, &slideTrans);
 
-    int tx, ty;
-    float x1, y1, x2, y2;
-    int j;
-
-    j = 0;
-    for (ty = 0; ty < tile_count_y; ty++) {
-        for (tx = 0; tx < tile_count_x; tx++) {
-            // D3D: SetTexture(0, textureptr)
-            g_pd3dDevice->SetTexture(0, info->textures[j]);
-
-#if 0
-            g_pd3dDevice->SetTextureStageState(0,
-                    D3DTSS_ADDRESSU, D3DTADDRESS_CLAMP);
-            g_pd3dDevice->SetTextureStageState(0,
-                    D3DTSS_ADDRESSV, D3DTADDRESS_CLAMP);
-#else
-            // this will catch problems where we run off the edge
-            // of the texture.  This shouldn't happen as long
-            // as TILE_SHRINK >= 0.5.
-            g_pd3dDevice->SetTextureStageState(0,
-                    D3DTSS_ADDRESSU, D3DTADDRESS_BORDER);
-            g_pd3dDevice->SetTextureStageState(0,
-                    D3DTSS_ADDRESSV, D3DTADDRESS_BORDER);
-            g_pd3dDevice->SetTextureStageState(0,
-                    D3DTSS_BORDERCOLOR, 0x0000FF00);  // green
-#endif
-            g_pd3dDevice->SetTextureStageState(0,
-                    D3DTSS_MAGFILTER, D3DTEXF_LINEAR);
-            g_pd3dDevice->SetTextureStageState(0,
-                    D3DTSS_MINFILTER, D3DTEXF_LINEAR);
-            g_pd3dDevice->SetTextureStageState(0,
-                    //D3DTSS_COLOROP, D3DTOP_MODULATE);
-                    D3DTSS_COLOROP, D3DTOP_SELECTARG1); // arg2 always white
-            g_pd3dDevice->SetTextureStageState(0,
-                    D3DTSS_COLORARG1, D3DTA_TEXTURE);
-            g_pd3dDevice->SetTextureStageState(0,
-                    D3DTSS_COLORARG2, D3DTA_DIFFUSE);   // always white
-#if 0
-            // the D3D docs say "Setting the alpha operation to D3DTOP_DISABLE
-            // when color blending is enabled causes undefined behavior."
-            g_pd3dDevice->SetTextureStageState(0,
-                    D3DTSS_ALPHAOP, D3DTOP_DISABLE);
-#else
-            g_pd3dDevice->SetTextureStageState(0,
-                    D3DTSS_ALPHAOP, D3DTOP_MODULATE);
-            g_pd3dDevice->SetTextureStageState(0,
-                    D3DTSS_ALPHAARG1, D3DTA_TEXTURE);
-            g_pd3dDevice->SetTextureStageState(0,
-                    D3DTSS_ALPHAARG2, D3DTA_DIFFUSE);
-#endif
-
-            x1 = tx/(float)tile_count_x;
-            y1 = (tile_count_y - 1 - ty)/(float)tile_count_y;
-            x2 = (tx + 1)/(float)tile_count_x;
-            y2 = (tile_count_y - 1 - ty + 1)/(float)tile_count_y;
-
-            // D3D: Create vertex array
-            textured_colored_2d_vertex vertices[4];
-
-            vertices[0].Color4f(1.0f, 1.0f, 1.0f, (float)dissolve);
-            vertices[0].TexCoord2f(0 + tile_edge_texel_low_bias / tile_size_x,
-                    1 - tile_edge_texel_high_bias / tile_size_y);
-            vertices[0].Vertex2f(x1, y1);
-
-            vertices[1].Color4f(1.0f, 1.0f, 1.0f, (float)dissolve);
-            vertices[1].TexCoord2f(1 - tile_edge_texel_high_bias / tile_size_x,
-                    1 - tile_edge_texel_high_bias / tile_size_y);
-            vertices[1].Vertex2f(x2, y1);
-
-            vertices[2].Color4f(1.0f, 1.0f, 1.0f, (float)dissolve);
-            vertices[2].TexCoord2f(1 - tile_edge_texel_high_bias / tile_size_x,
-                    0 + tile_edge_texel_low_bias / tile_size_y);
-            vertices[2].Vertex2f(x2, y2);
-
-            vertices[3].Color4f(1.0f, 1.0f, 1.0f, (float)dissolve);
-            vertices[3].TexCoord2f(0 + tile_edge_texel_low_bias / tile_size_x,
-                    0 + tile_edge_texel_low_bias / tile_size_y);
-            vertices[3].Vertex2f(x1, y2);
-
-            // copy our vertices to the vertex buffer
-            VOID* pVertices;
-            if (FAILED(g_pVB->Lock(0, 0, (BYTE **)&pVertices, 0))) {
-                jessu_printf(THREAD_GL, "Cannot lock vertex structure (%d,%d)",
-                        tx, ty);
-                continue;
-            }
-
-            memmove(pVertices, vertices, sizeof(vertices));
-            g_pVB->Unlock();
+    // the texture's alpha is multiplied by this
+    g_pd3dDevice->SetRenderState(D3DRS_TEXTUREFACTOR,
+            D3DCOLOR_ARGB((int)(dissolve*255), 255, 255, 255));
 
-            g_pd3dDevice->SetStreamSource(0, g_pVB,
-                    sizeof(textured_colored_2d_vertex));
-            g_pd3dDevice->SetVertexShader(D3DFVF_CUSTOMVERTEX);
-            g_pd3dDevice->DrawPrimitive(D3DPT_TRIANGLEFAN, 0, 2);
+    int j;
 
-            j++;
-        }
+    for (j = 0; j < tile_layout.tile_count; j++) {
+        g_pd3dDevice->SetTexture(0, info->textures[j]);
+        g_pd3dDevice->DrawPrimitive(D3DPT_TRIANGLEFAN, j*4, 2);
     }
 
     if (g_show_lines) {
-        for (ty = 0; ty < tile_count_y; ty++) {
-            for (tx = 0; tx < tile_count_x; tx++) {
-                x1 = tx/(float)tile_count_x;
-                y1 = (tile_count_y - 1 - ty)/(float)tile_count_y;
-                x2 = (tx + 1)/(float)tile_count_x;
-                y2 = (tile_count_y - 1 - ty + 1)/(float)tile_count_y;
-
-                // D3D: Create vertex array
-                textured_colored_2d_vertex vertices[4];
-
-                vertices[0].Color4f(1.0f, 1.0f, 1.0f, (float)dissolve);
-                vertices[0].TexCoord2f(0 + tile_edge_texel_low_bias / tile_size_x,
-                        1 - tile_edge_texel_high_bias / tile_size_y);
-                vertices[0].Vertex2f(x1, y1);
-
-                vertices[1].Color4f(1.0f, 1.0f, 1.0f, (float)dissolve);
-                vertices[1].TexCoord2f(1 - tile_edge_texel_high_bias / tile_size_x,
-                        1 - tile_edge_texel_high_bias / tile_size_y);
-                vertices[1].Vertex2f(x2, y1);
-
-                vertices[2].Color4f(1.0f, 1.0f, 1.0f, (float)dissolve);
-                vertices[2].TexCoord2f(1 - tile_edge_texel_high_bias / tile_size_x,
-                        0 + tile_edge_texel_low_bias / tile_size_y);
-                vertices[2].Vertex2f(x2, y2);
-
-                vertices[3].Color4f(1.0f, 1.0f, 1.0f, (float)dissolve);
-                vertices[3].TexCoord2f(0 + tile_edge_texel_low_bias / tile_size_x,
-                        0 + tile_edge_texel_low_bias / tile_size_y);
-                vertices[3].Vertex2f(x1, y2);
-
-                // copy our vertices to the vertex buffer
-                VOID* pVertices;
-                if (FAILED(g_pVB->Lock(0, 0, (BYTE **)&pVertices, 0))) {
-                    jessu_printf(THREAD_GL, "Cannot lock vertex structure (%d,%d)",
-                            tx, ty);
-                    continue;
-                }
-
-                memmove(pVertices, vertices, sizeof(vertices));
-                g_pVB->Unlock();
-
-                g_pd3dDevice->SetStreamSource(0, g_pVB,
-                        sizeof(textured_colored_2d_vertex));
-                g_pd3dDevice->SetVertexShader(D3DFVF_CUSTOMVERTEX);
-                g_pd3dDevice->SetTexture(0, NULL);
-                g_pd3dDevice->DrawPrimitive(D3DPT_LINESTRIP, 0, 2);
-            }
+        g_pd3dDevice->SetTexture(0, NULL);
+        for (j = 0; j < tile_layout.tile_count; j++) {
+            g_pd3dDevice->DrawPrimitive(D3DPT_LINESTRIP, j*4, 3);
         }
     }
 #else
@@ -942,48 +1617,34 @@ display_slide(int i)
         glScalef(scale, scale/info->ratio, scale);
         glTranslatef(-x, -y, 0.0f);
 
-        int tx, ty;
         float x1, y1, x2, y2;
-        int j;
-
-        j = 0;
-        for (ty = 0; ty < tile_count_y; ty++) {
-            for (tx = 0; tx < tile_count_x; tx++) {
-                glBindTexture(GL_TEXTURE_2D, info->texture_id[j]);
-                x1 = tx/(float)tile_count_x;
-                y1 = (tile_count_y - 1 - ty)/(float)tile_count_y;
-                x2 = (tx + 1)/(float)tile_count_x;
-                y2 = (tile_count_y - 1 - ty + 1)/(float)tile_count_y;
-
-                glEnable(GL_TEXTURE_2D);
-                glColor4f(1.0f, 1.0f, 1.0f, (float)dissolve);
-                glBegin(GL_QUADS);
-                glTexCoord2f(0 + tile_edge_texel_low_bias / tile_size_x,
-                        1 - tile_edge_texel_high_bias / tile_size_y);
+
+        for (int j = 0; j < tile_layout.tile_count; j++) {
+            glBindTexture(GL_TEXTURE_2D, info->texture_id[j]);
+            get_tile_position(&tile_layout, j, &x1, &y1, &x2, &y2);
+
+            glEnable(GL_TEXTURE_2D);
+            glColor4f(1.0f, 1.0f, 1.0f, (float)dissolve);
+            glBegin(GL_QUADS);
+            glTexCoord2f(0 + tile_apron_s, 1 - tile_apron_t);
+            glVertex2f(x1, y1);
+            glTexCoord2f(1 - tile_apron_s, 1 - tile_apron_t);
+            glVertex2f(x2, y1);
+            glTexCoord2f(1 - tile_apron_s, 0 + tile_apron_t);
+            glVertex2f(x2, y2);
+            glTexCoord2f(0 + tile_apron_s, 0 + tile_apron_t);
+            glVertex2f(x1, y2);
+            glEnd();
+
+            if (g_show_lines) {
+                glDisable(GL_TEXTURE_2D);
+                glColor4f(1.0, 0.0, 0.0, 0.75);
+                glBegin(GL_LINE_LOOP);
                 glVertex2f(x1, y1);
-                glTexCoord2f(1 - tile_edge_texel_high_bias / tile_size_x,
-                        1 - tile_edge_texel_high_bias / tile_size_y);
                 glVertex2f(x2, y1);
-                glTexCoord2f(1 - tile_edge_texel_high_bias / tile_size_x,
-                        0 + tile_edge_texel_low_bias / tile_size_y);
                 glVertex2f(x2, y2);
-                glTexCoord2f(0 + tile_edge_texel_low_bias / tile_size_x,
-                        0 + tile_edge_texel_low_bias / tile_size_y);
                 glVertex2f(x1, y2);
                 glEnd();
-
-                if (g_show_lines) {
-                    glDisable(GL_TEXTURE_2D);
-                    glColor4f(1.0, 0.0, 0.0, 0.75);
-                    glBegin(GL_LINE_LOOP);
-                    glVertex2f(x1, y1);
-                    glVertex2f(x2, y1);
-                    glVertex2f(x2, y2);
-                    glVertex2f(x1, y2);
-                    glEnd();
-                }
-
-                j++;
             }
         }
     glPopMatrix();
@@ -1043,78 +1704,181 @@ set_nice_font(HDC hdc, int *font_height)
         initialized = true;
     }
 
-    if (font_height != NULL) {
-        *font_height = height;
+    if (font_height != NULL) {
+        *font_height = height;
+    }
+
+    SelectFont(hdc, font);
+}
+
+#if USE_D3D
+// the state for drawing the tiles of both slides, set once per frame
+static void
+set_tile_render_state()
+{
+    g_pd3dDevice->SetRenderState(D3DRS_ALPHABLENDENABLE, TRUE);
+
+    // the apron keeps us off the edge of the full-size level,
+    // clamping keeps the small mipmap levels off it
+    g_pd3dDevice->SetTextureStageState(0,
+            D3DTSS_ADDRESSU, D3DTADDRESS_CLAMP);
+    g_pd3dDevice->SetTextureStageState(0,
+            D3DTSS_ADDRESSV, D3DTADDRESS_CLAMP);
+    g_pd3dDevice->SetTextureStageState(0,
+            D3DTSS_MAGFILTER, D3DTEXF_LINEAR);
+    g_pd3dDevice->SetTextureStageState(0,
+            D3DTSS_MINFILTER, D3DTEXF_LINEAR);
+    g_pd3dDevice->SetTextureStageState(0,
+            D3DTSS_MIPFILTER, D3DTEXF_LINEAR);
+    g_pd3dDevice->SetTextureStageState(0,
+            D3DTSS_COLOROP, D3DTOP_SELECTARG1);
+    g_pd3dDevice->SetTextureStageState(0,
+            D3DTSS_COLORARG1, D3DTA_TEXTURE);
+    g_pd3dDevice->SetTextureStageState(0,
+            D3DTSS_ALPHAOP, D3DTOP_MODULATE);
+    g_pd3dDevice->SetTextureStageState(0,
+            D3DTSS_ALPHAARG1, D3DTA_TEXTURE);
+    g_pd3dDevice->SetTextureStageState(0,
+            D3DTSS_ALPHAARG2, D3DTA_TFACTOR);   // the fade
+
+    g_pd3dDevice->SetStreamSource(0, g_pVB,
+            sizeof(textured_colored_2d_vertex));
+    g_pd3dDevice->SetVertexShader(D3DFVF_CUSTOMVERTEX);
+}
+#endif
+
+// copies the software frame to the window, with the filename (if not
+// NULL) in a dark band across the bottom
+static void
+show_soft_frame(HDC hdc, char *beautiful_filename)
+{
+    unsigned char *pixels = soft_frame.pixels;
+    int width = soft_frame.width;
+    int height = soft_frame.height;
+    int x, y;
+
+    // Windows wants blue first
+#if DST_RED != 2
+    for (x = 0; x < width*height*BYTES_PER_TEXEL; x += BYTES_PER_TEXEL) {
+        unsigned char red = pixels[x + DST_RED];
+
+        pixels[x + DST_RED] = pixels[x + DST_BLU];
+        pixels[x + DST_BLU] = red;
+    }
+#endif
+
+    // the same band as draw_filename_background()
+    int y2 = height - FILENAME_BOTTOM_MARGIN;
+    int y1 = y2 - FILENAME_HEIGHT;
+
+    if (beautiful_filename != NULL && y1 >= 0) {
+        for (y = y1; y < y2; y++) {
+            unsigned char *p = pixels + y*width*BYTES_PER_TEXEL;
+
+            for (x = 0; x < width*BYTES_PER_TEXEL; x++) {
+                p[x] = (unsigned char)(p[x]*0x50 >> 8);
+            }
+        }
+    }
+
+    BITMAPINFO info;
+
+    memset(&info, 0, sizeof(info));
+    info.bmiHeader.biSize = sizeof(info.bmiHeader);
+    info.bmiHeader.biWidth = width;
+    info.bmiHeader.biHeight = -height;  // top row first
+    info.bmiHeader.biPlanes = 1;
+    info.bmiHeader.biBitCount = 32;
+    info.bmiHeader.biCompression = BI_RGB;
+
+    SetDIBitsToDevice(hdc, 0, 0, width, height, 0, 0, 0, height,
+            pixels, &info, DIB_RGB_COLORS);
+
+    if (beautiful_filename != NULL && y1 >= 0) {
+        RECT rect;
+
+        rect.left = 0;
+        rect.right = width;
+        rect.top = y1;
+        rect.bottom = y2;
+
+        set_nice_font(hdc, NULL);
+        SetBkMode(hdc, TRANSPARENT);
+        SetTextColor(hdc, RGB(255, 255, 255));
+        DrawText(hdc, beautiful_filename, -1, &rect,
+                DT_CENTER | DT_VCENTER | DT_SINGLELINE | DT_NOPREFIX);
     }
-
-    SelectFont(hdc, font);
 }
 
 void
-display_slides(HDC
-#if !USE_D3D   // avoid compiler warning
-        hdc
-#endif
-        )
+display_slides(HDC hdc)
 {
     char *beautiful_filename = NULL;
     Filename_notice *filename_notice = NULL;
 
-#if USE_D3D
-    if (g_pd3dDevice == NULL) {
-        return;
-    }
-#else
-    if (gl_context == NULL) {
+    if (!rendering_is_set_up()) {
         return;
     }
-#endif
+
+    Trace_span span("draw_frame");
 
 #if PER_FRAME_OUTPUT
     DWORD start_time = timeGetTime();
     jessu_printf(THREAD_GL, "starting to paint");
 #endif
 
-#if USE_D3D
-    // D3D: setViewPort?
-    D3DVIEWPORT8 vp;
-    vp.X = 0;
-    vp.Y = 0;
-    vp.Width = window_width;
-    vp.Height = window_height;
-    vp.MinZ = 0.0f;
-    vp.MaxZ = 1.0f;
-    g_pd3dDevice->SetViewport(&vp);
-
     float ortho_height = window_height / (float)window_width;
-    D3DXMATRIX matProj;
-    D3DXMatrixOrthoOffCenterLH(&matProj,
-            0, 1,
-            0.5f - ortho_height/2, 0.5f + ortho_height/2,
-            -1, 1);
-    g_pd3dDevice->SetTransform(D3DTS_PROJECTION, &matProj);
 
-    // D3D: Clear
-    g_pd3dDevice->Clear(0, NULL, D3DCLEAR_TARGET,
-            D3DCOLOR_XRGB(0,0,0), 1.0f, 0);
+    if (soft_render) {
+        // try again next frame
+        if (!set_soft_frame_size(&soft_frame, window_width,
+                    window_height)) {
 
-    // D3D: BeginScene
-    if (FAILED(g_pd3dDevice->BeginScene())) {
-        jessu_printf(THREAD_GL, "BeginScene() failed");
-        return;
-    }
+            return;
+        }
+        clear_soft_frame(&soft_frame);
+    } else {
+#if USE_D3D
+        // D3D: setViewPort?
+        D3DVIEWPORT8 vp;
+        vp.X = 0;
+        vp.Y = 0;
+        vp.Width = window_width;
+        vp.Height = window_height;
+        vp.MinZ = 0.0f;
+        vp.MaxZ = 1.0f;
+        g_pd3dDevice->SetViewport(&vp);
+
+        D3DXMATRIX matProj;
+        D3DXMatrixOrthoOffCenterLH(&matProj,
+                0, 1,
+                0.5f - ortho_height/2, 0.5f + ortho_height/2,
+                -1, 1);
+        g_pd3dDevice->SetTransform(D3DTS_PROJECTION, &matProj);
+
+        // D3D: Clear
+        g_pd3dDevice->Clear(0, NULL, D3DCLEAR_TARGET,
+                D3DCOLOR_XRGB(0,0,0), 1.0f, 0);
+
+        // D3D: BeginScene
+        if (FAILED(g_pd3dDevice->BeginScene())) {
+            jessu_printf(THREAD_GL, "BeginScene() failed");
+            return;
+        }
+
+        set_tile_render_state();
 #else
-    glMatrixMode(GL_PROJECTION);
-    glViewport(0, 0, window_width, window_height);
-    glLoadIdentity();
-    float ortho_height = window_height / (float)window_width;
-    glOrtho(0.0, 1.0,
-        0.5f - ortho_height/2, 0.5f + ortho_height/2,
-        -1.0f, 1.0f);
-    glMatrixMode(GL_MODELVIEW);
+        glMatrixMode(GL_PROJECTION);
+        glViewport(0, 0, window_width, window_height);
+        glLoadIdentity();
+        glOrtho(0.0, 1.0,
+            0.5f - ortho_height/2, 0.5f + ortho_height/2,
+            -1.0f, 1.0f);
+        glMatrixMode(GL_MODELVIEW);
 
-    glClear(GL_COLOR_BUFFER_BIT);  // uses glClearColor
+        glClear(GL_COLOR_BUFFER_BIT);  // uses glClearColor
 #endif
+    }
 
     if (paused) {
         // display oldest one
@@ -1170,7 +1934,7 @@ display_slides(HDC
 
 #if !USE_D3D
     /* debugging stuff */
-    if (display_debugging) {
+    if (display_debugging && !soft_render) {
         if (loading_jpeg) {
             int i = loading_jpeg_progress;
             glDisable(GL_TEXTURE_2D);
@@ -1228,7 +1992,8 @@ display_slides(HDC
     }
 #endif
 
-    if (in_fullscreen && display_filename && beautiful_filename != NULL) {
+    if (in_fullscreen && display_filename && beautiful_filename != NULL &&
+            !soft_render) {
 #if USE_D3D
         int y2 = window_height - FILENAME_BOTTOM_MARGIN;
         int y1 = y2 - FILENAME_HEIGHT;
@@ -1272,14 +2037,30 @@ display_slides(HDC
 #endif
     }
 
+    STAGE_CLOCK present_start = get_stage_clock();
+    trace_begin("present");
+
+    if (soft_render) {
+        finish_soft_frame(&soft_frame);
+
+        // no window when rendering to a file
+        if (render_filename == NULL) {
+            show_soft_frame(hdc, in_fullscreen && display_filename ?
+                    beautiful_filename : NULL);
+        }
+    } else {
 #if USE_D3D
-    g_pd3dDevice->EndScene();
+        g_pd3dDevice->EndScene();
 
-    // Present the backbuffer contents to the display
-    g_pd3dDevice->Present(NULL, NULL, NULL, NULL);
+        // Present the backbuffer contents to the display
+        g_pd3dDevice->Present(NULL, NULL, NULL, NULL);
 #else
-    SwapBuffers(gl_device);
+        SwapBuffers(gl_device);
 #endif
+    }
+
+    trace_end("present");
+    record_stage_time(STAGE_PRESENT, present_start);
 
 #if PER_FRAME_OUTPUT
     DWORD end_time = timeGetTime();
@@ -1294,7 +2075,9 @@ display_slides(HDC
     static DWORD last_frame_time = 0;
     DWORD now = timeGetTime();
 
-    if (last_frame_time != 0 && now - last_frame_time > 1000/20) {
+    if (last_frame_time != 0 && now - last_frame_time > 1000/20 &&
+            render_filename == NULL) {
+
         jessu_printf(THREAD_GL, "Slow frame: %lu ms (%lu FPS)",
                 now - last_frame_time, 1000/(now - last_frame_time));
     }
@@ -1406,6 +2189,89 @@ reshape(int width, int height)
 #endif
 }
 
+// copies "row_count" rows of mipmap level "level" of tile "j" to the
+// graphics board, starting at "first_row".  DXT1 tiles go a row of
+// blocks at a time, so "first_row" must be a multiple of four.
+static void
+download_tile_rows(SLIDE_INFO *info, int j, int level, int first_row,
+        int row_count)
+{
+    Trace_span span("tile_upload");
+    STAGE_CLOCK start = get_stage_clock();
+    int size_x, size_y;
+    unsigned char *data = get_texel_format_level(tile_format,
+            info->tile[j], tile_layout.tile_size_x, tile_layout.tile_size_y,
+            level, &size_x, &size_y);
+
+    // the rows we copy, which are rows of blocks for DXT1
+    int row_height = get_texel_format_row_height(tile_format);
+    int row_bytes = get_texel_format_level_bytes(tile_format, size_x, 1);
+    int rows = (row_count + row_height - 1)/row_height;
+
+    data += first_row/row_height*row_bytes;
+
+    if (soft_render) {
+        // the tiles are A8R8G8B8, so the rows go in the same place
+        memcpy(info->soft_tile[j] + (data - info->tile[j]), data,
+                rows*row_bytes);
+        record_stage_time(STAGE_TILE_UPLOAD, start);
+        return;
+    }
+
+#if USE_D3D
+    D3DLOCKED_RECT rect;
+    RECT area;
+
+    area.left = 0;
+    area.top = first_row;
+    area.right = size_x;
+    area.bottom = first_row + row_count;
+
+    int result = info->textures[j]->LockRect(level, &rect, &area, 0);
+    if (FAILED(result)) {
+        jessu_printf(THREAD_GL, "LockRect() failed (%d)",
+                result & 0xffff);
+        return;
+    }
+
+    // the small levels may have padded rows
+    unsigned char *bits = (unsigned char *)rect.pBits;
+    for (int y = 0; y < rows; y++) {
+        memcpy(bits + y*rect.Pitch, data + y*row_bytes, row_bytes);
+    }
+    info->textures[j]->UnlockRect(level);
+#else
+    glBindTexture(GL_TEXTURE_2D, info->texture_id[j]);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexSubImage2D(GL_TEXTURE_2D, level, 0, first_row, size_x, row_count,
+            GL_RGBA, GL_UNSIGNED_BYTE, data);
+#endif
+
+    record_stage_time(STAGE_TILE_UPLOAD, start);
+}
+
+// when the machine gets short of memory, drop the filter tables we're
+// not using and load one picture at a time without strips, which is most
+// of what the workers use.  back to normal once there's plenty again.
+static void
+govern_memory(void)
+{
+    bool is_short = memory_is_short();
+
+    if (is_short == memory_was_short) {
+        return;
+    }
+    memory_was_short = is_short;
+
+    EnterCriticalSection(&prefetch_lock);
+    loading_limit = is_short ? 1 : worker_count;
+    strip_thread_limit = is_short ? 1 : memory_plan.strip_threads;
+    LeaveCriticalSection(&prefetch_lock);
+
+    set_contrib_cache_maximum(is_short ? 0 : memory_plan.contrib_cache_bytes);
+    trace_counter("memory_short", is_short);
+}
+
 static void
 idle(void)
 {
@@ -1417,65 +2283,113 @@ idle(void)
     int j;
     bool did_something = false;
 
+    govern_memory();
+
     for (int i = 0; i < 2; i++) {
-        if (slide[i].texture_ready && !slide[i].texture_downloaded) {
+        if (slide[i].texture_ready && (!slide[i].texture_downloaded ||
+                    slide[i].texture_is_refinement)) {
+
             did_something = true;
 
             if (!slide[i].texture_used) {
                 downloading_texture = 1 + i;
                 jessu_printf(THREAD_GL, "start download of %d", i);
                 slide[i].tile_number = 0;
+                slide[i].tile_row = 0;
                 slide[i].texture_used = 1;
             }
 
-            /* download tile "tile_number" */
+            /* download part of tile "tile_number": a band of the
+               full-size level, or once that's all there the rest of
+               the mip chain (a third as big), so that no one frame
+               gets too much of it.  a whole-slide texture takes
+               several bands. */
             j = slide[i].tile_number;
-            downloading_texture_progress = j*100/tile_count;
-            jessu_printf(THREAD_GL, "download tile %d of %d for %d",
-                    j, tile_count, i);
-
-#if USE_D3D
-            D3DLOCKED_RECT rect;
+            int tile_size_y = tile_layout.tile_size_y;
+            int row = slide[i].tile_row;
+            downloading_texture_progress = (j*tile_size_y + row)*100/
+                (tile_layout.tile_count*tile_size_y);
+            jessu_printf(THREAD_GL, "download tile %d of %d row %d for %d",
+                    j, tile_layout.tile_count, row, i);
+
+            if (row < tile_size_y) {
+                int row_count = DOWNLOAD_TEXELS_PER_IDLE/
+                    tile_layout.tile_size_x;
+
+                if (row_count < 1) {
+                    row_count = 1;
+                }
+                // whole rows of DXT1 blocks
+                int row_height = get_texel_format_row_height(tile_format);
+                row_count = (row_count + row_height - 1)/row_height*
+                    row_height;
+                if (row_count > tile_size_y - row) {
+                    row_count = tile_size_y - row;
+                }
 
-            int result = slide[i].textures[j]->LockRect(0, &rect, NULL, 0);
-            if (FAILED(result)) {
-                jessu_printf(THREAD_GL, "LockRect() failed (%d)",
-                        result & 0xffff);
+                download_tile_rows(&slide[i], j, 0, row, row_count);
+                slide[i].tile_row += row_count;
             } else {
-                memmove(rect.pBits, slide[i].tile[j],
-                        tile_size_x*tile_size_y*BYTES_PER_TEXEL);
-                slide[i].textures[j]->UnlockRect(0);
+                for (int level = 1; level < tile_levels; level++) {
+                    int size_x, size_y;
+
+                    get_mipmap_level_size(tile_layout.tile_size_x,
+                            tile_size_y, level, &size_x, &size_y);
+                    download_tile_rows(&slide[i], j, level, 0, size_y);
+                }
+                slide[i].tile_row = tile_size_y + 1;
+            }
+
+            if (slide[i].tile_row > tile_size_y ||
+                    (slide[i].tile_row == tile_size_y && tile_levels == 1)) {
+
+                slide[i].tile_row = 0;
+                slide[i].tile_number++;
             }
-#else
-            glBindTexture(GL_TEXTURE_2D, slide[i].texture_id[j]);
-            glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-            glTexImage2D(GL_TEXTURE_2D, 0, preferred_texture_internal_format,
-                    tile_size_x, tile_size_y,
-                    0, GL_RGBA, GL_UNSIGNED_BYTE, slide[i].tile[j]);
-#endif
 
-            slide[i].tile_number++;
-            if (slide[i].tile_number >= tile_count) {
+            if (slide[i].tile_number >= tile_layout.tile_count) {
                 /* tell the worker thread that it can fill this
                    slide with the next image */
                 jessu_printf(THREAD_GL, "end download of %d", i);
                 slide[i].texture_ready = 0;
                 slide[i].texture_used = 0;
-
-                /* mark that the textures have been downloaded */
-                slide[i].ratio = (float)slide[i].width/slide[i].height;
-                slide[i].texture_downloaded = 1;
                 downloading_texture = 0;
-                strcpy(slide[i].beautiful_filename,
-                        slide[i].next_beautiful_filename);
+
+                if (slide[i].texture_is_refinement &&
+                        slide[i].texture_downloaded) {
+
+                    /* same picture, better tiles.  everything else about
+                       the slide stays as it is. */
+                    slide[i].texture_is_refinement = 0;
+                } else {
+                    slide[i].texture_is_refinement = 0;
+
+                    /* mark that the textures have been downloaded */
+                    slide[i].ratio = (float)slide[i].width/slide[i].height;
+                    slide[i].texture_downloaded = 1;
+                    strcpy(slide[i].beautiful_filename,
+                            slide[i].next_beautiful_filename);
 
 #if USE_D3D
-                delete slide[i].filename_notice;
-                slide[i].filename_notice = prepare_filename_notice(g_pd3dDevice,
-                        slide[i].beautiful_filename);
+                    if (!soft_render) {
+                        STAGE_CLOCK start = get_stage_clock();
+                        Trace_span span("filename_notice");
+
+                        delete slide[i].filename_notice;
+                        slide[i].filename_notice = prepare_filename_notice(
+                                g_pd3dDevice, slide[i].beautiful_filename);
+                        record_stage_time(STAGE_FILENAME_NOTICE, start);
+                    }
 #endif
 
-                slide[i].misc_info = slide[i].next_misc_info;
+                    slide[i].misc_info = slide[i].next_misc_info;
+                }
+            }
+
+            if (trace_enabled()) {
+                EnterCriticalSection(&prefetch_lock);
+                trace_pipeline();
+                LeaveCriticalSection(&prefetch_lock);
             }
         }
     }
@@ -1557,6 +2471,20 @@ setup_rendering_on_window(HWND hWnd)
 #endif
 }
 
+// draws in software when the graphics board can't be set up, rather
+// than showing the error
+static void
+fall_back_to_soft_render(void)
+{
+    if (rendering_is_set_up() || error_message == NULL) {
+        return;
+    }
+
+    jessu_printf(THREAD_GL, "Rendering in software (%s)", error_message);
+    set_error_message(NULL);
+    soft_render = true;
+}
+
 static void
 schedule_paint(void)
 {
@@ -1579,7 +2507,7 @@ convert_speeds(float old_speed, float speed)
     // adjust time stamp on images so that speed multiplier
     // doesn't make zooming jump
 
-    DWORD now = timeGetTime();
+    DWORD now = get_slide_time();
 
     convert_speed(old_speed, speed, now, &slide[0]);
     convert_speed(old_speed, speed, now, &slide[1]);
@@ -1626,6 +2554,93 @@ log_fps()
     }
 }
 
+// a slide is due to start but its picture isn't in yet
+static bool
+slide_is_waiting(void)
+{
+    for (int i = 0; i < 2; i++) {
+        if (slide[i].time_to_start && !slide[i].being_displayed) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Draws "render_seconds" of the slide show into "render_filename" as
+ * fast as it'll go.  The clock moves a frame at a time, and stops while
+ * a slide waits for its picture so that nothing is skipped.  The workers
+ * load the next pictures and the video thread writes the last frame
+ * while we draw this one.
+ */
+static void
+render_slide_show(void)
+{
+    int frame_count = render_seconds*RENDER_FRAMES_PER_SECOND;
+    DWORD start_time = timeGetTime();
+    DWORD wait_start_time = 0;
+    int frame = 0;
+
+    if (!open_video_file(render_filename, window_width, window_height,
+                RENDER_FRAMES_PER_SECOND)) {
+
+        set_error_message("Cannot open the video file");
+        return;
+    }
+    set_soft_frame_hook(write_video_frame, NULL);
+    picture_ready_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+
+    while (frame < frame_count) {
+        render_time = (DWORD)(frame*1000.0/RENDER_FRAMES_PER_SECOND);
+
+        idle();
+
+        if (slide_is_waiting()) {
+            DWORD now = timeGetTime();
+
+            if (wait_start_time == 0) {
+                wait_start_time = now;
+            } else if (now - wait_start_time > RENDER_WAIT_SECONDS*1000) {
+                set_error_message("No pictures could be loaded");
+                break;
+            }
+
+            // leave the processor to the workers until there's something
+            // to download
+            if (!slide[0].texture_ready && !slide[1].texture_ready) {
+                WaitForSingleObject(picture_ready_event,
+                        RENDER_POLL_MILLISECONDS);
+            }
+            continue;
+        }
+        wait_start_time = 0;
+
+        display_slides(NULL);
+        frame++;
+
+        if (frame % (RENDER_FRAMES_PER_SECOND*10) == 0) {
+            jessu_printf(THREAD_GL, "Rendered %d of %d frames",
+                    frame, frame_count);
+        }
+    }
+
+    set_soft_frame_hook(NULL, NULL);
+    close_video_file();
+
+    // publish_picture() looks at it with "prefetch_lock"
+    EnterCriticalSection(&prefetch_lock);
+    HANDLE event = picture_ready_event;
+    picture_ready_event = NULL;
+    LeaveCriticalSection(&prefetch_lock);
+    CloseHandle(event);
+
+    DWORD elapsed = timeGetTime() - start_time;
+    jessu_printf(THREAD_GL, "Rendered %d frames in %.1f seconds (%.1f FPS)",
+            frame, elapsed/1000.0,
+            elapsed == 0 ? 0 : frame*1000.0/elapsed);
+}
+
 static void
 handle_events_until_done(void)
 {
@@ -1634,15 +2649,9 @@ handle_events_until_done(void)
     /* Message loop */
     while (!quit_requested) {
         if (PeekMessage(&msg, rendering_window, 0, 0, PM_REMOVE) == FALSE) {
-#if USE_D3D
-            if (g_pD3D != NULL) {
-                idle();
-            }
-#else
-            if (gl_context != NULL) {
+            if (rendering_is_set_up()) {
                 idle();
             }
-#endif
 
             if (paint_scheduled) {
                 // we used to call display_slides() directly here, but
@@ -1707,11 +2716,33 @@ handle_mouse_motion(int x, int y)
 }
 #endif
 
+// writes a report such as the stage times to "filename", if there is
+// one, with "write"
+static void
+write_report_file(char *filename, void (*write)(FILE *), char *what)
+{
+    if (filename == NULL) {
+        return;
+    }
+
+    FILE *out = fopen(filename, "w");
+    if (out == NULL) {
+        jessu_printf(THREAD_GL, "Can't write \"%s\" (%s)", filename,
+                jessu_strerror());
+        return;
+    }
+
+    write(out);
+    fclose(out);
+
+    jessu_printf(THREAD_GL, "Wrote the %s to \"%s\"", what, filename);
+}
+
 static void
 toggle_pause()
 {
     paused = !paused;
-    DWORD now = timeGetTime();
+    DWORD now = get_slide_time();
 
     if (paused) {
         /* keep track of where we are in the slide */
@@ -1804,6 +2835,17 @@ handle_slideshow_char(int key)
         case ' ':
             toggle_pause();
             break;
+
+        case 't': // stage times and trace
+            write_report_file(stages_filename, write_stage_times,
+                    "stage times");
+            write_report_file(trace_filename, write_trace, "trace");
+            break;
+
+        case 'm': // memory use
+            write_report_file(memory_filename, write_memory_use,
+                    "memory use");
+            break;
     }
 }
 
@@ -1835,6 +2877,27 @@ handle_screensaver_key(int vkey, bool pressed) // virtual key, like VK_LEFT
             }
             return true;
 
+        case 'T':
+            if (stages_filename == NULL && trace_filename == NULL) {
+                return false;
+            }
+            if (pressed) {
+                write_report_file(stages_filename, write_stage_times,
+                        "stage times");
+                write_report_file(trace_filename, write_trace, "trace");
+            }
+            return true;
+
+        case 'M':
+            if (memory_filename == NULL) {
+                return false;
+            }
+            if (pressed) {
+                write_report_file(memory_filename, write_memory_use,
+                        "memory use");
+            }
+            return true;
+
         case VK_UP:
             if (pressed) {
                 if (!paused) {
@@ -1867,8 +2930,9 @@ gl_wnd_proc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
 #if USE_D3D
     // setup is done earlier
 #else
-    if (gl_context == NULL && error_message == NULL) {
+    if (gl_context == NULL && error_message == NULL && !soft_render) {
         setup_rendering_on_window(hWnd);
+        fall_back_to_soft_render();
     }
 #endif
 
@@ -1887,15 +2951,16 @@ gl_wnd_proc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
             return 0;
             break;
 
+        case WM_COMPACTING:
+            note_memory_short();
+            return 0;
+            break;
+
         case WM_PAINT:
             {
                 PAINTSTRUCT ps;
                 HDC hdc = BeginPaint(hWnd, &ps);
-#if USE_D3D
-                if (g_pD3D != NULL) {
-#else
-                if (gl_context != NULL) {
-#endif
+                if (rendering_is_set_up()) {
                     display_slides(hdc);
                 } else if (error_message != NULL) {
                     display_error_message(hWnd, hdc, &ps);
@@ -2031,8 +3096,8 @@ monitorProc( HMONITOR hMonitor, HDC hdcMonitor,
                 NULL);   
 
         if (rendering_window == NULL) {
-            fprintf(debug_output, "couldn't open blanking Window for "
-                "{%d, %d, %d, %d}\n",
+            jessu_printf(THREAD_GL, "couldn't open blanking Window for "
+                "{%d, %d, %d, %d}",
                 monitor.rcMonitor.left, monitor.rcMonitor.right,
                 monitor.rcMonitor.top, monitor.rcMonitor.bottom);
             // ignore this failure.
@@ -2124,7 +3189,7 @@ create_rendering_window(HINSTANCE hInstance, int nCmdShow)
                 (LPCTSTR)"Cannot Open Rendering Window.",
                 "Cannot Open Rendering Window",
                 MB_OK | MB_ICONEXCLAMATION);
-        fprintf(debug_output, "couldn't open Rendering Window\n");
+        jessu_printf(THREAD_GL, "couldn't open Rendering Window");
         exit(1);
     }
 
@@ -2149,58 +3214,38 @@ static unsigned long __stdcall
 worker_thread(void *  /* params */)
 {
     /*
-     * The worker thread checks the slides and fills in from disk
-     * images whenever slots are no longer needed.  Basically it
-     * checks for textures that are no longer used and it loads
-     * texture space.  It's up to the main thread to send that
-     * to the graphics board for display.
+     * The worker threads load upcoming pictures into prefetch entries
+     * and move them into the slides whenever slots are no longer
+     * needed.  It's up to the main thread to send them to the graphics
+     * board for display.
      */
 
-    int i;
-    int did_something;
-    static Vertical_scaler vertical_scaler;
+    // each worker has its own scaler and its own row buffers
+    Vertical_scaler vertical_scaler;
 
     srand(seed);
+    set_trace_thread_name("worker");
 
     while (!g_worker_thread_should_quit) {
-        did_something = 0;
-
-        for (i = 0; i < 2; i++) {
-            if (!slide[i].texture_ready && !slide[i].texture_used) {
-                loading_jpeg = 1 + i;
-                jessu_printf(THREAD_WORKER, "reading texture %d", i);
-                vertical_scaler.Set_destination_parameters(
-                        slide[i].tile, tile_size_x, tile_size_y,
-                        tile_count_x, tile_count_y, texture_size_x,
-                        texture_size_y);
-                load_next_picture(vertical_scaler, &slide[i]);
-                loading_jpeg = 0;
-#if 0
-                scaling_image = 1 + i;
-                jessu_printf(THREAD_WORKER, "scaling texture %d", i);
-                scale_and_tile(pixels, texture_size_x, slide[i].height,
-                        slide[i].tile, tile_size_x, tile_size_y,
-                        tile_count_x, tile_count_y,
-                        texture_size_x, texture_size_y);
-                scaling_image = 0;
-                // don't free "pixels" -- the buffer is reused
-#endif
-
-                /* tell GL thread that it can download this texture */
-                slide[i].texture_ready = 1;
-                jessu_printf(THREAD_WORKER, "texture for %d is ready", i);
-                did_something = 1;
-            }
-        }
+        PREFETCH_ENTRY *entry = claim_prefetch_entry();
 
-        if (!did_something) {
+        if (entry == NULL) {
             /* avoid busy looping */
-            jessu_printf(THREAD_WORKER, "sleeping");
-            _sleep(1000);
+            _sleep(WORKER_IDLE_MILLISECONDS);
+            continue;
         }
+
+        loading_jpeg = 1 + (entry - prefetch);
+        load_prefetch_entry(vertical_scaler, entry);
+        loading_jpeg = 0;
+
+        EnterCriticalSection(&prefetch_lock);
+        dispatch_pictures();
+        LeaveCriticalSection(&prefetch_lock);
     }
 
     jessu_printf(THREAD_WORKER, "asked to quit");
+    free_linear_row();
     return 0;
 }
 
@@ -2208,12 +3253,12 @@ worker_thread(void *  /* params */)
 void *jessu_malloc(THREAD_TYPE thread, size_t size, char *description)
 {
     jessu_printf(thread, "%s: malloc(%d)", description, size);
-    return malloc(size);
+    return counted_malloc(thread, size, description);
 }
 #else
-void *jessu_malloc(THREAD_TYPE, size_t size, char *)
+void *jessu_malloc(THREAD_TYPE thread, size_t size, char *description)
 {
-    return malloc(size);
+    return counted_malloc(thread, size, description);
 }
 #endif
 
@@ -2222,12 +3267,13 @@ void *jessu_calloc(THREAD_TYPE thread,
         size_t count, size_t size, char *description)
 {
     jessu_printf(thread, "%s: calloc(%d, %d)", description, count, size);
-    return calloc(count, size);
+    return counted_calloc(thread, count, size, description);
 }
 #else
-void *jessu_calloc(THREAD_TYPE, size_t count, size_t size, char *)
+void *jessu_calloc(THREAD_TYPE thread,
+        size_t count, size_t size, char *description)
 {
-    return calloc(count, size);
+    return counted_calloc(thread, count, size, description);
 }
 #endif
 
@@ -2236,12 +3282,13 @@ void *jessu_realloc(THREAD_TYPE thread,
         void *ptr, size_t size, char *description)
 {
     jessu_printf(thread, "%s: realloc(%d)", description, size);
-    return realloc(ptr, size);
+    return counted_realloc(thread, ptr, size, description);
 }
 #else
-void *jessu_realloc(THREAD_TYPE, void *ptr, size_t size, char *)
+void *jessu_realloc(THREAD_TYPE thread,
+        void *ptr, size_t size, char *description)
 {
-    return realloc(ptr, size);
+    return counted_realloc(thread, ptr, size, description);
 }
 #endif
 
@@ -2249,12 +3296,12 @@ void *jessu_realloc(THREAD_TYPE, void *ptr, size_t size, char *)
 void jessu_free(THREAD_TYPE thread, void *ptr, char *description)
 {
     jessu_printf(thread, "%s: free()", description);
-    free(ptr);
+    counted_free(ptr);
 }
 #else
 void jessu_free(THREAD_TYPE, void *ptr, char *)
 {
-    free(ptr);
+    counted_free(ptr);
 }
 #endif
 
@@ -2262,12 +3309,22 @@ void jessu_free(THREAD_TYPE, void *ptr, char *)
 char *jessu_strdup(THREAD_TYPE thread, const char *string, char *description)
 {
     jessu_printf(thread, "%s: strdup(%d)", description, strlen(string));
-    return strdup(string);
+    char *copy = (char *)counted_malloc(thread, strlen(string) + 1,
+            description);
+    if (copy != NULL) {
+        strcpy(copy, string);
+    }
+    return copy;
 }
 #else
-char *jessu_strdup(THREAD_TYPE, const char *string, char *)
+char *jessu_strdup(THREAD_TYPE thread, const char *string, char *description)
 {
-    return strdup(string);
+    char *copy = (char *)counted_malloc(thread, strlen(string) + 1,
+            description);
+    if (copy != NULL) {
+        strcpy(copy, string);
+    }
+    return copy;
 }
 #endif
 
@@ -2278,15 +3335,15 @@ void jessu_printf(THREAD_TYPE thread, char *fmt, ...)
         DWORD time = timeGetTime();
         int seconds = time/1000%100;
         int mseconds = time%1000;
-        char buf[256];
+        char buf[DEBUG_LINE_LENGTH];
 
 #if PER_FRAME_OUTPUT
         static last_time = 0;
         DWORD diff = time - last_time;
 
         if (last_time != 0 && diff > 250) {
-            fprintf(debug_output, "------- %d.%03d seconds gap\n",
-                    diff/1000, diff%1000);
+            sprintf(buf, "------- %d.%03d seconds gap", diff/1000, diff%1000);
+            add_debug_line(buf);
         }
         last_time = time;
 #endif
@@ -2296,14 +3353,18 @@ void jessu_printf(THREAD_TYPE thread, char *fmt, ...)
         int spaces = thread*20;
 
         memset(buf + len, ' ', spaces);
+        len += spaces;
 
+        // cut long lines (filenames, mostly) rather than overrun "buf".
+        // _vsnprintf() doesn't end them when it cuts them.
         va_list ap;
         va_start(ap, fmt);
-        vsprintf(buf + len + spaces, fmt, ap);
+        _vsnprintf(buf + len, sizeof(buf) - len - 1, fmt, ap);
         va_end(ap);
+        buf[sizeof(buf) - 1] = '\0';
 
-        fprintf(debug_output, "%s\n", buf);
-        fflush(debug_output);
+        // the writer thread does the disk
+        add_debug_line(buf);
     }
 #endif
 }
@@ -2342,6 +3403,12 @@ usage(void)
         "\n"
         "Options:\n"
         "    /b\t\trun benchmark and report results\n"
+        "    /soft\tdraw without the graphics board\n"
+        "    /render s f\twrite \"s\" seconds of video to \"f\"\n"
+        "    /stages f\ttime each loading stage, as JSON in \"f\"\n"
+        "    /trace f\twrite a timeline of the threads to \"f\"\n"
+        "    /memory f\twrite where the memory goes to \"f\"\n"
+        "    /budget n\tuse at most \"n\" MB for the pictures\n"
 #if OUTPUT_DEBUG_FILE
         "    /d\t\tprint debugging information\n"
 #endif
@@ -2349,6 +3416,8 @@ usage(void)
         "    /D\t\tdisplay debugging information\n"
         "    /seed n\tset the random seed to \"n\"\n"
         "    /dir d\tset the pictures directory to \"d\"\n"
+        "    /filters d\tcompare scaling filters on pictures in \"d\"\n"
+        "    /cpubench f\ttime the processor's work, as JSON in \"f\"\n"
 #endif
         "\n"
         "Modes:\n"
@@ -2380,6 +3449,7 @@ static void cleanup()
 #else
     cleanup_gl();
 #endif
+    free_soft_frame(&soft_frame);
 }
 
 int APIENTRY
@@ -2430,6 +3500,66 @@ WinMain(HINSTANCE hInstance, HINSTANCE /* hPrevInst */,
             argv++;
             in_screensaver = true;
             do_benchmark = true;
+        } else if (strcmp(argv[1], "/soft") == 0) {
+            /* draw in software */
+            argc--;
+            argv++;
+            soft_render = true;
+        } else if (strcmp(argv[1], "/render") == 0) {
+            /* to a video file, with no window */
+            argc--;
+            argv++;
+            if (argc < 3) {
+                usage();
+            }
+            render_seconds = atoi(argv[1]);
+            render_filename = argv[2];
+            argc -= 2;
+            argv += 2;
+            soft_render = true;
+        } else if (strcmp(argv[1], "/stages") == 0) {
+            /* histograms of the loading stages, at the end and on 'T' */
+            argc--;
+            argv++;
+            if (argc < 2) {
+                usage();
+            }
+            stages_filename = argv[1];
+            argc--;
+            argv++;
+            enable_stage_times();
+        } else if (strcmp(argv[1], "/trace") == 0) {
+            /* Chrome trace events, at the end and on 'T' */
+            argc--;
+            argv++;
+            if (argc < 2) {
+                usage();
+            }
+            trace_filename = argv[1];
+            argc--;
+            argv++;
+            start_trace();
+            set_trace_thread_name("drawing");
+        } else if (strcmp(argv[1], "/memory") == 0) {
+            /* memory use by description, at the end and on 'M' */
+            argc--;
+            argv++;
+            if (argc < 2) {
+                usage();
+            }
+            memory_filename = argv[1];
+            argc--;
+            argv++;
+        } else if (strcmp(argv[1], "/budget") == 0) {
+            /* megabytes to plan the textures and workers around */
+            argc--;
+            argv++;
+            if (argc < 2) {
+                usage();
+            }
+            memory_budget = (DWORD)atoi(argv[1])*1024*1024;
+            argc--;
+            argv++;
         } else if (strcmp(argv[1], "/s") == 0) {
             /* regular full-screen */
             argc--;
@@ -2470,6 +3600,35 @@ WinMain(HINSTANCE hInstance, HINSTANCE /* hPrevInst */,
             g_parent_window = (HWND)atol(argv[1]);
             argc--;
             argv++;
+#if !RELEASE_QUALITY
+        } else if (strcmp(argv[1], "/filters") == 0) {
+            /* write a table comparing the filters, then quit */
+            argc--;
+            argv++;
+            if (argc < 2) {
+                usage();
+            }
+            FILE *filters_output = fopen(FILTERS_FILENAME, "w");
+            if (filters_output != NULL) {
+                bench_scale_filters(argv[1], filters_output);
+                fclose(filters_output);
+            }
+            exit(EXIT_SUCCESS);
+        } else if (strcmp(argv[1], "/cpubench") == 0) {
+            /* time the loading pipeline without a window, then quit */
+            argc--;
+            argv++;
+            if (argc < 2) {
+                usage();
+            }
+            FILE *cpubench_output = fopen(argv[1], "w");
+            if (cpubench_output == NULL) {
+                exit(EXIT_FAILURE);
+            }
+            bench_cpu_pipeline(cpubench_output);
+            fclose(cpubench_output);
+            exit(EXIT_SUCCESS);
+#endif
 #if !RELEASE_QUALITY
         } else if (strcmp(argv[1], "/seed") == 0) {
             /* set random seed */
@@ -2495,6 +3654,8 @@ WinMain(HINSTANCE hInstance, HINSTANCE /* hPrevInst */,
                     (LPCTSTR)"Couldn't open " OUTPUT_FILENAME ".",
                     "Couldn't open " OUTPUT_FILENAME,
                     MB_OK | MB_ICONEXCLAMATION);
+        } else {
+            start_debug_log(debug_output);
         }
     } else {
         debug_output = stdout;  // basically ignored
@@ -2516,7 +3677,11 @@ WinMain(HINSTANCE hInstance, HINSTANCE /* hPrevInst */,
     /* ---- get defaults from the registry -------------------------- */
 
     display_filename = get_show_filenames();
+    // the video waits for the whole picture instead
+    fast_start = get_fast_start() && render_filename == NULL;
     int use_less_memory = get_less_memory();
+    set_scale_filter(get_scale_filter());
+    set_linear_light(get_linear_light());
 
     /* ---- seed the random number generator ------------------------ */
 
@@ -2567,17 +3732,42 @@ WinMain(HINSTANCE hInstance, HINSTANCE /* hPrevInst */,
 
     /* ---- initialize GLUT ----------------------------------------- */
 
-    create_rendering_window(hInstance, nCmdShow);
+    if (render_filename != NULL) {
+        window_width = RENDER_WIDTH;
+        window_height = RENDER_HEIGHT;
+    } else {
+        create_rendering_window(hInstance, nCmdShow);
+    }
 #if USE_D3D
-    if (error_message == NULL) {
+    if (error_message == NULL && !soft_render) {
         setup_rendering_on_window(rendering_window);
+        fall_back_to_soft_render();
     }
 #endif
 
     /* ---- set up textures ----------------------------------------- */
 
+    // one worker per processor, plus a picture waiting in the wings, if
+    // the memory plan has room for them
+    SYSTEM_INFO system_info;
+    GetSystemInfo(&system_info);
+    processor_count = system_info.dwNumberOfProcessors;
+    worker_count = processor_count;
+    if (worker_count > MAXIMUM_WORKER_THREADS) {
+        worker_count = MAXIMUM_WORKER_THREADS;
+    } else if (worker_count < 1) {
+        worker_count = 1;
+    }
+    prefetch_count = worker_count + 1;
+    loading_limit = worker_count;
+    strip_thread_limit = processor_count;
+
+    // the GL thread takes it even if the workers never start
+    InitializeCriticalSection(&prefetch_lock);
+
     probe_rendering_capabilities();
-    set_up_textures(!in_fullscreen, use_less_memory);
+    set_up_textures(!in_fullscreen && render_filename == NULL,
+            use_less_memory);
 
     /* ---- benchmarking -------------------------------------------- */
 
@@ -2613,16 +3803,20 @@ WinMain(HINSTANCE hInstance, HINSTANCE /* hPrevInst */,
     }
 #endif
 
-    /* ---- start the worker thread --------------------------------- */
+    /* ---- start the worker threads -------------------------------- */
 
     if (error_message == NULL) {
         HANDLE worker_thread_handle;
         DWORD worker_thread_id;
         HANDLE graphics_thread_handle;
 
+        jessu_printf(THREAD_GL, "starting %d worker threads", worker_count);
+
         g_worker_thread_should_quit = 0;
-        worker_thread_handle = CreateThread(NULL, 0, worker_thread, NULL, 0,
-                &worker_thread_id);
+        for (int i = 0; i < worker_count; i++) {
+            worker_thread_handle = CreateThread(NULL, 0, worker_thread, NULL,
+                    0, &worker_thread_id);
+        }
         graphics_thread_handle = GetCurrentThread();
 
 #if 0
@@ -2640,25 +3834,57 @@ WinMain(HINSTANCE hInstance, HINSTANCE /* hPrevInst */,
 
 #if !USE_D3D
     if (print_debugging && gl_context != NULL) {
-        fprintf(debug_output, "GL_VERSION: %s\n", glGetString(GL_VERSION));
-        fprintf(debug_output, "GL_RENDERER: %s\n", glGetString(GL_RENDERER));
-        fprintf(debug_output,
-                "GL_EXTENSIONS: %s\n", glGetString(GL_EXTENSIONS));
-        fprintf(debug_output, "GL_VENDOR: %s\n", glGetString(GL_VENDOR));
+        jessu_printf(THREAD_GL, "GL_VERSION: %s", glGetString(GL_VERSION));
+        jessu_printf(THREAD_GL, "GL_RENDERER: %s", glGetString(GL_RENDERER));
+        jessu_printf(THREAD_GL, "GL_VENDOR: %s", glGetString(GL_VENDOR));
+
+        // one to a line, since the list is longer than a debugging line
+        const char *extensions = (const char *)glGetString(GL_EXTENSIONS);
+        while (extensions != NULL && *extensions != '\0') {
+            int length = strcspn(extensions, " ");
+
+            if (length > 0) {
+                jessu_printf(THREAD_GL, "GL_EXTENSION: %.*s",
+                        length, extensions);
+            }
+            extensions += length;
+            while (*extensions == ' ') {
+                extensions++;
+            }
+        }
     }
 #endif
 
-    if (in_fullscreen) {
-        hide_cursor();
-    }
+    int exit_status = EXIT_SUCCESS;
+
+    if (render_filename != NULL) {
+        if (error_message == NULL) {
+            render_slide_show();
+        }
+        if (error_message != NULL) {
+            jessu_printf(THREAD_GL, "Can't render: %s", error_message);
+            fprintf(stderr, "%s\n", error_message);
+            exit_status = EXIT_FAILURE;
+        }
+    } else {
+        if (in_fullscreen) {
+            hide_cursor();
+        }
 
-    handle_events_until_done();
+        handle_events_until_done();
+    }
     g_worker_thread_should_quit = 1;
 
+    write_report_file(stages_filename, write_stage_times, "stage times");
+    write_report_file(trace_filename, write_trace, "trace");
+    write_report_file(memory_filename, write_memory_use, "memory use");
+    log_memory_use();
+
     cleanup();
 
+    stop_debug_log();
     fclose(debug_output);
 
-    return EXIT_SUCCESS;
+    return exit_status;
 }
 
@@ -59,9 +59,25 @@
 // 1 for TV viewing, 0 for monitor viewing
 #define TV_VIEWING          1
 
-// how much to shrink each tile so that we never read past its edge.
-// must be a multiple of 0.5.  Typically 0.5 is enough.
-#define TILE_SHRINK             0.5
+// each tile has a border this many texels wide that repeats the edge of
+// its neighbors, and only the inside is drawn, so that bilinear filtering
+// never reads past the edge and neighboring tiles meet without a seam.
+#define TILE_APRON              1
+
+// where each color goes in the texels of a tile
+#if USE_D3D
+// ARGB but little-endian
+#define DST_RED     2
+#define DST_GRN     1
+#define DST_BLU     0
+#define DST_ALP     3
+#else
+// RGBA
+#define DST_RED     0
+#define DST_GRN     1
+#define DST_BLU     2
+#define DST_ALP     3
+#endif
 
 extern FILE *debug_output;
 
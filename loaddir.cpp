@@ -66,6 +66,7 @@
 #include "jessu.h"
 #include "loaddir.h"
 #include "config.h"
+#include "tracefile.h"
 
 #define EVAL_LIMIT_IMAGE "jessu_limit.jpg"
 
@@ -219,6 +220,8 @@ load_directory(char *dir)
     }
 
     _findclose(hnd);
+
+    trace_counter("files_found", file_count);
 }
 
 char *
@@ -259,7 +262,10 @@ load_directory_thread(void *params)
     char *dir = (char *)params;
 
     srand(seed);
+    set_trace_thread_name("loader");
+    trace_begin("load_directory");
     load_directory(dir);
+    trace_end("load_directory");
     done_loading_files = 1;
     jessu_printf(THREAD_LOADDIR, "Read %d filenames in all", file_count);
 
@@ -289,6 +295,29 @@ start_getting_filenames_from_directory(char *directory)
 }
 
 
+int
+scan_directory(char *directory)
+{
+    static bool initialized = false;
+
+    if (!initialized) {
+        InitializeCriticalSection(&loading_files_mutex);
+        initialized = true;
+    }
+
+    for (int i = 0; i < file_count; i++) {
+        jessu_free(THREAD_LOADDIR, file_names[i], "dir path");
+    }
+    file_count = 0;
+    file_pointer = 0;
+
+    load_directory(directory);
+    done_loading_files = 1;
+
+    return file_count;
+}
+
+
 bool
 get_filenames_from_file(char *slideshow_file)
 {
@@ -32,6 +32,11 @@ typedef struct {
 
 void set_max_images(int max);
 bool start_getting_filenames_from_directory(char *directory);
+
+// reads the names of the pictures under "directory" before returning,
+// in place of any there were, and returns how many there are.  for
+// timing the scan.
+int scan_directory(char *directory);
 bool get_filenames_from_file(char *slideshow_file);
 char *get_next_filename(MISC_INFO **misc_info);
 void set_direction(int dir);
@@ -0,0 +1,374 @@
+/*
+ * MemUse.cpp
+ *
+ * Each block has a small header in front with its size and what it was
+ * counted as, so freeing it takes it off the right counters whichever
+ * thread does that.  The counters are kept for each description and kind
+ * of thread, and any thread can change them at once with the Interlocked
+ * functions; nothing waits except the first time a description is seen.
+ *
+ */
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memuse.h"
+
+// in front of each block.  16 so the block is aligned as well as malloc()
+// would have done it.
+#define MEMORY_HEADER_BYTES         16
+
+struct MEMORY_HEADER {
+    size_t size;
+    short tag;
+    short thread;
+};
+
+// descriptions we keep apart.  the rest are counted together as the
+// first one.
+#define MEMORY_MAXIMUM_TAGS         64
+
+#define MEMORY_THREAD_TYPES         (THREAD_LOADDIR + 1)
+
+// by powers of two: bucket n has the blocks up to 2^n bytes
+#define MEMORY_SIZE_BUCKETS         32
+
+struct MEMORY_USE {
+    volatile LONG current;
+    volatile LONG peak;
+    volatile LONG allocations;
+    volatile LONG frees;
+    volatile LONG size_count[MEMORY_SIZE_BUCKETS];
+};
+
+static char *tag_name[MEMORY_MAXIMUM_TAGS] = { "other" };
+static volatile LONG tag_count = 1;
+static volatile LONG tag_lock;
+
+static MEMORY_USE use[MEMORY_MAXIMUM_TAGS][MEMORY_THREAD_TYPES];
+
+// all of them together, which doesn't peak when the parts do
+static volatile LONG total_current;
+static volatile LONG total_peak;
+
+static char *thread_name[MEMORY_THREAD_TYPES] = {
+    "gl",
+    "worker",
+    "loaddir",
+};
+
+static int
+find_tag(char *description, int count)
+{
+    int i;
+
+    // the same literal, then one spelled the same in another file
+    for (i = 1; i < count; i++) {
+        if (tag_name[i] == description) {
+            return i;
+        }
+    }
+    for (i = 1; i < count; i++) {
+        if (strcmp(tag_name[i], description) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static int
+get_tag(char *description)
+{
+    if (description == NULL) {
+        return 0;
+    }
+
+    int tag = find_tag(description, tag_count);
+    if (tag >= 0) {
+        return tag;
+    }
+
+    // a new one.  it's rare enough that spinning is fine.
+    while (InterlockedExchange((LONG *)&tag_lock, 1) != 0) {
+        Sleep(0);
+    }
+
+    tag = find_tag(description, tag_count);
+    if (tag < 0) {
+        if (tag_count < MEMORY_MAXIMUM_TAGS) {
+            tag = tag_count;
+            tag_name[tag] = description;
+            InterlockedIncrement((LONG *)&tag_count);
+        } else {
+            tag = 0;
+        }
+    }
+
+    InterlockedExchange((LONG *)&tag_lock, 0);
+
+    return tag;
+}
+
+static int
+get_size_bucket(size_t size)
+{
+    int bucket = 0;
+
+    while (bucket < MEMORY_SIZE_BUCKETS - 1 &&
+            ((size_t)1 << bucket) < size) {
+
+        bucket++;
+    }
+
+    return bucket;
+}
+
+// raises "peak" to "value" if it's below
+static void
+raise_peak(volatile LONG *peak, LONG value)
+{
+    LONG seen = *peak;
+
+    while (seen < value) {
+        LONG old = InterlockedCompareExchange((LONG *)peak, value, seen);
+        if (old == seen) {
+            break;
+        }
+        seen = old;
+    }
+}
+
+static void
+count_block(MEMORY_HEADER *header)
+{
+    MEMORY_USE *u = &use[header->tag][header->thread];
+    LONG size = (LONG)header->size;
+
+    raise_peak(&u->peak, InterlockedExchangeAdd((LONG *)&u->current, size) +
+            size);
+    raise_peak(&total_peak, InterlockedExchangeAdd((LONG *)&total_current,
+                size) + size);
+    InterlockedIncrement((LONG *)&u->allocations);
+    InterlockedIncrement((LONG *)&u->size_count[get_size_bucket(
+                header->size)]);
+}
+
+static void
+uncount_block(MEMORY_HEADER *header)
+{
+    MEMORY_USE *u = &use[header->tag][header->thread];
+    LONG size = (LONG)header->size;
+
+    InterlockedExchangeAdd((LONG *)&u->current, -size);
+    InterlockedExchangeAdd((LONG *)&total_current, -size);
+    InterlockedIncrement((LONG *)&u->frees);
+}
+
+// fills in the header of "block" and returns what's after it
+static void *
+start_block(void *block, THREAD_TYPE thread, size_t size, char *description)
+{
+    MEMORY_HEADER *header = (MEMORY_HEADER *)block;
+
+    if (block == NULL) {
+        return NULL;
+    }
+
+    header->size = size;
+    header->tag = (short)get_tag(description);
+    header->thread = (short)thread;
+    count_block(header);
+
+    return (unsigned char *)block + MEMORY_HEADER_BYTES;
+}
+
+// whether "count" blocks of "size" bytes and the header don't fit in a
+// size_t.  the sum would wrap and we'd get a small block back.
+static bool
+too_big(size_t count, size_t size)
+{
+    return size != 0 && count > ((size_t)-1 - MEMORY_HEADER_BYTES)/size;
+}
+
+void *counted_malloc(THREAD_TYPE thread, size_t size, char *description)
+{
+    if (too_big(1, size)) {
+        return NULL;
+    }
+
+    return start_block(malloc(MEMORY_HEADER_BYTES + size), thread, size,
+            description);
+}
+
+void *counted_calloc(THREAD_TYPE thread, size_t count, size_t size,
+        char *description)
+{
+    if (too_big(count, size)) {
+        return NULL;
+    }
+
+    return start_block(calloc(1, MEMORY_HEADER_BYTES + count*size), thread,
+            count*size, description);
+}
+
+void *counted_realloc(THREAD_TYPE thread, void *ptr, size_t size,
+        char *description)
+{
+    if (ptr == NULL) {
+        return counted_malloc(thread, size, description);
+    }
+    if (size == 0) {
+        counted_free(ptr);
+        return NULL;
+    }
+    if (too_big(1, size)) {
+        // like a failed realloc(), the old one is left alone
+        return NULL;
+    }
+
+    MEMORY_HEADER *header = (MEMORY_HEADER *)((unsigned char *)ptr -
+            MEMORY_HEADER_BYTES);
+    void *block = realloc(header, MEMORY_HEADER_BYTES + size);
+    if (block == NULL) {
+        // the old one is still there, and still counted
+        return NULL;
+    }
+
+    uncount_block((MEMORY_HEADER *)block);
+
+    return start_block(block, thread, size, description);
+}
+
+void counted_free(void *ptr)
+{
+    if (ptr == NULL) {
+        return;
+    }
+
+    MEMORY_HEADER *header = (MEMORY_HEADER *)((unsigned char *)ptr -
+            MEMORY_HEADER_BYTES);
+
+    uncount_block(header);
+    free(header);
+}
+
+void count_memory(THREAD_TYPE thread, LONG bytes, char *description)
+{
+    MEMORY_HEADER header;
+
+    header.tag = (short)get_tag(description);
+    header.thread = (short)thread;
+
+    if (bytes >= 0) {
+        header.size = bytes;
+        count_block(&header);
+    } else {
+        header.size = -bytes;
+        uncount_block(&header);
+    }
+}
+
+LONG get_memory_in_use(char *description)
+{
+    if (description == NULL) {
+        return total_current;
+    }
+
+    LONG bytes = 0;
+    int tag = find_tag(description, tag_count);
+    if (tag >= 0) {
+        for (int thread = 0; thread < MEMORY_THREAD_TYPES; thread++) {
+            bytes += use[tag][thread].current;
+        }
+    }
+
+    return bytes;
+}
+
+LONG get_memory_peak(char *description)
+{
+    if (description == NULL) {
+        return total_peak;
+    }
+
+    // each thread's peak may have come at a different time, so this is
+    // at least the real one
+    LONG bytes = 0;
+    int tag = find_tag(description, tag_count);
+    if (tag >= 0) {
+        for (int thread = 0; thread < MEMORY_THREAD_TYPES; thread++) {
+            bytes += use[tag][thread].peak;
+        }
+    }
+
+    return bytes;
+}
+
+void write_memory_use(FILE *out)
+{
+    LONG count = tag_count;
+    bool first = true;
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"current\": %ld, \"peak\": %ld,\n", total_current,
+            total_peak);
+    fprintf(out, "  \"blocks\": [");
+
+    for (int tag = 0; tag < count; tag++) {
+        for (int thread = 0; thread < MEMORY_THREAD_TYPES; thread++) {
+            MEMORY_USE *u = &use[tag][thread];
+
+            if (u->allocations == 0) {
+                continue;
+            }
+
+            fprintf(out, "%s\n    {\"description\": \"%s\", "
+                    "\"thread\": \"%s\", \"current\": %ld, \"peak\": %ld, "
+                    "\"allocations\": %ld, \"frees\": %ld,\n"
+                    "      \"sizes\": [",
+                    first ? "" : ",", tag_name[tag], thread_name[thread],
+                    u->current, u->peak, u->allocations, u->frees);
+            first = false;
+
+            // the buckets with anything in them, as [low, high, count]
+            bool first_size = true;
+            for (int i = 0; i < MEMORY_SIZE_BUCKETS; i++) {
+                if (u->size_count[i] != 0) {
+                    fprintf(out, "%s[%lu, %lu, %ld]", first_size ? "" : ", ",
+                            i == 0 ? 0 : (1UL << (i - 1)) + 1, 1UL << i,
+                            u->size_count[i]);
+                    first_size = false;
+                }
+            }
+            fprintf(out, "]}");
+        }
+    }
+
+    fprintf(out, "\n  ]\n}\n");
+}
+
+void log_memory_use()
+{
+    LONG count = tag_count;
+
+    jessu_printf(THREAD_GL, "memory: %ld KB now, %ld KB at the most",
+            total_current/1024, total_peak/1024);
+
+    for (int tag = 0; tag < count; tag++) {
+        for (int thread = 0; thread < MEMORY_THREAD_TYPES; thread++) {
+            MEMORY_USE *u = &use[tag][thread];
+
+            if (u->allocations == 0) {
+                continue;
+            }
+
+            jessu_printf(THREAD_GL, "memory: \"%s\" (%s) %ld KB now, "
+                    "%ld KB at the most, %ld allocations, %ld frees",
+                    tag_name[tag], thread_name[thread], u->current/1024,
+                    u->peak/1024, u->allocations, u->frees);
+        }
+    }
+}
@@ -0,0 +1,45 @@
+/*
+ * MemUse.h
+ *
+ * Counts the memory allocated through jessu_malloc() and friends, by
+ * description and by the kind of thread that asked for it, so we can
+ * see where it goes (tiles, the filter tables, the file list...).
+ *
+ */
+
+#ifndef __MEMUSE_H__
+#define __MEMUSE_H__
+
+
+#include <windows.h>
+#include <stdio.h>
+
+#include "jessu.h"
+
+// what jessu_malloc() and friends are underneath.  "description" must be
+// a string that stays around, such as a literal.  blocks from these must
+// be freed with counted_free().
+void *counted_malloc(THREAD_TYPE thread, size_t size, char *description);
+void *counted_calloc(THREAD_TYPE thread, size_t count, size_t size,
+        char *description);
+void *counted_realloc(THREAD_TYPE thread, void *ptr, size_t size,
+        char *description);
+void counted_free(void *ptr);
+
+// for memory that doesn't come from these, such as VirtualAlloc()'s.
+// negative "bytes" for giving it back.
+void count_memory(THREAD_TYPE thread, LONG bytes, char *description);
+
+// bytes in use now and at the most, for blocks with "description" or
+// with NULL for all of them
+LONG get_memory_in_use(char *description);
+LONG get_memory_peak(char *description);
+
+// everything, as JSON
+void write_memory_use(FILE *out);
+
+// a line for each description to the debugging output
+void log_memory_use();
+
+
+#endif /* __MEMUSE_H__ */
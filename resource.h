@@ -29,6 +29,10 @@
 #define IDC_KEY                         6
 #define IDC_LESS_MEMORY                 7
 #define IDC_SHOW_FILENAMES              8
+#define IDC_FAST_START                  9
+#define IDC_SCALE_FILTER                10
+#define IDC_LINEAR_LIGHT                11
+#define IDC_COMPRESS_TEXTURES           12
 
 #define IDI_JESSU                       1
 
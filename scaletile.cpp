@@ -13,313 +13,1556 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 
 #include "scaletile.h"
 #include "jessu.h"
-
-#if USE_D3D
-// ARGB but little-endian
-#define DST_RED     2
-#define DST_GRN     1
-#define DST_BLU     0
-#define DST_ALP     3
-#else
-// RGBA
-#define DST_RED     0
-#define DST_GRN     1
-#define DST_BLU     2
-#define DST_ALP     3
-#endif
+#include "exif.h"
+#include "stagetime.h"
+#include "tracefile.h"
+#include "cpu.h"
 
 #ifndef M_PI
 // how is this not defined in math.h?!
 #define M_PI  3.14159
 #endif
 
-#define TRANSPARENT_BORDER_WIDTH    1
-#define WRITE_OUT_TILES             0
-#define PRINT_CONTRIB_ARRAY         0
+// the apron around the outside of the picture and the texel inside it,
+// so that the edge fades in over a texel
+#define TRANSPARENT_BORDER_WIDTH    (TILE_APRON + 1)
+#define WRITE_OUT_TILES             0
+#define PRINT_CONTRIB_ARRAY         0
+
+/*
+ * Linear light.  Pixels are turned into linear RGBX with 15 bits per
+ * component, so that they fit in a signed short, and the weights into
+ * fixed point with WEIGHT_BITS fraction bits.  At the end the top 12
+ * bits of the linear value index a table going back to sRGB.
+ */
+#define LINEAR_MAXIMUM              32767
+#define LINEAR_TO_SRGB_SHIFT        3
+#define LINEAR_TO_SRGB_SIZE         ((LINEAR_MAXIMUM >> LINEAR_TO_SRGB_SHIFT) + 1)
+#define WEIGHT_BITS                 14
+#define LINEAR_COMPONENTS           4
+#define LINEAR_BYTES_PER_PIXEL      (LINEAR_COMPONENTS*sizeof(short))
+
+static unsigned short srgb_to_linear[256];
+static unsigned char linear_to_srgb[LINEAR_TO_SRGB_SIZE];
+static bool linear_light = false;
+
+/*
+ * The weights for each destination pixel apply to a run of consecutive
+ * source pixels starting at "start".  Runs that hang off either end of
+ * the source reflect back into it; for rows this is done by padding the
+ * row with "padding" reflected pixels on each side, so the inner loop
+ * never has to check.  Everything lives in one block after the struct.
+ * If "box" is more than 1, every "box" source pixels are averaged into
+ * one first, and the runs are in terms of those.  Linear tables have an
+ * even number of taps so that the SSE2 code can do them in pairs.
+ */
+struct CLIST {
+    int box;            /* source pixels averaged before filtering, or 1 */
+    int box_src_size;   /* size of the source before that */
+    int src_size;
+    int dst_size;
+    int taps;       /* weights per destination pixel, trailing ones may be 0 */
+    int padding;    /* largest distance a run goes past either end */
+    int *start;     /* first source pixel of each run, may be negative */
+    float *weight;  /* "taps" weights for each destination pixel */
+
+    /* rows are scaled in linear light, the same weights in fixed point */
+    int linear;
+    short *fixed_weight;
+};
+
+static inline double
+sinc(double x)
+{
+    x *= M_PI;
+    if (x != 0) {
+        return sin(x)/x;
+    }
+
+    return 1;
+}
+
+static double
+Box_filter(double t)
+{
+    if (t > -0.5 && t <= 0.5) {
+        return 1;
+    }
+
+    return 0;
+}
+
+static double
+Triangle_filter(double t)
+{
+    if (t < 0) {
+        t = -t;
+    }
+
+    if (t < 1) {
+        return 1 - t;
+    }
+
+    return 0;
+}
+
+// Mitchell and Netravali's cubic with B = C = 1/3
+static double
+Mitchell_filter(double t)
+{
+    const double B = 1.0/3;
+    const double C = 1.0/3;
+    double tt;
+
+    if (t < 0) {
+        t = -t;
+    }
+    tt = t*t;
+
+    if (t < 1) {
+        return ((12 - 9*B - 6*C)*t*tt + (-18 + 12*B + 6*C)*tt +
+                (6 - 2*B))/6;
+    }
+    if (t < 2) {
+        return ((-B - 6*C)*t*tt + (6*B + 30*C)*tt + (-12*B - 48*C)*t +
+                (8*B + 24*C))/6;
+    }
+
+    return 0;
+}
+
+static double
+Lanczos2_filter(double t)
+{
+    if (t < 0) {
+        t = -t;
+    }
+
+    if (t < 2) {
+        return sinc(t)*sinc(t/2);
+    }
+
+    return 0;
+}
+
+static double
+Lanczos3_filter(double t)
+{
+    if (t < 0) {
+        t = -t;
+    }
+
+    if (t < 3) {
+        return sinc(t)*sinc(t/3);
+    }
+
+    return 0;
+}
+
+struct FILTER_INFO {
+    char *name;
+    double (*function)(double t);
+    double support;
+};
+
+// in the order of the SCALE_FILTER_ defines.  "auto" uses Lanczos2 after
+// averaging down.
+static FILTER_INFO filter_info[SCALE_FILTER_COUNT] = {
+    { "Box", Box_filter, 0.5 },
+    { "Triangle", Triangle_filter, 1 },
+    { "Mitchell", Mitchell_filter, 2 },
+    { "Lanczos2", Lanczos2_filter, 2 },
+    { "Lanczos3", Lanczos3_filter, 3 },
+    { "Automatic", Lanczos2_filter, 2 },
+};
+
+static int scale_filter = SCALE_FILTER_LANCZOS3;
+
+// where a pixel off either end of the source reflects back to
+static inline int
+reflect_pixel(int pixel, int size)
+{
+    // loop in case it bounces more than once
+    for (;;) {
+        if (pixel < 0) {
+            pixel = -pixel;
+        } else if (pixel >= size) {
+            pixel = (size - pixel) + size - 1;
+        } else {
+            return pixel;
+        }
+    }
+}
+
+static CLIST *
+make_contrib_table(int src_size, int dst_size, int tile_size, int filter,
+        int linear, int *table_bytes)
+{
+    CLIST *contrib;
+    int i, j;
+    int left;
+    int taps;
+    int box;
+    int box_src_size;
+    double scale;
+    double width, fscale;
+    double center;
+    double fwidth;
+    double (*filter_function)(double t);
+
+    filter_function = filter_info[filter].function;
+    fwidth = filter_info[filter].support;
+
+    // the picture is spread over the inside of the tiles.  the aprons
+    // get the neighboring tiles' edge pixels.
+    int num_tiles = dst_size / tile_size;
+    int effective_tile_size = tile_size - TILE_APRON*2;
+    int effective_dst_size = num_tiles * effective_tile_size;
+
+    scale = (double)effective_dst_size / src_size;
+
+    // for big reductions, averaging whole blocks of pixels is much
+    // cheaper than a wide filter.  the filter does what's left, which is
+    // less than half again.
+    box = 1;
+    if (filter == SCALE_FILTER_AUTO && scale < 0.5) {
+        box = (int)(1/scale);
+    }
+    box_src_size = src_size;
+    src_size = (src_size + box - 1)/box;
+    scale *= box;
+
+    if (scale < 1.0) {
+        // making image smaller, so stretch the filter to cover more
+        // source pixels
+        width = fwidth / scale;
+        fscale = 1.0 / scale;
+    } else {
+        // making image larger
+        width = fwidth;
+        fscale = 1.0;
+    }
+    taps = (int)(width*2 + 1);
+    if (linear) {
+        taps = (taps + 1) & ~1;
+    }
+
+    *table_bytes = sizeof(CLIST) + dst_size*sizeof(int) +
+        dst_size*taps*sizeof(float);
+    if (linear) {
+        *table_bytes += dst_size*taps*sizeof(short);
+    }
+    contrib = (CLIST *)jessu_malloc(THREAD_WORKER, *table_bytes,
+            "scale clist");
+    contrib->box = box;
+    contrib->box_src_size = box_src_size;
+    contrib->src_size = src_size;
+    contrib->dst_size = dst_size;
+    contrib->taps = taps;
+    contrib->padding = 0;
+    contrib->start = (int *)(contrib + 1);
+    contrib->weight = (float *)(contrib->start + dst_size);
+    contrib->linear = linear;
+    contrib->fixed_weight = linear ?
+        (short *)(contrib->weight + dst_size*taps) : NULL;
+
+    for (i = 0; i < dst_size; i++) {
+        int tile_number = i / tile_size;
+        int tile_offset = i % tile_size;
+        float *weight = contrib->weight + i*taps;
+
+        // where "i" is in the picture, leaving out the aprons
+        int effective_offset = tile_offset - TILE_APRON;
+        int effective_i = tile_number*effective_tile_size +
+            effective_offset;
+
+        // the averaged pixels are centered in their blocks
+        center = (effective_i*box/scale - (box - 1)*0.5)/box;
+#if PRINT_CONTRIB_ARRAY
+        jessu_printf(THREAD_WORKER, "scale=%g, i=%d, tile=%d, offset=%d, "
+                "eoffset=%d, ei=%d, center=%g",
+                scale, i, tile_number, tile_offset, effective_offset,
+                effective_i, center);
+#endif
+
+        // the weights don't quite add up to 1 by themselves
+        double total = 0;
+        left = (int)ceil(center - width);
+        for (j = 0; j < taps; j++) {
+            weight[j] = (float)filter_function(
+                    (center - (double)(left + j))/fscale);
+            total += weight[j];
+        }
+        if (total != 0) {
+            for (j = 0; j < taps; j++) {
+                weight[j] = (float)(weight[j]/total);
+            }
+        }
+
+        if (linear) {
+            // round, then make up the difference on the biggest weight
+            // so that flat areas stay exactly the same
+            short *fixed_weight = contrib->fixed_weight + i*taps;
+            int fixed_total = 0;
+            int biggest = 0;
+
+            for (j = 0; j < taps; j++) {
+                fixed_weight[j] = (short)floor(weight[j]*(1 << WEIGHT_BITS) +
+                        0.5);
+                fixed_total += fixed_weight[j];
+                if (fixed_weight[j] > fixed_weight[biggest]) {
+                    biggest = j;
+                }
+            }
+            fixed_weight[biggest] += (1 << WEIGHT_BITS) - fixed_total;
+        }
+
+        contrib->start[i] = left;
+        if (-left > contrib->padding) {
+            contrib->padding = -left;
+        }
+        if (left + taps - src_size > contrib->padding) {
+            contrib->padding = left + taps - src_size;
+        }
+    }
+
+    return contrib;
+}
+
+/*
+ * Finished tables are kept around, since a camera makes pictures of only
+ * a few sizes and working out the weights is slow.  The cache is shared
+ * by all worker threads.  Tables are counted while in use so that they
+ * aren't thrown out from under anybody, and the least recently used ones
+ * that aren't in use go when the cache is over "contrib_cache_maximum".
+ */
+#define CONTRIB_CACHE_MAXIMUM_BYTES     (4*1024*1024)
+
+struct CONTRIB_CACHE_ENTRY {
+    int src_size;
+    int dst_size;
+    int tile_size;
+    int filter;
+    int linear;
+    CLIST *clist;
+    int bytes;
+    int use_count;
+    CONTRIB_CACHE_ENTRY *next;  // most recently used first
+};
+
+static CONTRIB_CACHE_ENTRY *contrib_cache_head = NULL;
+static int contrib_cache_bytes = 0;
+static int contrib_cache_maximum = CONTRIB_CACHE_MAXIMUM_BYTES;
+
+// the lock has to be ready before the first worker thread starts
+static struct CONTRIB_CACHE_LOCK {
+    CRITICAL_SECTION cs;
+
+    CONTRIB_CACHE_LOCK() {
+        InitializeCriticalSection(&cs);
+    }
+    ~CONTRIB_CACHE_LOCK() {
+        DeleteCriticalSection(&cs);
+    }
+} contrib_cache_lock;
+
+// call with "contrib_cache_lock"
+static void
+trim_contrib_cache()
+{
+    CONTRIB_CACHE_ENTRY **pp = &contrib_cache_head;
+    CONTRIB_CACHE_ENTRY **last_unused = NULL;
+
+    while (contrib_cache_bytes > contrib_cache_maximum) {
+        // find the least recently used table that nobody is using
+        last_unused = NULL;
+        for (pp = &contrib_cache_head; *pp != NULL; pp = &(*pp)->next) {
+            if ((*pp)->use_count == 0) {
+                last_unused = pp;
+            }
+        }
+
+        if (last_unused == NULL) {
+            break;
+        }
+
+        CONTRIB_CACHE_ENTRY *p = *last_unused;
+        *last_unused = p->next;
+        contrib_cache_bytes -= p->bytes;
+
+        jessu_printf(THREAD_WORKER, "Dropping %dx%d contrib table, "
+                "cache is %d bytes", p->src_size, p->dst_size,
+                contrib_cache_bytes);
+
+        jessu_free(THREAD_WORKER, p->clist, "scale clist");
+        delete p;
+    }
+}
+
+// call with "contrib_cache_lock".  moves the entry to the front.
+static CONTRIB_CACHE_ENTRY *
+find_contrib_table(int src_size, int dst_size, int tile_size, int filter,
+        int linear)
+{
+    CONTRIB_CACHE_ENTRY **pp;
+
+    for (pp = &contrib_cache_head; *pp != NULL; pp = &(*pp)->next) {
+        CONTRIB_CACHE_ENTRY *p = *pp;
+
+        if (p->src_size == src_size && p->dst_size == dst_size &&
+                p->tile_size == tile_size && p->filter == filter &&
+                p->linear == linear) {
+
+            *pp = p->next;
+            p->next = contrib_cache_head;
+            contrib_cache_head = p;
+
+            return p;
+        }
+    }
+
+    return NULL;
+}
+
+// the table must be given back with release_contrib_table()
+static CLIST *
+get_contrib_table(int src_size, int dst_size, int tile_size)
+{
+    CONTRIB_CACHE_ENTRY *p;
+    int filter = scale_filter;
+    int linear = linear_light;
+
+    EnterCriticalSection(&contrib_cache_lock.cs);
+    p = find_contrib_table(src_size, dst_size, tile_size, filter,
+            linear);
+    if (p != NULL) {
+        p->use_count++;
+        LeaveCriticalSection(&contrib_cache_lock.cs);
+        return p->clist;
+    }
+    LeaveCriticalSection(&contrib_cache_lock.cs);
+
+    // not there, make one without holding up the other threads
+    int bytes;
+    CLIST *clist = make_contrib_table(src_size, dst_size, tile_size, filter,
+            linear, &bytes);
+
+    EnterCriticalSection(&contrib_cache_lock.cs);
+
+    p = find_contrib_table(src_size, dst_size, tile_size, filter,
+            linear);
+    if (p != NULL) {
+        // another thread beat us to it
+        jessu_free(THREAD_WORKER, clist, "scale clist");
+    } else {
+        p = new CONTRIB_CACHE_ENTRY;
+        p->src_size = src_size;
+        p->dst_size = dst_size;
+        p->tile_size = tile_size;
+        p->filter = filter;
+        p->linear = linear;
+        p->clist = clist;
+        p->bytes = bytes;
+        p->use_count = 0;
+        p->next = contrib_cache_head;
+        contrib_cache_head = p;
+
+        contrib_cache_bytes += bytes;
+        jessu_printf(THREAD_WORKER, "Added %dx%d %s contrib table, "
+                "cache is %d bytes", src_size, dst_size,
+                filter_info[filter].name, contrib_cache_bytes);
+    }
+
+    p->use_count++;
+    clist = p->clist;
+
+    trim_contrib_cache();
+
+    LeaveCriticalSection(&contrib_cache_lock.cs);
+
+    return clist;
+}
+
+static void
+release_contrib_table(CLIST *clist)
+{
+    CONTRIB_CACHE_ENTRY *p;
+
+    if (clist == NULL) {
+        return;
+    }
+
+    EnterCriticalSection(&contrib_cache_lock.cs);
+
+    for (p = contrib_cache_head; p != NULL; p = p->next) {
+        if (p->clist == clist) {
+            p->use_count--;
+            break;
+        }
+    }
+
+    trim_contrib_cache();
+
+    LeaveCriticalSection(&contrib_cache_lock.cs);
+}
+
+void set_contrib_cache_maximum(int bytes)
+{
+    EnterCriticalSection(&contrib_cache_lock.cs);
+    contrib_cache_maximum = bytes;
+    trim_contrib_cache();
+    LeaveCriticalSection(&contrib_cache_lock.cs);
+}
+
+inline unsigned char clamp_color(double color)
+{
+    int j = (int)color;
+
+    if (j < 0) {
+        j = 0;
+    }
+    if (j > 255) {
+        j = 255;
+    }
+
+    return (unsigned char)j;
+}
+
+static void
+make_linear_light_tables()
+{
+    int i;
+
+    for (i = 0; i < 256; i++) {
+        double c = i/255.0;
+        double linear;
+
+        if (c <= 0.04045) {
+            linear = c/12.92;
+        } else {
+            linear = pow((c + 0.055)/1.055, 2.4);
+        }
+
+        srgb_to_linear[i] = (unsigned short)floor(linear*LINEAR_MAXIMUM + 0.5);
+    }
+
+    // each entry is for the middle of its range of linear values
+    for (i = 0; i < LINEAR_TO_SRGB_SIZE; i++) {
+        double linear = ((i << LINEAR_TO_SRGB_SHIFT) +
+                (1 << LINEAR_TO_SRGB_SHIFT)/2)/(double)LINEAR_MAXIMUM;
+        double c;
+
+        if (linear > 1) {
+            linear = 1;
+        }
+        if (linear <= 0.0031308) {
+            c = linear*12.92;
+        } else {
+            c = 1.055*pow(linear, 1/2.4) - 0.055;
+        }
+
+        linear_to_srgb[i] = (unsigned char)floor(c*255 + 0.5);
+    }
+
+    jessu_printf(THREAD_WORKER, "Linear light scaling%s",
+            has_sse2() ? " with SSE2" : "");
+}
+
+void set_linear_light(bool linear)
+{
+    static bool made_tables = false;
+
+    if (linear && !made_tables) {
+        make_linear_light_tables();
+        made_tables = true;
+    }
+
+    linear_light = linear;
+}
+
+void set_scale_filter(int filter)
+{
+    if (filter >= 0 && filter < SCALE_FILTER_COUNT) {
+        scale_filter = filter;
+    }
+}
+
+char *get_scale_filter_name(int filter)
+{
+    return filter_info[filter].name;
+}
+
+CLIST *get_scale_row_data(int src_size, int dst_size, int tile_size)
+{
+    return get_contrib_table(src_size, dst_size, tile_size);
+}
+
+void release_scale_row_data(CLIST *clist)
+{
+    release_contrib_table(clist);
+}
+
+CLIST *make_scale_row_data(int src_size, int dst_size, int tile_size)
+{
+    int bytes;
+
+    return make_contrib_table(src_size, dst_size, tile_size, scale_filter,
+            linear_light, &bytes);
+}
+
+void free_scale_row_data(CLIST *clist)
+{
+    jessu_free(THREAD_WORKER, clist, "scale clist");
+}
+
+int get_scale_row_padding(CLIST *clist)
+{
+    return clist->padding;
+}
+
+int get_scale_row_pixel_bytes(CLIST *clist)
+{
+    return clist->linear ? LINEAR_BYTES_PER_PIXEL : BYTES_PER_PIXEL;
+}
+
+int get_scale_pixel_bytes()
+{
+    return linear_light ? LINEAR_BYTES_PER_PIXEL : BYTES_PER_PIXEL;
+}
+
+int get_mipmap_level_count(int size_x, int size_y)
+{
+    int levels = 1;
+
+    while (size_x > 1 || size_y > 1) {
+        size_x = size_x > 1 ? size_x/2 : 1;
+        size_y = size_y > 1 ? size_y/2 : 1;
+        levels++;
+    }
+
+    return levels;
+}
+
+void get_mipmap_level_size(int size_x, int size_y, int level,
+        int *level_size_x, int *level_size_y)
+{
+    for (int i = 0; i < level; i++) {
+        size_x = size_x > 1 ? size_x/2 : 1;
+        size_y = size_y > 1 ? size_y/2 : 1;
+    }
+
+    *level_size_x = size_x;
+    *level_size_y = size_y;
+}
+
+unsigned char *get_mipmap_level(unsigned char *tile, int size_x, int size_y,
+        int level, int *level_size_x, int *level_size_y)
+{
+    for (int i = 0; i < level; i++) {
+        tile += size_x*size_y*BYTES_PER_TEXEL;
+        size_x = size_x > 1 ? size_x/2 : 1;
+        size_y = size_y > 1 ? size_y/2 : 1;
+    }
+
+    *level_size_x = size_x;
+    *level_size_y = size_y;
+
+    return tile;
+}
+
+int get_mipmap_bytes(int size_x, int size_y)
+{
+    int levels = get_mipmap_level_count(size_x, size_y);
+    int bytes = 0;
+
+    for (int level = 0; level < levels; level++) {
+        bytes += size_x*size_y*BYTES_PER_TEXEL;
+        size_x = size_x > 1 ? size_x/2 : 1;
+        size_y = size_y > 1 ? size_y/2 : 1;
+    }
+
+    return bytes;
+}
+
+// averages each 2x2 block of "src" into a texel of "dst"
+static void
+reduce_mipmap_level(unsigned char *src, int src_size_x, int src_size_y,
+        unsigned char *dst, int dst_size_x, int dst_size_y)
+{
+    for (int y = 0; y < dst_size_y; y++) {
+        int src_y1 = 2*y + 1 < src_size_y ? 2*y + 1 : 2*y;
+        unsigned char *row0 = src + 2*y*src_size_x*BYTES_PER_TEXEL;
+        unsigned char *row1 = src + src_y1*src_size_x*BYTES_PER_TEXEL;
+        unsigned char *d = dst + y*dst_size_x*BYTES_PER_TEXEL;
+        int x = 0;
+
+#if USE_SSE2
+        if (has_sse2() && src_size_x == dst_size_x*2) {
+            __m128i zero = _mm_setzero_si128();
+            __m128i two = _mm_set1_epi16(2);
+
+            // eight source texels from each row make four
+            for (; x + 4 <= dst_size_x; x += 4) {
+                unsigned char *s0 = row0 + 2*x*BYTES_PER_TEXEL;
+                unsigned char *s1 = row1 + 2*x*BYTES_PER_TEXEL;
+                __m128i a0 = _mm_loadu_si128((__m128i *)s0);
+                __m128i a1 = _mm_loadu_si128((__m128i *)(s0 + 16));
+                __m128i b0 = _mm_loadu_si128((__m128i *)s1);
+                __m128i b1 = _mm_loadu_si128((__m128i *)(s1 + 16));
+
+                // the two rows added, two texels in each
+                __m128i sum01 = _mm_add_epi16(_mm_unpacklo_epi8(a0, zero),
+                        _mm_unpacklo_epi8(b0, zero));
+                __m128i sum23 = _mm_add_epi16(_mm_unpackhi_epi8(a0, zero),
+                        _mm_unpackhi_epi8(b0, zero));
+                __m128i sum45 = _mm_add_epi16(_mm_unpacklo_epi8(a1, zero),
+                        _mm_unpacklo_epi8(b1, zero));
+                __m128i sum67 = _mm_add_epi16(_mm_unpackhi_epi8(a1, zero),
+                        _mm_unpackhi_epi8(b1, zero));
+
+                // then the neighbors
+                __m128i low = _mm_add_epi16(_mm_unpacklo_epi64(sum01, sum23),
+                        _mm_unpackhi_epi64(sum01, sum23));
+                __m128i high = _mm_add_epi16(_mm_unpacklo_epi64(sum45, sum67),
+                        _mm_unpackhi_epi64(sum45, sum67));
+
+                low = _mm_srli_epi16(_mm_add_epi16(low, two), 2);
+                high = _mm_srli_epi16(_mm_add_epi16(high, two), 2);
+                _mm_storeu_si128((__m128i *)(d + x*BYTES_PER_TEXEL),
+                        _mm_packus_epi16(low, high));
+            }
+        }
+#endif
+
+        for (; x < dst_size_x; x++) {
+            int x0 = 2*x;
+            int x1 = 2*x + 1 < src_size_x ? 2*x + 1 : 2*x;
+
+            for (int i = 0; i < BYTES_PER_TEXEL; i++) {
+                d[x*BYTES_PER_TEXEL + i] = (unsigned char)
+                    ((row0[x0*BYTES_PER_TEXEL + i] +
+                      row0[x1*BYTES_PER_TEXEL + i] +
+                      row1[x0*BYTES_PER_TEXEL + i] +
+                      row1[x1*BYTES_PER_TEXEL + i] + 2) >> 2);
+            }
+        }
+    }
+}
+
+void make_mipmaps(unsigned char *tile, int size_x, int size_y)
+{
+    int levels = get_mipmap_level_count(size_x, size_y);
+
+    for (int level = 1; level < levels; level++) {
+        int src_size_x, src_size_y;
+        int dst_size_x, dst_size_y;
+        unsigned char *src = get_mipmap_level(tile, size_x, size_y,
+                level - 1, &src_size_x, &src_size_y);
+        unsigned char *dst = get_mipmap_level(tile, size_x, size_y,
+                level, &dst_size_x, &dst_size_y);
+
+        reduce_mipmap_level(src, src_size_x, src_size_y,
+                dst, dst_size_x, dst_size_y);
+    }
+}
+
+/*
+ * Texel formats.  The tiles are always scaled and mipmapped as 8-bit
+ * RGBA, and then turned into what the card wants.  Every level gets
+ * smaller, so it's done in place with each level at the front of the
+ * tile data, the levels packed one after the other.
+ */
+
+#define DXT1_BLOCK_BYTES    8
+
+int get_texel_format_level_bytes(int format, int size_x, int size_y)
+{
+    switch (format) {
+        case TEXEL_FORMAT_A1R5G5B5:
+        case TEXEL_FORMAT_R5G6B5:
+            return size_x*size_y*2;
+
+        case TEXEL_FORMAT_DXT1:
+            return ((size_x + 3)/4)*((size_y + 3)/4)*DXT1_BLOCK_BYTES;
+
+        default:
+            return size_x*size_y*BYTES_PER_TEXEL;
+    }
+}
+
+int get_texel_format_row_height(int format)
+{
+    return format == TEXEL_FORMAT_DXT1 ? 4 : 1;
+}
+
+int get_texel_format_mipmap_bytes(int format, int size_x, int size_y,
+        int levels)
+{
+    int bytes = 0;
+
+    for (int level = 0; level < levels; level++) {
+        bytes += get_texel_format_level_bytes(format, size_x, size_y);
+        size_x = size_x > 1 ? size_x/2 : 1;
+        size_y = size_y > 1 ? size_y/2 : 1;
+    }
+
+    return bytes;
+}
+
+unsigned char *get_texel_format_level(int format, unsigned char *tile,
+        int size_x, int size_y, int level,
+        int *level_size_x, int *level_size_y)
+{
+    for (int i = 0; i < level; i++) {
+        tile += get_texel_format_level_bytes(format, size_x, size_y);
+        size_x = size_x > 1 ? size_x/2 : 1;
+        size_y = size_y > 1 ? size_y/2 : 1;
+    }
+
+    *level_size_x = size_x;
+    *level_size_y = size_y;
+
+    return tile;
+}
+
+/*
+ * 16-bit texels.  An ordered dither spreads the error of the 5-bit (and
+ * 6-bit) channels over a 4x4 pattern so that skies don't band.  The
+ * dither adds half a step on average, so it rounds rather than truncates,
+ * and each channel is first scaled by 31/32 (or 63/64) so that 255 ends
+ * up as 31 the way 248 would, rather than everything coming out bright.
+ */
+
+static const unsigned char bayer[4][4] = {
+    {  0,  8,  2, 10 },
+    { 12,  4, 14,  6 },
+    {  3, 11,  1,  9 },
+    { 15,  7, 13,  5 },
+};
+
+// what to add to each byte of four texels in row "y" before dropping
+// the low bits, and how many bits each byte keeps
+static void
+make_dither_row(int format, int y, unsigned char *dither,
+        unsigned char *bits)
+{
+    int green_bits = format == TEXEL_FORMAT_R5G6B5 ? 6 : 5;
+
+    for (int x = 0; x < 4; x++) {
+        unsigned char *d = dither + x*BYTES_PER_TEXEL;
+        unsigned char *b = bits + x*BYTES_PER_TEXEL;
+        int value = bayer[y & 3][x];
+
+        d[DST_RED] = (unsigned char)(value >> 1);
+        d[DST_GRN] = (unsigned char)(value >> (green_bits - 4));
+        d[DST_BLU] = (unsigned char)(value >> 1);
+        d[DST_ALP] = 0;
+
+        b[DST_RED] = 5;
+        b[DST_GRN] = (unsigned char)green_bits;
+        b[DST_BLU] = 5;
+        b[DST_ALP] = 0;
+    }
+}
+
+// "value" scaled by 31/32 or 63/64, dithered and cut down to "bits" bits
+static inline int
+dither_channel(int value, int dither, int bits)
+{
+    value = value - (value >> bits) + dither;
+
+    return (value < 255 ? value : 255) >> (8 - bits);
+}
+
+static void
+pack_16bit_level(int format, unsigned char *src, int size_x, int size_y,
+        unsigned short *dst)
+{
+    bool r5g6b5 = format == TEXEL_FORMAT_R5G6B5;
+    int green_bits = r5g6b5 ? 6 : 5;
+
+    // a texel is always read before it's written over, so "dst" can be
+    // "src"
+    for (int y = 0; y < size_y; y++) {
+        unsigned char dither[4*BYTES_PER_TEXEL];
+        unsigned char bits[4*BYTES_PER_TEXEL];
+        unsigned char *s = src + y*size_x*BYTES_PER_TEXEL;
+        unsigned short *d = dst + y*size_x;
+        int x = 0;
+
+        make_dither_row(format, y, dither, bits);
+
+#if USE_SSE2
+        if (has_sse2()) {
+            __m128i dither_row = _mm_loadu_si128((__m128i *)dither);
+            __m128i bits_row = _mm_loadu_si128((__m128i *)bits);
+            __m128i five_bits = _mm_cmpeq_epi8(bits_row, _mm_set1_epi8(5));
+            __m128i six_bits = _mm_cmpeq_epi8(bits_row, _mm_set1_epi8(6));
+            __m128i red_shift = _mm_cvtsi32_si128(DST_RED*8 + 3);
+            __m128i grn_shift = _mm_cvtsi32_si128(DST_GRN*8 + 8 -
+                    green_bits);
+            __m128i blu_shift = _mm_cvtsi32_si128(DST_BLU*8 + 3);
+            __m128i alp_shift = _mm_cvtsi32_si128(DST_ALP*8 + 7);
+            __m128i red_place = _mm_cvtsi32_si128(r5g6b5 ? 11 : 10);
+            __m128i red_mask = _mm_set1_epi32(31);
+            __m128i grn_mask = _mm_set1_epi32((1 << green_bits) - 1);
+            __m128i blu_mask = _mm_set1_epi32(31);
+            __m128i alp_mask = _mm_set1_epi32(r5g6b5 ? 0 : 1);
+
+            // eight texels, four in each half
+            for (; x + 8 <= size_x; x += 8) {
+                __m128i half[2];
+
+                for (int i = 0; i < 2; i++) {
+                    __m128i texels = _mm_loadu_si128((__m128i *)
+                            (s + (x + i*4)*BYTES_PER_TEXEL));
+
+                    // there's no byte shift, so shift words and mask
+                    // off what came down from the next byte
+                    __m128i scale = _mm_or_si128(
+                            _mm_and_si128(five_bits, _mm_and_si128(
+                                    _mm_srli_epi16(texels, 5),
+                                    _mm_set1_epi8(7))),
+                            _mm_and_si128(six_bits, _mm_and_si128(
+                                    _mm_srli_epi16(texels, 6),
+                                    _mm_set1_epi8(3))));
+
+                    texels = _mm_adds_epu8(dither_row,
+                            _mm_sub_epi8(texels, scale));
+                    __m128i red = _mm_and_si128(red_mask,
+                            _mm_srl_epi32(texels, red_shift));
+                    __m128i grn = _mm_and_si128(grn_mask,
+                            _mm_srl_epi32(texels, grn_shift));
+                    __m128i blu = _mm_and_si128(blu_mask,
+                            _mm_srl_epi32(texels, blu_shift));
+                    __m128i alp = _mm_and_si128(alp_mask,
+                            _mm_srl_epi32(texels, alp_shift));
+                    __m128i texel = _mm_or_si128(
+                            _mm_or_si128(_mm_sll_epi32(red, red_place),
+                                _mm_slli_epi32(grn, 5)),
+                            _mm_or_si128(blu, _mm_slli_epi32(alp, 15)));
+
+                    // sign-extended so that _mm_packs_epi32() doesn't
+                    // saturate the alpha bit
+                    half[i] = _mm_srai_epi32(_mm_slli_epi32(texel, 16), 16);
+                }
+
+                _mm_storeu_si128((__m128i *)(d + x),
+                        _mm_packs_epi32(half[0], half[1]));
+            }
+        }
+#endif
+
+        for (; x < size_x; x++) {
+            unsigned char *texel = s + x*BYTES_PER_TEXEL;
+            unsigned char *t = dither + (x & 3)*BYTES_PER_TEXEL;
+            int red = dither_channel(texel[DST_RED], t[DST_RED], 5);
+            int grn = dither_channel(texel[DST_GRN], t[DST_GRN],
+                    green_bits);
+            int blu = dither_channel(texel[DST_BLU], t[DST_BLU], 5);
+
+            if (r5g6b5) {
+                d[x] = (unsigned short)((red << 11) | (grn << 5) | blu);
+            } else {
+                d[x] = (unsigned short)(
+                        (texel[DST_ALP] >= 128 ? 0x8000 : 0) |
+                        (red << 10) | (grn << 5) | blu);
+            }
+        }
+    }
+}
+
+/*
+ * DXT1 compression.  Each 4x4 block of texels becomes two 5:6:5 colors
+ * and a two-bit index per texel, eight bytes in all.  The two colors are
+ * the corners of the block's bounding box pulled in a little, and each
+ * texel picks the nearest of the four colors on the line between them.
+ * Blocks with transparent texels, which are only along the picture's
+ * border, use the three-color mode where index 3 is transparent.
+ */
+
+// rounds to the nearest 5:6:5 color rather than truncating, which would
+// make everything a little darker
+static inline int
+pack_565(unsigned char *texel)
+{
+    return (((texel[DST_RED]*31 + 127)/255) << 11) |
+        (((texel[DST_GRN]*63 + 127)/255) << 5) |
+        ((texel[DST_BLU]*31 + 127)/255);
+}
+
+// the texel that the card makes of a 5:6:5 color, with no alpha so that
+// it doesn't count in the distances
+static inline void
+unpack_565(int color, unsigned char *texel)
+{
+    int red = (color >> 11) & 31;
+    int grn = (color >> 5) & 63;
+    int blu = color & 31;
+
+    texel[DST_RED] = (unsigned char)((red << 3) | (red >> 2));
+    texel[DST_GRN] = (unsigned char)((grn << 2) | (grn >> 4));
+    texel[DST_BLU] = (unsigned char)((blu << 3) | (blu >> 2));
+    texel[DST_ALP] = 0;
+}
+
+// copies the 4x4 block at "block_x", "block_y" out of a level, repeating
+// the last row and column for levels smaller than a block
+static void
+get_dxt1_block(unsigned char *src, int size_x, int size_y,
+        int block_x, int block_y, unsigned char *block)
+{
+    for (int y = 0; y < 4; y++) {
+        int src_y = block_y*4 + y < size_y ? block_y*4 + y : size_y - 1;
+        unsigned char *row = src + src_y*size_x*BYTES_PER_TEXEL;
+
+        if (block_x*4 + 4 <= size_x) {
+            memcpy(block + y*4*BYTES_PER_TEXEL,
+                    row + block_x*4*BYTES_PER_TEXEL, 4*BYTES_PER_TEXEL);
+        } else {
+            for (int x = 0; x < 4; x++) {
+                int src_x = block_x*4 + x < size_x ?
+                    block_x*4 + x : size_x - 1;
+
+                memcpy(block + (y*4 + x)*BYTES_PER_TEXEL,
+                        row + src_x*BYTES_PER_TEXEL, BYTES_PER_TEXEL);
+            }
+        }
+    }
+}
+
+static void
+compress_dxt1_block(unsigned char *block, unsigned char *dst)
+{
+    unsigned char low[BYTES_PER_TEXEL];
+    unsigned char high[BYTES_PER_TEXEL];
+    unsigned char palette[4][BYTES_PER_TEXEL];
+    unsigned int indices = 0;
+    bool transparent = false;
+    int i, c;
+
+    for (i = 0; i < 16; i++) {
+        if (block[i*BYTES_PER_TEXEL + DST_ALP] < 128) {
+            transparent = true;
+        }
+    }
+
+    // the bounding box of the colors
+#if USE_SSE2
+    if (has_sse2()) {
+        __m128i row0 = _mm_loadu_si128((__m128i *)block);
+        __m128i row1 = _mm_loadu_si128((__m128i *)(block + 16));
+        __m128i row2 = _mm_loadu_si128((__m128i *)(block + 32));
+        __m128i row3 = _mm_loadu_si128((__m128i *)(block + 48));
+        __m128i minimum = _mm_min_epu8(_mm_min_epu8(row0, row1),
+                _mm_min_epu8(row2, row3));
+        __m128i maximum = _mm_max_epu8(_mm_max_epu8(row0, row1),
+                _mm_max_epu8(row2, row3));
+
+        minimum = _mm_min_epu8(minimum, _mm_srli_si128(minimum, 8));
+        minimum = _mm_min_epu8(minimum, _mm_srli_si128(minimum, 4));
+        maximum = _mm_max_epu8(maximum, _mm_srli_si128(maximum, 8));
+        maximum = _mm_max_epu8(maximum, _mm_srli_si128(maximum, 4));
+
+        *(int *)low = _mm_cvtsi128_si32(minimum);
+        *(int *)high = _mm_cvtsi128_si32(maximum);
+    } else
+#endif
+    {
+        memcpy(low, block, BYTES_PER_TEXEL);
+        memcpy(high, block, BYTES_PER_TEXEL);
+        for (i = 1; i < 16; i++) {
+            for (c = 0; c < BYTES_PER_TEXEL; c++) {
+                unsigned char value = block[i*BYTES_PER_TEXEL + c];
+
+                if (value < low[c]) {
+                    low[c] = value;
+                }
+                if (value > high[c]) {
+                    high[c] = value;
+                }
+            }
+        }
+    }
+
+    // pulling the corners in by a sixteenth keeps a few outlying texels
+    // from spreading the colors too far apart
+    for (c = 0; c < BYTES_PER_TEXEL; c++) {
+        int inset = (high[c] - low[c]) >> 4;
 
-enum Direction {
-    DIRECTION_HORIZONTAL,
-    DIRECTION_VERTICAL
-};
+        low[c] = (unsigned char)(low[c] + inset);
+        high[c] = (unsigned char)(high[c] - inset);
+    }
 
-struct CONTRIB {
-    int pixel;
-    double weight;
-};
+    int color0 = pack_565(high);
+    int color1 = pack_565(low);
+    int colors;
 
-struct CLIST {
-    int n;          /* number of contributors */
-    CONTRIB *p;     /* pointer to list of contributions */
-};
+    if (transparent) {
+        // color0 <= color1 picks the three-color mode
+        if (color0 > color1) {
+            int t = color0;
+            color0 = color1;
+            color1 = t;
+        }
+        colors = 3;
+    } else {
+        // color0 > color1 picks the four-color mode.  if they're the
+        // same, every texel is color0 in either mode.
+        colors = color0 == color1 ? 1 : 4;
+    }
 
-static inline double
-sinc(double x)
-{
-    x *= M_PI;
-    if (x != 0) {
-        return sin(x)/x;
+    unpack_565(color0, palette[0]);
+    unpack_565(color1, palette[1]);
+    for (c = 0; c < BYTES_PER_TEXEL; c++) {
+        if (colors == 3) {
+            palette[2][c] = (unsigned char)
+                ((palette[0][c] + palette[1][c])/2);
+        } else {
+            palette[2][c] = (unsigned char)
+                ((2*palette[0][c] + palette[1][c])/3);
+            palette[3][c] = (unsigned char)
+                ((palette[0][c] + 2*palette[1][c])/3);
+        }
     }
 
-    return 1;
-}
+    // the nearest color to each texel, the lowest index on a tie
+#if USE_SSE2
+    if (has_sse2() && colors == 4) {
+        __m128i zero = _mm_setzero_si128();
+        __m128i no_alpha = _mm_set1_epi32(~(0xff << (DST_ALP*8)));
+        __m128i color[4];
+
+        // each color next to zeros, the way the texels are below, so
+        // that _mm_sad_epu8() gives a distance per texel
+        for (c = 0; c < 4; c++) {
+            color[c] = _mm_set_epi32(0, *(int *)palette[c],
+                    0, *(int *)palette[c]);
+        }
 
-#define Lanczos3_support    3
+        for (int y = 3; y >= 0; y--) {
+            __m128i row = _mm_and_si128(no_alpha,
+                    _mm_loadu_si128((__m128i *)(block + y*16)));
+            __m128i texels01 = _mm_unpacklo_epi32(row, zero);
+            __m128i texels23 = _mm_unpackhi_epi32(row, zero);
+            __m128i best = zero;
+            __m128i index = zero;
+
+            // the four texels' distances end up in 16-bit words 0, 2,
+            // 4 and 6
+            for (c = 0; c < 4; c++) {
+                __m128i distance = _mm_packs_epi32(
+                        _mm_sad_epu8(texels01, color[c]),
+                        _mm_sad_epu8(texels23, color[c]));
+
+                if (c == 0) {
+                    best = distance;
+                } else {
+                    __m128i closer = _mm_cmplt_epi16(distance, best);
+
+                    best = _mm_min_epi16(best, distance);
+                    index = _mm_or_si128(_mm_andnot_si128(closer, index),
+                            _mm_and_si128(closer, _mm_set1_epi16(
+                                    (short)c)));
+                }
+            }
 
-static inline double
-Lanczos3_filter(double t)
-{
-    if (t < 0) {
-        t = -t;
-    }
+            indices = (indices << 8) |
+                (_mm_extract_epi16(index, 6) << 6) |
+                (_mm_extract_epi16(index, 4) << 4) |
+                (_mm_extract_epi16(index, 2) << 2) |
+                _mm_extract_epi16(index, 0);
+        }
+    } else
+#endif
+    {
+        for (i = 15; i >= 0; i--) {
+            unsigned char *texel = block + i*BYTES_PER_TEXEL;
+            int index = 0;
+
+            if (colors == 3 && texel[DST_ALP] < 128) {
+                index = 3;
+            } else {
+                int best = -1;
+
+                for (c = 0; c < colors; c++) {
+                    int distance =
+                        abs(texel[DST_RED] - palette[c][DST_RED]) +
+                        abs(texel[DST_GRN] - palette[c][DST_GRN]) +
+                        abs(texel[DST_BLU] - palette[c][DST_BLU]);
+
+                    if (best == -1 || distance < best) {
+                        best = distance;
+                        index = c;
+                    }
+                }
+            }
 
-    if (t < 3) {
-        return sinc(t)*sinc(t/3);
+            indices = (indices << 2) | index;
+        }
     }
 
-    return 0;
+    // little-endian, texel 0 in the low bits
+    dst[0] = (unsigned char)color0;
+    dst[1] = (unsigned char)(color0 >> 8);
+    dst[2] = (unsigned char)color1;
+    dst[3] = (unsigned char)(color1 >> 8);
+    dst[4] = (unsigned char)indices;
+    dst[5] = (unsigned char)(indices >> 8);
+    dst[6] = (unsigned char)(indices >> 16);
+    dst[7] = (unsigned char)(indices >> 24);
 }
 
-static CLIST *
-get_contrib_buffer(int length, int contrib_width, Direction direction)
+void compress_dxt1(unsigned char *src, int size_x, int size_y,
+        unsigned char *dst)
 {
-    /*
-       keep Direction in cache because we'll want one of these for
-       horizontal and one for vertical at the same time and we don't
-       want them to clobber each other.
-    */
-    struct CONTRIB_BUFFER_CACHE {
-        int length;
-        int contrib_width;
-        Direction direction;
-        CLIST *m_clist;
-        CONTRIB_BUFFER_CACHE *next;
-    };
-    static CONTRIB_BUFFER_CACHE *head = NULL;
-    static int cache_size = 0;
-
-    // check if we have a buffer of the right size
-    for (CONTRIB_BUFFER_CACHE *p = head; p != NULL; p = p->next) {
-        if (p->length == length && p->contrib_width == contrib_width &&
-                p->direction == direction) {
-
-            return p->m_clist;
-        }
-    }
-
-    // no, make one
-    CLIST *clist = (CLIST *)jessu_malloc(THREAD_WORKER, length*sizeof(CLIST),
-            "scale clist");
-
-    for (int i = 0; i < length; i++) {
-        clist[i].n = 0;
-        clist[i].p = (CONTRIB *)jessu_calloc(THREAD_WORKER,
-                contrib_width, sizeof(CONTRIB), "scale contrib");
+    unsigned char block[16*BYTES_PER_TEXEL];
+    int blocks_x = (size_x + 3)/4;
+    int blocks_y = (size_y + 3)/4;
+
+    // a block is read before it's written and never written past where
+    // the next one starts, so "dst" can be "src"
+    for (int block_y = 0; block_y < blocks_y; block_y++) {
+        for (int block_x = 0; block_x < blocks_x; block_x++) {
+            get_dxt1_block(src, size_x, size_y, block_x, block_y, block);
+            compress_dxt1_block(block, dst);
+            dst += DXT1_BLOCK_BYTES;
+        }
     }
+}
 
-    // insert new array into linked list
-    p = new CONTRIB_BUFFER_CACHE;
-    p->length = length;
-    p->contrib_width = contrib_width;
-    p->direction = direction;
-    p->m_clist = clist;
-    p->next = head;
-    head = p;
-
-    cache_size++;
-    jessu_printf(THREAD_WORKER, "Growing contrib buffer cache to %d %s",
-            cache_size, cache_size == 1 ? "entry" : "entries");
+void decompress_dxt1(unsigned char *src, int size_x, int size_y,
+        unsigned char *dst)
+{
+    int blocks_x = (size_x + 3)/4;
+    int blocks_y = (size_y + 3)/4;
+
+    for (int block_y = 0; block_y < blocks_y; block_y++) {
+        for (int block_x = 0; block_x < blocks_x; block_x++) {
+            unsigned char palette[4][BYTES_PER_TEXEL];
+            int color0 = src[0] | (src[1] << 8);
+            int color1 = src[2] | (src[3] << 8);
+            unsigned int indices = src[4] | (src[5] << 8) |
+                (src[6] << 16) | ((unsigned int)src[7] << 24);
+            int c;
+
+            unpack_565(color0, palette[0]);
+            unpack_565(color1, palette[1]);
+            for (c = 0; c < BYTES_PER_TEXEL; c++) {
+                if (color0 > color1) {
+                    palette[2][c] = (unsigned char)
+                        ((2*palette[0][c] + palette[1][c])/3);
+                    palette[3][c] = (unsigned char)
+                        ((palette[0][c] + 2*palette[1][c])/3);
+                } else {
+                    palette[2][c] = (unsigned char)
+                        ((palette[0][c] + palette[1][c])/2);
+                    palette[3][c] = 0;
+                }
+            }
+            palette[0][DST_ALP] = 255;
+            palette[1][DST_ALP] = 255;
+            palette[2][DST_ALP] = 255;
+            palette[3][DST_ALP] = color0 > color1 ? 255 : 0;
+
+            for (int y = 0; y < 4; y++) {
+                for (int x = 0; x < 4; x++) {
+                    int index = (indices >> (2*(y*4 + x))) & 3;
+
+                    if (block_x*4 + x < size_x && block_y*4 + y < size_y) {
+                        memcpy(dst + ((block_y*4 + y)*size_x +
+                                    block_x*4 + x)*BYTES_PER_TEXEL,
+                                palette[index], BYTES_PER_TEXEL);
+                    }
+                }
+            }
 
-    return clist;
+            src += DXT1_BLOCK_BYTES;
+        }
+    }
 }
 
-static CLIST *
-make_contrib_table(int src_size, int dst_size, int tile_size,
-        Direction direction)
+void convert_texel_format(int format, unsigned char *tile,
+        int size_x, int size_y, int levels)
 {
-    CLIST *contrib;
-    int i, j, pixel;
-    int left, right;
-    int contrib_width;
-    double scale;
-    double width, fscale, weight;
-    double center;
-    double fwidth;
-
-    fwidth = Lanczos3_support;
+    for (int level = 0; level < levels; level++) {
+        int level_size_x, level_size_y;
+        unsigned char *src = get_mipmap_level(tile, size_x, size_y,
+                level, &level_size_x, &level_size_y);
+        unsigned char *dst = get_texel_format_level(format, tile,
+                size_x, size_y, level, &level_size_x, &level_size_y);
+
+        switch (format) {
+            case TEXEL_FORMAT_A1R5G5B5:
+            case TEXEL_FORMAT_R5G6B5:
+                pack_16bit_level(format, src, level_size_x, level_size_y,
+                        (unsigned short *)dst);
+                break;
 
-    // the effective destination size takes into account the fact that
-    // each tile is shrunk by TILE_SHRINK on each edge, reducing the
-    // number of usable pixels.  TILE_SHRINK should be some multiple
-    // of 0.5.
-    int num_tiles = dst_size / tile_size;
-    int effective_tile_size = (int)(tile_size - TILE_SHRINK*2);
-    int effective_dst_size = num_tiles * effective_tile_size;
+            case TEXEL_FORMAT_DXT1:
+                compress_dxt1(src, level_size_x, level_size_y, dst);
+                break;
+        }
+    }
+}
 
-    scale = (double)effective_dst_size / src_size;
+// each thread's source row in linear light, with padding
+static __declspec(thread) unsigned short *linear_row_data = NULL;
+static __declspec(thread) int linear_row_size;
 
-    if (scale < 1.0) {
-        // making image smaller
-        width = fwidth / scale;
-        contrib_width = (int)(width*2 + 1);
+static unsigned short *
+get_linear_row(int pixels)
+{
+    int size = pixels*LINEAR_BYTES_PER_PIXEL;
+
+    if (linear_row_data == NULL) {
+        linear_row_data = (unsigned short *)jessu_malloc(THREAD_WORKER,
+                size, "linear row buffer");
+        linear_row_size = size;
+    } else if (size > linear_row_size) {
+        linear_row_data = (unsigned short *)jessu_realloc(THREAD_WORKER,
+                linear_row_data, size, "linear row buffer");
+        linear_row_size = size;
+    }
 
-        contrib = get_contrib_buffer(dst_size, contrib_width, direction);
+    return linear_row_data;
+}
 
-        fscale = 1.0 / scale;
-        for (i = 0; i < dst_size; i++) {
-            int tile_number = i / tile_size;
-            int tile_offset = i % tile_size;
+void free_linear_row()
+{
+    if (linear_row_data != NULL) {
+        jessu_free(THREAD_WORKER, linear_row_data, "linear row buffer");
+        linear_row_data = NULL;
+        linear_row_size = 0;
+    }
+}
 
-            // spread out "i" to account for tile shrink
-            double effective_offset = tile_offset - TILE_SHRINK;
-            double effective_i = tile_number*effective_tile_size +
-                effective_offset;
+static inline unsigned short
+clamp_linear(int value)
+{
+    value >>= WEIGHT_BITS;
 
-            center = effective_i / scale;
-#if PRINT_CONTRIB_ARRAY
-            jessu_printf(THREAD_WORKER, "scale=%g, i=%d, tile=%d, offset=%d, "
-                    "eoffset=%g, ei=%g, center=%g",
-                    scale, i, tile_number, tile_offset, effective_offset,
-                    effective_i, center);
-#endif
+    if (value < 0) {
+        return 0;
+    }
+    if (value > LINEAR_MAXIMUM) {
+        return LINEAR_MAXIMUM;
+    }
 
-            int n = 0;
-
-            left = (int)ceil(center - width);
-            right = (int)floor(center + width);
-            for (j = left; j <= right && n < contrib_width; j++) {
-                weight = Lanczos3_filter((center - (double)j)/fscale)/fscale;
-                if (weight != 0) {
-                    pixel = j;
-
-                    // loop in case it bounces more than once
-                    for (;;) {
-                        if (pixel < 0) {
-                            pixel = -pixel;
-                        } else if (pixel >= src_size) {
-                            pixel = (src_size - pixel) + src_size - 1;
-                        } else {
-                            break;
-                        }
-                    }
+    return (unsigned short)value;
+}
 
-                    contrib[i].p[n].pixel = pixel;
-                    contrib[i].p[n].weight = weight;
-                    n++;
-                }
-            }
+// the "weights" argument of _mm_madd_epi16() for a pair of taps
+static inline int
+weight_pair(short *weight)
+{
+    return (int)((unsigned short)weight[0] |
+            ((unsigned int)(unsigned short)weight[1] << 16));
+}
 
-            contrib[i].n = n;
+// same as box_reduce_row() but in linear light
+static void
+box_reduce_linear_row(unsigned short *row, int size, int box)
+{
+    unsigned short *src = row;
+    unsigned short *dst = row;
+
+    for (int x = 0; x < size; x += box) {
+        int n = size - x < box ? size - x : box;
+        int red = 0;
+        int grn = 0;
+        int blu = 0;
+
+        for (int j = 0; j < n; j++) {
+            red += src[0];
+            grn += src[1];
+            blu += src[2];
+            src += LINEAR_COMPONENTS;
         }
-    } else {
-        contrib_width = (int)(fwidth*2 + 1);
 
-        contrib = get_contrib_buffer(dst_size, contrib_width, direction);
+        dst[0] = (unsigned short)((red + n/2)/n);
+        dst[1] = (unsigned short)((grn + n/2)/n);
+        dst[2] = (unsigned short)((blu + n/2)/n);
+        dst[3] = 0;
+        dst += LINEAR_COMPONENTS;
+    }
+}
 
-        // making image larger
-        for (i = 0; i < dst_size; i++) {
-            int tile_number = i / tile_size;
-            int tile_offset = i % tile_size;
+// turns the sRGB source row into linear light and scales it to a row of
+// linear RGBX
+static void
+scale_row_linear(CLIST *clist, unsigned char *src, unsigned short *dst,
+        int dst_size)
+{
+    int src_size = clist->src_size;
+    int taps = clist->taps;
+    int padding = clist->padding;
+    short *weight = clist->fixed_weight;
+    unsigned short *row;
+    int i, j;
+
+    row = get_linear_row(clist->box_src_size + padding*2) +
+        padding*LINEAR_COMPONENTS;
+
+    for (i = 0; i < clist->box_src_size; i++) {
+        unsigned short *d = &row[i*LINEAR_COMPONENTS];
+
+        d[0] = srgb_to_linear[src[0]];
+        d[1] = srgb_to_linear[src[1]];
+        d[2] = srgb_to_linear[src[2]];
+        d[3] = 0;
+        src += BYTES_PER_PIXEL;
+    }
 
-            // spread out "i" to account for tile shrink
-            double effective_offset = tile_offset - TILE_SHRINK;
-            double effective_i = tile_number*effective_tile_size +
-                effective_offset;
+    if (clist->box > 1) {
+        box_reduce_linear_row(row, clist->box_src_size, clist->box);
+    }
 
-            center = effective_i / scale;
-#if PRINT_CONTRIB_ARRAY
-            jessu_printf(THREAD_WORKER, "scale=%g, i=%d, tile=%d, offset=%d, "
-                    "eoffset=%g, ei=%g, center=%g",
-                    scale, i, tile_number, tile_offset, effective_offset,
-                    effective_i, center);
-#endif
+    // reflect the ends into the padding
+    for (i = 1; i <= padding; i++) {
+        memcpy(&row[-i*LINEAR_COMPONENTS],
+                &row[reflect_pixel(-i, src_size)*LINEAR_COMPONENTS],
+                LINEAR_BYTES_PER_PIXEL);
+        memcpy(&row[(src_size - 1 + i)*LINEAR_COMPONENTS],
+                &row[reflect_pixel(src_size - 1 + i, src_size)*
+                LINEAR_COMPONENTS], LINEAR_BYTES_PER_PIXEL);
+    }
 
-            int n = 0;
-
-            left = (int)ceil(center - fwidth);
-            right = (int)floor(center + fwidth);
-
-            for (j = left; j <= right && n < contrib_width; j++) {
-                weight = Lanczos3_filter(center - (double)j);
-                if (weight != 0) {
-                    pixel = j;
-
-                    // loop in case it bounces more than once
-                    for (;;) {
-                        if (pixel < 0) {
-                            pixel = -pixel;
-                        } else if (pixel >= src_size) {
-                            pixel = (src_size - pixel) + src_size - 1;
-                        } else {
-                            break;
-                        }
-                    }
+#if USE_SSE2
+    if (has_sse2()) {
+        __m128i zero = _mm_setzero_si128();
+        __m128i round = _mm_set1_epi32(1 << (WEIGHT_BITS - 1));
 
-                    contrib[i].p[n].pixel = pixel;
-                    contrib[i].p[n].weight = weight;
-                    n++;
-                }
+        for (i = 0; i < dst_size; i++) {
+            unsigned short *s = &row[clist->start[i]*LINEAR_COMPONENTS];
+            __m128i sum = round;
+
+            // two neighboring pixels at a time, their components
+            // interleaved so that each pair gets the two weights
+            for (j = 0; j < taps; j += 2) {
+                __m128i pixels = _mm_loadu_si128((__m128i *)s);
+                __m128i pairs = _mm_unpacklo_epi16(pixels,
+                        _mm_srli_si128(pixels, 8));
+
+                sum = _mm_add_epi32(sum, _mm_madd_epi16(pairs,
+                            _mm_set1_epi32(weight_pair(&weight[j]))));
+                s += 2*LINEAR_COMPONENTS;
             }
 
-            contrib[i].n = n;
+            sum = _mm_srai_epi32(sum, WEIGHT_BITS);
+            sum = _mm_max_epi16(_mm_packs_epi32(sum, sum), zero);
+            _mm_storel_epi64((__m128i *)dst, sum);
+
+            dst += LINEAR_COMPONENTS;
+            weight += taps;
         }
+
+        return;
     }
+#endif
 
-    return contrib;
-}
+    for (i = 0; i < dst_size; i++) {
+        unsigned short *s = &row[clist->start[i]*LINEAR_COMPONENTS];
+        int red = 1 << (WEIGHT_BITS - 1);
+        int grn = red;
+        int blu = red;
 
-inline unsigned char clamp_color(double color)
-{
-    int j = (int)color;
+        for (j = 0; j < taps; j++) {
+            red += s[0]*weight[j];
+            grn += s[1]*weight[j];
+            blu += s[2]*weight[j];
 
-    if (j < 0) {
-        j = 0;
-    }
-    if (j > 255) {
-        j = 255;
-    }
+            s += LINEAR_COMPONENTS;
+        }
 
-    return (unsigned char)j;
+        dst[0] = clamp_linear(red);
+        dst[1] = clamp_linear(grn);
+        dst[2] = clamp_linear(blu);
+        dst[3] = 0;
+        dst += LINEAR_COMPONENTS;
+
+        weight += taps;
+    }
 }
 
-CLIST *get_scale_row_data(int src_size, int dst_size, int tile_size)
+// averages every "box" pixels into one, in place
+static void
+box_reduce_row(unsigned char *row, int size, int box)
 {
-    /* OKAY so here we return a pointer to an array, and that array is passed
-       into the scale_row() function, but we've got no guarantee that someone
-       else won't call "make_contrib_table()" with similar enough parameters
-       to reuse the array but different enough to get different coefficients.
-       In the current program this won't happen because only the worker
-       thread does scaling and it's either scaling or reading.  But I
-       recognize that this is potentially bad. */
+    unsigned char *src = row;
+    unsigned char *dst = row;
+
+    for (int x = 0; x < size; x += box) {
+        int n = size - x < box ? size - x : box;
+        int red = 0;
+        int grn = 0;
+        int blu = 0;
+
+        for (int j = 0; j < n; j++) {
+            red += src[0];
+            grn += src[1];
+            blu += src[2];
+            src += BYTES_PER_PIXEL;
+        }
 
-    return make_contrib_table(src_size, dst_size, tile_size,
-            DIRECTION_HORIZONTAL);
+        dst[0] = (unsigned char)((red + n/2)/n);
+        dst[1] = (unsigned char)((grn + n/2)/n);
+        dst[2] = (unsigned char)((blu + n/2)/n);
+        dst += BYTES_PER_PIXEL;
+    }
 }
 
 void scale_row(CLIST *clist, unsigned char *src,
         unsigned char *dst, int dst_size)
 {
-    CLIST *c = &clist[0];
-    CONTRIB *p;
+    int src_size = clist->src_size;
+    int taps = clist->taps;
+    float *weight = clist->weight;
+    int i;
+
+    if (clist->linear) {
+        scale_row_linear(clist, src, (unsigned short *)dst, dst_size);
+        return;
+    }
 
-    for (int i = 0; i < dst_size; i++) {
-        double red = 0;
-        double grn = 0;
-        double blu = 0;
+    if (clist->box > 1) {
+        box_reduce_row(src, clist->box_src_size, clist->box);
+    }
 
-        p = &c->p[0];
-        for (int j = 0; j < c->n; j++) {
-            unsigned char *s = &src[p->pixel*BYTES_PER_PIXEL];
-            double weight = p->weight;
+    // reflect the ends into the padding
+    for (i = 1; i <= clist->padding; i++) {
+        unsigned char *s = &src[reflect_pixel(-i, src_size)*BYTES_PER_PIXEL];
+        unsigned char *d = &src[-i*BYTES_PER_PIXEL];
 
-            red += s[0]*weight;
-            grn += s[1]*weight;
-            blu += s[2]*weight;
+        d[0] = s[0];
+        d[1] = s[1];
+        d[2] = s[2];
+
+        s = &src[reflect_pixel(src_size - 1 + i, src_size)*BYTES_PER_PIXEL];
+        d = &src[(src_size - 1 + i)*BYTES_PER_PIXEL];
+
+        d[0] = s[0];
+        d[1] = s[1];
+        d[2] = s[2];
+    }
+
+    for (i = 0; i < dst_size; i++) {
+        unsigned char *s = &src[clist->start[i]*BYTES_PER_PIXEL];
+        float red = 0;
+        float grn = 0;
+        float blu = 0;
 
-            p++;
+        for (int j = 0; j < taps; j++) {
+            red += s[0]*weight[j];
+            grn += s[1]*weight[j];
+            blu += s[2]*weight[j];
+
+            s += BYTES_PER_PIXEL;
         }
 
         dst[0] = clamp_color(red);
@@ -327,7 +1570,7 @@ void scale_row(CLIST *clist, unsigned char *src,
         dst[2] = clamp_color(blu);
         dst += BYTES_PER_PIXEL;
 
-        c++;
+        weight += taps;
     }
 }
 
@@ -336,20 +1579,74 @@ void scale_row(CLIST *clist, unsigned char *src,
 Vertical_scaler::Vertical_scaler()
 {
     m_clist = NULL;
+    m_box_sum = NULL;
+    m_box_row = NULL;
+    m_box_allocated_size = 0;
+    m_tap_row = NULL;
+    m_tap_weight = NULL;
+    m_tap_fixed_weight = NULL;
+    m_linear_row = NULL;
+    m_linear_row_allocated_size = 0;
+    m_pixel_bytes = BYTES_PER_PIXEL;
+    m_mipmaps = false;
+    m_texel_format = TEXEL_FORMAT_A8R8G8B8;
     m_in_queue = NULL;
     m_cannot_do_rows = NULL;
     m_parameters_changed = true;
     m_cannot_do_rows_allocated_size = 0;
     m_in_queue_allocated_size = 0;
+    m_orientation = ORIENTATION_TOP_LEFT;
+    m_scale_ticks = 0;
 }
 
 Vertical_scaler::~Vertical_scaler()
 {
-    // don't free clist, it's cached elsewhere
     // don't free tile, it was allocated elsewhere
+    release_contrib_table(m_clist);
 
     delete[] m_in_queue;
     delete[] m_cannot_do_rows;
+    delete[] m_tap_row;
+    delete[] m_tap_weight;
+    delete[] m_tap_fixed_weight;
+    delete[] m_linear_row;
+    delete[] m_box_sum;
+    delete[] m_box_row;
+}
+
+void make_tile_layout(TILE_LAYOUT *layout,
+        int texture_size_x, int texture_size_y,
+        int maximum_tile_size_x, int maximum_tile_size_y)
+{
+    int tile_size_x = texture_size_x;
+    int tile_size_y = texture_size_y;
+
+    while (tile_size_x > 64 && tile_size_x > maximum_tile_size_x) {
+        tile_size_x /= 2;
+    }
+    while (tile_size_y > 64 && tile_size_y > maximum_tile_size_y) {
+        tile_size_y /= 2;
+    }
+
+    layout->texture_size_x = texture_size_x;
+    layout->texture_size_y = texture_size_y;
+    layout->tile_size_x = tile_size_x;
+    layout->tile_size_y = tile_size_y;
+    layout->tile_count_x = texture_size_x/tile_size_x;
+    layout->tile_count_y = texture_size_y/tile_size_y;
+    layout->tile_count = layout->tile_count_x*layout->tile_count_y;
+}
+
+void get_tile_position(TILE_LAYOUT *layout, int j,
+        float *x1, float *y1, float *x2, float *y2)
+{
+    int tx = j % layout->tile_count_x;
+    int ty = j / layout->tile_count_x;
+
+    *x1 = tx/(float)layout->tile_count_x;
+    *y1 = (layout->tile_count_y - 1 - ty)/(float)layout->tile_count_y;
+    *x2 = (tx + 1)/(float)layout->tile_count_x;
+    *y2 = (layout->tile_count_y - ty)/(float)layout->tile_count_y;
 }
 
 void Vertical_scaler::Set_destination_parameters(unsigned char **tile,
@@ -365,57 +1662,145 @@ void Vertical_scaler::Set_destination_parameters(unsigned char **tile,
     this->m_texture_size_x = texture_size_x;
     this->m_texture_size_y = texture_size_y;
 
+    Update_row_size();
     m_parameters_changed = true;
 }
 
-void Vertical_scaler::Set_source_parameters(int src_size_x, int src_size_y)
+void Vertical_scaler::Set_destination_parameters(unsigned char **tile,
+        TILE_LAYOUT *layout)
+{
+    Set_destination_parameters(tile,
+            layout->tile_size_x, layout->tile_size_y,
+            layout->tile_count_x, layout->tile_count_y,
+            layout->texture_size_x, layout->texture_size_y);
+}
+
+void Vertical_scaler::Set_source_parameters(int src_size_x, int src_size_y,
+        int orientation)
 {
     this->m_src_size_x = src_size_x;
     this->m_src_size_y = src_size_y;
+    this->m_orientation = orientation;
 
+    Update_row_size();
     m_parameters_changed = true;
 }
 
+void Vertical_scaler::Update_row_size()
+{
+    if (ORIENTATION_IS_TRANSPOSED(m_orientation)) {
+        m_row_size = m_texture_size_y;
+        m_row_tile_size = m_tile_size_y;
+        m_column_size = m_texture_size_x;
+        m_column_tile_size = m_tile_size_x;
+    } else {
+        m_row_size = m_texture_size_x;
+        m_row_tile_size = m_tile_size_x;
+        m_column_size = m_texture_size_y;
+        m_column_tile_size = m_tile_size_y;
+    }
+}
+
+// maps (x, y) in the stored image's frame, scaled to texture size, to the
+// texel it belongs in.  see the EXIF 2.2 spec, section 4.6.4, for what
+// each orientation means.
+void Vertical_scaler::Get_texel_position(int x, int y,
+        int *texel_x, int *texel_y)
+{
+    int last_x = m_texture_size_x - 1;
+    int last_y = m_texture_size_y - 1;
+
+    switch (m_orientation) {
+        default:
+        case ORIENTATION_TOP_LEFT:
+            *texel_x = x;
+            *texel_y = y;
+            break;
+
+        case ORIENTATION_TOP_RIGHT:
+            *texel_x = last_x - x;
+            *texel_y = y;
+            break;
+
+        case ORIENTATION_BOTTOM_RIGHT:
+            *texel_x = last_x - x;
+            *texel_y = last_y - y;
+            break;
+
+        case ORIENTATION_BOTTOM_LEFT:
+            *texel_x = x;
+            *texel_y = last_y - y;
+            break;
+
+        case ORIENTATION_LEFT_TOP:
+            *texel_x = y;
+            *texel_y = x;
+            break;
+
+        case ORIENTATION_RIGHT_TOP:
+            *texel_x = last_x - y;
+            *texel_y = x;
+            break;
+
+        case ORIENTATION_RIGHT_BOTTOM:
+            *texel_x = last_x - y;
+            *texel_y = last_y - x;
+            break;
+
+        case ORIENTATION_LEFT_BOTTOM:
+            *texel_x = y;
+            *texel_y = last_y - x;
+            break;
+    }
+}
+
 void Vertical_scaler::Setup()
 {
     if (!m_parameters_changed) {
         return;
     }
 
-    m_clist = make_contrib_table(m_src_size_y, m_texture_size_y,
-            m_tile_size_y, DIRECTION_VERTICAL);
+    release_contrib_table(m_clist);
+    m_clist = get_contrib_table(m_src_size_y, m_column_size,
+            m_column_tile_size);
     m_start_dst_y = 0;
+    m_scale_ticks = 0;
+
+    // the rows in the circular buffer, after any averaging
+    int src_size = m_clist->src_size;
 
     /* create the array that tells us which rows we can do once we
        have row y.  */
 
     // reallocate array
-    if (m_cannot_do_rows_allocated_size < m_src_size_y) {
+    if (m_cannot_do_rows_allocated_size < src_size) {
         delete[] m_cannot_do_rows;
-        m_cannot_do_rows = new int[m_src_size_y];
-        m_cannot_do_rows_allocated_size = m_src_size_y;
+        m_cannot_do_rows = new int[src_size];
+        m_cannot_do_rows_allocated_size = src_size;
     }
 
+    int i;
+    int src_y;
     int cannot_do_dst_y = 0;
-    for (int src_y = 0; src_y < m_src_size_y; src_y++) {
-        while (cannot_do_dst_y < m_texture_size_y) {
-            CLIST *c = &m_clist[cannot_do_dst_y];
-            CONTRIB *p = &c->p[0];
+    int taps = m_clist->taps;
+    for (src_y = 0; src_y < src_size; src_y++) {
+        while (cannot_do_dst_y < m_column_size) {
+            int start = m_clist->start[cannot_do_dst_y];
+            float *weight = m_clist->weight + cannot_do_dst_y*taps;
 
             // see whether we could do "cannot_do_dst_y" if we had everything
             // up to and including "src_y".
-            for (int i = 0; i < c->n; i++) {
-                int required_src_y = p->pixel;
-                if (required_src_y > src_y) {
+            for (i = 0; i < taps; i++) {
+                int required_src_y = reflect_pixel(start + i, src_size);
+                if (weight[i] != 0 && required_src_y > src_y) {
                     // accesses a row we don't have, can't do this one.
                     // (this breaks out of both loops, does not increment
                     // cannot_do_dst_y)
                     break;
                 }
-                p++;
             }
 
-            if (i < c->n) {
+            if (i < taps) {
                 break;
             }
 
@@ -430,31 +1815,23 @@ void Vertical_scaler::Setup()
     /*
      * create the in queue of source rows.  this is a circular buffer
      * where m_in_queue[y % m_in_queue_rows] has the data for row y.
+     * find the largest number of source rows that we need to keep.
+     * do this by simulating what we'll do later, since thanks to
+     * the aprons and the reflection we might go backwards.
      */
     m_in_queue_rows = 1;
-#if 0
-    // find the destination row that uses the most number of source rows.
-    // this is now insufficient because it doesn't take into account
-    // the fact that we might go backwards, thanks to TILE_SHRINK.
-    for (int y = 0; y < m_texture_size_y; y++) {
-        CLIST *c = &m_clist[y];
-        if (c->n > m_in_queue_rows) {
-            m_in_queue_rows = c->n;
-        }
-    }
-#else
-    // find the largest number of source rows that we need to keep.
-    // do this by simulating what we'll do later.
     int start_dst_y = 0;
-    for (src_y = 0; src_y < m_src_size_y; src_y++) {
+    for (src_y = 0; src_y < src_size; src_y++) {
         cannot_do_dst_y = m_cannot_do_rows[src_y];
 
         for (int dst_y = start_dst_y; dst_y < cannot_do_dst_y; dst_y++) {
-            CLIST *c = &m_clist[dst_y];
-            for (int i = 0; i < c->n; i++) {
-                int diff = src_y - c->p[i].pixel + 1;
+            int start = m_clist->start[dst_y];
+            float *weight = m_clist->weight + dst_y*taps;
+
+            for (i = 0; i < taps; i++) {
+                int diff = src_y - reflect_pixel(start + i, src_size) + 1;
 
-                if (diff > m_in_queue_rows) {
+                if (weight[i] != 0 && diff > m_in_queue_rows) {
                     m_in_queue_rows = diff;
                 }
             }
@@ -462,37 +1839,146 @@ void Vertical_scaler::Setup()
 
         start_dst_y = cannot_do_dst_y;
     }
-#endif
+
+    delete[] m_tap_row;
+    delete[] m_tap_weight;
+    delete[] m_tap_fixed_weight;
+    m_tap_row = new unsigned char *[taps];
+    m_tap_weight = new float[taps];
+    m_tap_fixed_weight = new short[taps];
+
+    // linear rows are bigger, and are scaled into "m_linear_row" before
+    // going back to sRGB
+    m_pixel_bytes = get_scale_row_pixel_bytes(m_clist);
+    if (m_clist->linear && m_linear_row_allocated_size < m_row_size) {
+        delete[] m_linear_row;
+        m_linear_row = new unsigned short[m_row_size*LINEAR_COMPONENTS];
+        m_linear_row_allocated_size = m_row_size;
+    }
 
     jessu_printf(THREAD_WORKER, "Using %d rows in circular input buffer",
             m_in_queue_rows);
-    int new_in_queue_size = m_texture_size_x*m_in_queue_rows*BYTES_PER_PIXEL;
+    int new_in_queue_size = m_row_size*m_in_queue_rows*m_pixel_bytes;
     if (m_in_queue_allocated_size < new_in_queue_size) {
         delete[] m_in_queue;
         m_in_queue = new unsigned char[new_in_queue_size];
         m_in_queue_allocated_size = new_in_queue_size;
     }
 
+    // rows are added up here until there are enough to average
+    if (m_clist->box > 1 && m_box_allocated_size < m_row_size) {
+        delete[] m_box_sum;
+        delete[] m_box_row;
+        m_box_sum = new int[m_row_size*LINEAR_COMPONENTS];
+        m_box_row = new unsigned char[m_row_size*LINEAR_BYTES_PER_PIXEL];
+        m_box_allocated_size = m_row_size;
+    }
+
     m_parameters_changed = false;
 }
 
+void Vertical_scaler::Set_mipmaps(bool mipmaps)
+{
+    m_mipmaps = mipmaps;
+}
+
+void Vertical_scaler::Set_texel_format(int format)
+{
+    m_texel_format = format;
+}
+
+void Vertical_scaler::Restart()
+{
+    Setup();
+
+    m_start_dst_y = 0;
+    m_scale_ticks = 0;
+}
+
 unsigned char *Vertical_scaler::Get_row_buffer(int src_y)
 {
     Setup();
 
+    if (m_clist->box > 1) {
+        return m_box_row;
+    }
+
     int in_queue_y = src_y % m_in_queue_rows;
 
-    return m_in_queue + in_queue_y*m_texture_size_x*BYTES_PER_PIXEL;
+    return m_in_queue + in_queue_y*m_row_size*m_pixel_bytes;
 }
 
 void Vertical_scaler::Process_row(int src_y)
 {
+    STAGE_CLOCK start = get_stage_clock();
+
     Setup();
 
+    if (m_clist->box > 1) {
+        // add the row to the block, and once it's complete put the
+        // average in the circular buffer as a row of its own
+        int box = m_clist->box;
+        int i;
+
+        if (m_clist->linear) {
+            unsigned short *in = (unsigned short *)m_box_row;
+            int size = m_row_size*LINEAR_COMPONENTS;
+
+            if (src_y % box == 0) {
+                for (i = 0; i < size; i++) {
+                    m_box_sum[i] = in[i];
+                }
+            } else {
+                for (i = 0; i < size; i++) {
+                    m_box_sum[i] += in[i];
+                }
+            }
+        } else {
+            int size = m_row_size*BYTES_PER_PIXEL;
+
+            if (src_y % box == 0) {
+                for (i = 0; i < size; i++) {
+                    m_box_sum[i] = m_box_row[i];
+                }
+            } else {
+                for (i = 0; i < size; i++) {
+                    m_box_sum[i] += m_box_row[i];
+                }
+            }
+        }
+
+        if ((src_y + 1) % box != 0 && src_y != m_src_size_y - 1) {
+            m_scale_ticks += get_stage_clock() - start;
+            return;
+        }
+
+        int n = src_y % box + 1;
+        src_y /= box;
+
+        unsigned char *row = m_in_queue +
+            (src_y % m_in_queue_rows)*m_row_size*m_pixel_bytes;
+        if (m_clist->linear) {
+            unsigned short *out = (unsigned short *)row;
+            int size = m_row_size*LINEAR_COMPONENTS;
+
+            for (i = 0; i < size; i++) {
+                out[i] = (unsigned short)((m_box_sum[i] + n/2)/n);
+            }
+        } else {
+            int size = m_row_size*BYTES_PER_PIXEL;
+
+            for (i = 0; i < size; i++) {
+                row[i] = (unsigned char)((m_box_sum[i] + n/2)/n);
+            }
+        }
+    }
+
     // assume new row is already in circular buffer
 
     // look up src_y in array to find first row that we cannot do
     int cannot_do_dst_y = m_cannot_do_rows[src_y];
+    bool last = m_start_dst_y < m_column_size &&
+        cannot_do_dst_y == m_column_size;
 
     // go from m_start_dst_y to the last row we can do
     for (int y = m_start_dst_y; y < cannot_do_dst_y; y++) {
@@ -501,52 +1987,169 @@ void Vertical_scaler::Process_row(int src_y)
 
     // set m_start_dst_y to the next row to do
     m_start_dst_y = cannot_do_dst_y;
+
+    m_scale_ticks += get_stage_clock() - start;
+
+    if (last) {
+        add_stage_ticks(STAGE_VERTICAL_SCALE, m_scale_ticks);
+        m_scale_ticks = 0;
+
+        start = get_stage_clock();
+        trace_begin("finish_image");
+        Finish_image();
+        trace_end("finish_image");
+        record_stage_time(STAGE_FINISH_IMAGE, start);
+    }
 }
 
-void Vertical_scaler::Scale_row(int dst_y)
+// scales a row in linear light into "m_linear_row"
+void Vertical_scaler::Scale_linear_row(int tap_count)
 {
-    int ty = dst_y/m_tile_size_y;
-    CLIST *c = &m_clist[dst_y];
-
-    for (int tx = 0; tx < m_tile_count_x; tx++) {
-        unsigned char *t = m_tile[ty*m_tile_count_x + tx];
-        unsigned char *dst = t +
-            (dst_y - ty*m_tile_size_y)*m_tile_size_x*BYTES_PER_TEXEL;
-
-        // this is also src_x since the rows are the same width now
-        int dst_x = tx*m_tile_size_x;
-
-        for (int x = 0; x < m_tile_size_x; x++) {
-            double red = 0;
-            double grn = 0;
-            double blu = 0;
-            CONTRIB *p = &c->p[0];
-
-            for (int j = 0; j < c->n; j++) {
-                int in_row = p->pixel % m_in_queue_rows;
-                unsigned char *s = &m_in_queue[(dst_x +
-                        in_row*m_texture_size_x)*BYTES_PER_PIXEL];
-                double weight = p->weight;
-
-                red += s[0]*weight;
-                grn += s[1]*weight;
-                blu += s[2]*weight;
-                p++;
+    int size = m_row_size*LINEAR_COMPONENTS;
+    int x = 0;
+    int j;
+
+    // pairs of taps, so make it even
+    if (tap_count % 2 != 0) {
+        m_tap_row[tap_count] = m_tap_row[0];
+        m_tap_fixed_weight[tap_count] = 0;
+        tap_count++;
+    }
+
+#if USE_SSE2
+    if (has_sse2()) {
+        __m128i zero = _mm_setzero_si128();
+        __m128i round = _mm_set1_epi32(1 << (WEIGHT_BITS - 1));
+
+        // two pixels at a time, the odd one out is done below
+        for (; x + 2*LINEAR_COMPONENTS <= size; x += 2*LINEAR_COMPONENTS) {
+
+            __m128i low = round;
+            __m128i high = round;
+
+            // interleave the components of two rows so that each pair
+            // gets the two weights
+            for (j = 0; j < tap_count; j += 2) {
+                __m128i a = _mm_loadu_si128((__m128i *)
+                        ((unsigned short *)m_tap_row[j] + x));
+                __m128i b = _mm_loadu_si128((__m128i *)
+                        ((unsigned short *)m_tap_row[j + 1] + x));
+                __m128i weights = _mm_set1_epi32(
+                        weight_pair(&m_tap_fixed_weight[j]));
+
+                low = _mm_add_epi32(low,
+                        _mm_madd_epi16(_mm_unpacklo_epi16(a, b), weights));
+                high = _mm_add_epi32(high,
+                        _mm_madd_epi16(_mm_unpackhi_epi16(a, b), weights));
             }
 
-            dst[DST_RED] = clamp_color(red);
-            dst[DST_GRN] = clamp_color(grn);
-            dst[DST_BLU] = clamp_color(blu);
-            dst[DST_ALP] = 255;  // we'll fix it up after the image is done
+            low = _mm_srai_epi32(low, WEIGHT_BITS);
+            high = _mm_srai_epi32(high, WEIGHT_BITS);
+            _mm_storeu_si128((__m128i *)(m_linear_row + x),
+                    _mm_max_epi16(_mm_packs_epi32(low, high), zero));
+        }
+    }
+#endif
+
+    for (; x < size; x++) {
+        int sum = 1 << (WEIGHT_BITS - 1);
 
-            dst += BYTES_PER_TEXEL;
+        for (j = 0; j < tap_count; j++) {
+            sum += ((unsigned short *)m_tap_row[j])[x]*m_tap_fixed_weight[j];
+        }
+
+        m_linear_row[x] = clamp_linear(sum);
+    }
+}
 
-            dst_x++;
+void Vertical_scaler::Scale_row(int dst_y)
+{
+    int start = m_clist->start[dst_y];
+    float *weight = m_clist->weight + dst_y*m_clist->taps;
+    short *fixed_weight = m_clist->fixed_weight + dst_y*m_clist->taps;
+    int texel_x, texel_y;
+    int next_texel_x, next_texel_y;
+    int tap_count = 0;
+    int j;
+
+    // find the rows in the circular buffer once for the whole row
+    for (j = 0; j < m_clist->taps; j++) {
+        if (weight[j] != 0) {
+            int in_row = reflect_pixel(start + j, m_clist->src_size) %
+                m_in_queue_rows;
+
+            m_tap_row[tap_count] = &m_in_queue[in_row*m_row_size*
+                m_pixel_bytes];
+            m_tap_weight[tap_count] = weight[j];
+            if (m_clist->linear) {
+                m_tap_fixed_weight[tap_count] = fixed_weight[j];
+            }
+            tap_count++;
         }
     }
 
-    if (dst_y == m_src_size_y - 1) {
-        Finish_image();
+    if (m_clist->linear) {
+        Scale_linear_row(tap_count);
+    }
+
+    // the row runs along a row or column of the texture, in either
+    // direction, depending on the orientation
+    Get_texel_position(0, dst_y, &texel_x, &texel_y);
+    Get_texel_position(1, dst_y, &next_texel_x, &next_texel_y);
+
+    int step_x = next_texel_x - texel_x;
+    int step_y = next_texel_y - texel_y;
+    int texel_step = (step_y*m_tile_size_x + step_x)*BYTES_PER_TEXEL;
+    unsigned char *dst = NULL;
+
+    // this is also src_x since the rows are the same width now
+    for (int dst_x = 0; dst_x < m_row_size; dst_x++) {
+        int offset = dst_x*BYTES_PER_PIXEL;
+        float red = 0;
+        float grn = 0;
+        float blu = 0;
+
+        if (dst_x % m_row_tile_size == 0) {
+            // moved into the next tile
+            int tx = texel_x/m_tile_size_x;
+            int ty = texel_y/m_tile_size_y;
+
+            dst = m_tile[ty*m_tile_count_x + tx] +
+                ((texel_y - ty*m_tile_size_y)*m_tile_size_x +
+                 (texel_x - tx*m_tile_size_x))*BYTES_PER_TEXEL;
+        }
+
+        if (m_clist->linear) {
+            unsigned short *linear = m_linear_row + dst_x*LINEAR_COMPONENTS;
+
+            dst[DST_RED] = linear_to_srgb[linear[0] >> LINEAR_TO_SRGB_SHIFT];
+            dst[DST_GRN] = linear_to_srgb[linear[1] >> LINEAR_TO_SRGB_SHIFT];
+            dst[DST_BLU] = linear_to_srgb[linear[2] >> LINEAR_TO_SRGB_SHIFT];
+            dst[DST_ALP] = 255;
+
+            dst += texel_step;
+            texel_x += step_x;
+            texel_y += step_y;
+            continue;
+        }
+
+        for (j = 0; j < tap_count; j++) {
+            unsigned char *s = m_tap_row[j] + offset;
+            float weight = m_tap_weight[j];
+
+            red += s[0]*weight;
+            grn += s[1]*weight;
+            blu += s[2]*weight;
+        }
+
+        dst[DST_RED] = clamp_color(red);
+        dst[DST_GRN] = clamp_color(grn);
+        dst[DST_BLU] = clamp_color(blu);
+        dst[DST_ALP] = 255;  // we'll fix it up after the image is done
+
+        dst += texel_step;
+        texel_x += step_x;
+        texel_y += step_y;
     }
 }
 
@@ -605,6 +2208,12 @@ void Vertical_scaler::Finish_image()
         }
     }
 
+    if (m_mipmaps) {
+        for (i = 0; i < m_tile_count_x*m_tile_count_y; i++) {
+            make_mipmaps(m_tile[i], m_tile_size_x, m_tile_size_y);
+        }
+    }
+
 #if WRITE_OUT_TILES
     for (ty = 0; ty < m_tile_count_y; ty++) {
         for (tx = 0; tx < m_tile_count_x; tx++) {
@@ -628,4 +2237,14 @@ void Vertical_scaler::Finish_image()
         }
     }
 #endif
+
+    if (m_texel_format != TEXEL_FORMAT_A8R8G8B8) {
+        int levels = m_mipmaps ?
+            get_mipmap_level_count(m_tile_size_x, m_tile_size_y) : 1;
+
+        for (i = 0; i < m_tile_count_x*m_tile_count_y; i++) {
+            convert_texel_format(m_texel_format, m_tile[i],
+                    m_tile_size_x, m_tile_size_y, levels);
+        }
+    }
 }
@@ -26,20 +26,122 @@
 #ifndef __SCALETILE_H__
 #define __SCALETILE_H__
 
+#include "stagetime.h"
+
 #define BYTES_PER_PIXEL         3   // input image
 #define BYTES_PER_TEXEL         4   // output texture
 
 struct CLIST;
 
+// how a slide's texture is cut into tiles.  when the card can take a
+// texture as big as the whole slide there's just the one tile.
+struct TILE_LAYOUT {
+    int texture_size_x;
+    int texture_size_y;
+    int tile_size_x;
+    int tile_size_y;
+    int tile_count_x;
+    int tile_count_y;
+    int tile_count;     // row-major, top row first
+};
+
+// the biggest tiles no bigger than "maximum_tile_size", but at least 64
+void make_tile_layout(TILE_LAYOUT *layout,
+        int texture_size_x, int texture_size_y,
+        int maximum_tile_size_x, int maximum_tile_size_y);
+
+// where tile "j" goes on a slide that's 0 to 1 across and up
+void get_tile_position(TILE_LAYOUT *layout, int j,
+        float *x1, float *y1, float *x2, float *y2);
+
+// resampling filters, from fastest to sharpest.  the automatic one
+// averages blocks of pixels for big reductions and uses Lanczos2 for
+// the rest.
+#define SCALE_FILTER_BOX            0
+#define SCALE_FILTER_TRIANGLE       1
+#define SCALE_FILTER_MITCHELL       2
+#define SCALE_FILTER_LANCZOS2       3
+#define SCALE_FILTER_LANCZOS3       4
+#define SCALE_FILTER_AUTO           5
+#define SCALE_FILTER_COUNT          6
+
+// applies to tables made after the call.  Lanczos3 by default.
+void set_scale_filter(int filter);
+char *get_scale_filter_name(int filter);
+
+// blend in linear light rather than on the sRGB values.  also applies to
+// tables made after the call, off by default.
+void set_linear_light(bool linear);
+
+// the most bytes of filter tables kept for later, 4 MB by default.  the
+// ones not in use go right away if there are more.
+void set_contrib_cache_maximum(int bytes);
+
 void scale_and_tile(unsigned char *pixels, int width, int height,
         unsigned char **tile, int tile_size_x, int tile_size_y,
         int tile_count_x, int tile_count_y,
         int texture_size_x, int texture_size_y);
 
+// the table is shared, give it back with release_scale_row_data()
 CLIST *get_scale_row_data(int src_size, int dst_size, int tile_size);
+void release_scale_row_data(CLIST *clist);
+
+// a table of its own, made every time, for timing how long that takes.
+// give it back with free_scale_row_data().
+CLIST *make_scale_row_data(int src_size, int dst_size, int tile_size);
+void free_scale_row_data(CLIST *clist);
+
+// "src" must have room for this many pixels before and after the row
+int get_scale_row_padding(CLIST *clist);
+
+// the size of each pixel that scale_row() writes, which is also what
+// Vertical_scaler::Get_row_buffer() wants
+int get_scale_row_pixel_bytes(CLIST *clist);
+
+// the same for tables made now, from set_linear_light()
+int get_scale_pixel_bytes();
+
 void scale_row(CLIST *clist, unsigned char *src,
         unsigned char *dst, int dst_size);
 
+// scale_row() keeps a row for linear light for each thread.  call before
+// a thread that used it ends.
+void free_linear_row();
+
+// a tile with mipmaps has each level right after the one before it, down
+// to 1x1.  level 0 is the tile itself.
+int get_mipmap_level_count(int size_x, int size_y);
+int get_mipmap_bytes(int size_x, int size_y);
+void get_mipmap_level_size(int size_x, int size_y, int level,
+        int *level_size_x, int *level_size_y);
+unsigned char *get_mipmap_level(unsigned char *tile, int size_x, int size_y,
+        int level, int *level_size_x, int *level_size_y);
+void make_mipmaps(unsigned char *tile, int size_x, int size_y);
+
+// what the tiles end up as on the card.  the scaler always makes
+// BYTES_PER_TEXEL texels, and the others are made from them in place,
+// each level at the front of the tile data one after the other.  DXT1
+// is in 4x4 blocks, so its rows are four texels high.
+#define TEXEL_FORMAT_A8R8G8B8       0
+#define TEXEL_FORMAT_A1R5G5B5       1
+#define TEXEL_FORMAT_R5G6B5         2
+#define TEXEL_FORMAT_DXT1           3
+
+int get_texel_format_level_bytes(int format, int size_x, int size_y);
+int get_texel_format_row_height(int format);
+int get_texel_format_mipmap_bytes(int format, int size_x, int size_y,
+        int levels);
+unsigned char *get_texel_format_level(int format, unsigned char *tile,
+        int size_x, int size_y, int level,
+        int *level_size_x, int *level_size_y);
+void convert_texel_format(int format, unsigned char *tile,
+        int size_x, int size_y, int levels);
+
+void compress_dxt1(unsigned char *src, int size_x, int size_y,
+        unsigned char *dst);
+void decompress_dxt1(unsigned char *src, int size_x, int size_y,
+        unsigned char *dst);
+
 class Vertical_scaler {
 public:
     Vertical_scaler();
@@ -49,13 +151,37 @@ public:
             unsigned char **tile, int tile_size_x, int tile_size_y,
             int tile_count_x, int tile_count_y,
             int texture_size_x, int texture_size_y);
-    void Set_source_parameters(int src_size_x, int src_size_y);
+    void Set_destination_parameters(unsigned char **tile,
+            TILE_LAYOUT *layout);
+    // "orientation" is the EXIF orientation of the source image.  rows
+    // come in as they're stored in the file and get turned on the way
+    // into the tiles.
+    void Set_source_parameters(int src_size_x, int src_size_y,
+            int orientation);
+
+    // also fill in the rest of each tile's mip chain when the image is
+    // done.  the tiles must have room for get_mipmap_bytes().
+    void Set_mipmaps(bool mipmaps);
+
+    // then turn the tiles (and their mip chains) into one of the
+    // TEXEL_FORMAT_ formats
+    void Set_texel_format(int format);
+
+    // start filling the tiles from the top again, for another pass
+    // over the same image
+    void Restart();
 
     unsigned char *Get_row_buffer(int src_y);
     void Process_row(int src_y);
 
     int m_src_size_x;
     int m_src_size_y;
+    int m_orientation;
+
+    // the size (and tile size) of the rows passed to Get_row_buffer().
+    // this is the texture's height if the image is on its side.
+    int m_row_size;
+    int m_row_tile_size;
     unsigned char **m_tile;
     int m_tile_size_x;
     int m_tile_size_y;
@@ -65,14 +191,41 @@ public:
     int m_texture_size_y;
 
 private:
+    void Update_row_size();
+    void Get_texel_position(int x, int y, int *texel_x, int *texel_y);
     void Setup();
     void Scale_row(int dst_y);
+    void Scale_linear_row(int tap_count);
     void Finish_image();
 
     bool m_parameters_changed;
 
+    // the number of rows that Scale_row() produces, and their tile size
+    int m_column_size;
+    int m_column_tile_size;
+
     CLIST *m_clist;
     int m_start_dst_y;
+    bool m_mipmaps;
+    int m_texel_format;
+
+    // for averaging blocks of rows before filtering
+    int *m_box_sum;
+    unsigned char *m_box_row;
+    int m_box_allocated_size;
+
+    // the source rows and weights for the row being scaled
+    unsigned char **m_tap_row;
+    float *m_tap_weight;
+    short *m_tap_fixed_weight;
+
+    // the size of each pixel in the circular buffer, bigger when the
+    // rows are in linear light
+    int m_pixel_bytes;
+
+    // the row being scaled, in linear light
+    unsigned short *m_linear_row;
+    int m_linear_row_allocated_size;
 
     int m_cannot_do_rows_allocated_size;
     int *m_cannot_do_rows;
@@ -80,6 +233,10 @@ private:
     int m_in_queue_rows;
     int m_in_queue_allocated_size;
     unsigned char *m_in_queue;
+
+    // the time in Process_row() so far this pass, not counting
+    // Finish_image()
+    STAGE_CLOCK m_scale_ticks;
 };
 
 #endif  /* __SCALETILE_H__ */
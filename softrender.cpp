@@ -0,0 +1,269 @@
+/*
+ * SoftRender.cpp
+ *
+ * A software version of the slide drawing, for machines whose drivers
+ * can't do it and for making frames without a window.  Each tile is
+ * sampled bilinearly from the one mipmap level nearest its size on the
+ * screen and blended over the frame with its alpha times the dissolve.
+ *
+ */
+
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "softrender.h"
+#include "scaletile.h"
+#include "jessu.h"
+#include "cpu.h"
+
+static SOFT_FRAME_HOOK frame_hook = NULL;
+static void *frame_hook_data;
+
+bool set_soft_frame_size(SOFT_FRAME *frame, int width, int height)
+{
+    if (frame->pixels != NULL && frame->width == width &&
+            frame->height == height) {
+
+        return true;
+    }
+
+    free_soft_frame(frame);
+
+    frame->pixels = (unsigned char *)jessu_malloc(THREAD_GL,
+            width*height*BYTES_PER_TEXEL, "soft frame");
+    if (frame->pixels == NULL) {
+        jessu_printf(THREAD_GL, "No memory for a %dx%d soft frame",
+                width, height);
+        frame->width = 0;
+        frame->height = 0;
+        return false;
+    }
+
+    frame->width = width;
+    frame->height = height;
+
+    return true;
+}
+
+void free_soft_frame(SOFT_FRAME *frame)
+{
+    if (frame->pixels != NULL) {
+        jessu_free(THREAD_GL, frame->pixels, "soft frame");
+        frame->pixels = NULL;
+    }
+    frame->width = 0;
+    frame->height = 0;
+}
+
+void clear_soft_frame(SOFT_FRAME *frame)
+{
+    memset(frame->pixels, 0, frame->width*frame->height*BYTES_PER_TEXEL);
+}
+
+void set_soft_frame_hook(SOFT_FRAME_HOOK hook, void *data)
+{
+    frame_hook = hook;
+    frame_hook_data = data;
+}
+
+void finish_soft_frame(SOFT_FRAME *frame)
+{
+    if (frame_hook != NULL) {
+        frame_hook(frame, frame_hook_data);
+    }
+}
+
+// blends "count" pixels of a row of the frame.  "tu" is the first one's
+// position across the level in 16.16 texels and "tu_step" how far each
+// pixel goes; "fy" is how far (out of 256) it is from "row0" to "row1".
+// "alpha_scale" is the dissolve, out of 256.
+static void
+draw_soft_span(unsigned char *dst, int count,
+        unsigned char *row0, unsigned char *row1, int fy, int size_x,
+        int tu, int tu_step, int alpha_scale)
+{
+    int last = (size_x - 1) << 16;
+    int i = 0;
+
+#if USE_SSE2
+    if (has_sse2()) {
+        __m128i zero = _mm_setzero_si128();
+        __m128i weight_y0 = _mm_set1_epi16((short)(256 - fy));
+        __m128i weight_y1 = _mm_set1_epi16((short)fy);
+
+        for (; i < count; i++, tu += tu_step, dst += BYTES_PER_TEXEL) {
+            int t = tu < 0 ? 0 : tu > last ? last : tu;
+            int tx = t >> 16;
+            int fx = (t >> 8) & 255;
+            int tx1 = tx + 1 < size_x ? tx + 1 : tx;
+
+            // each row's two texels side by side, in words
+            __m128i top = _mm_unpacklo_epi8(_mm_unpacklo_epi32(
+                        _mm_cvtsi32_si128(*(int *)(row0 +
+                                tx*BYTES_PER_TEXEL)),
+                        _mm_cvtsi32_si128(*(int *)(row0 +
+                                tx1*BYTES_PER_TEXEL))), zero);
+            __m128i bottom = _mm_unpacklo_epi8(_mm_unpacklo_epi32(
+                        _mm_cvtsi32_si128(*(int *)(row1 +
+                                tx*BYTES_PER_TEXEL)),
+                        _mm_cvtsi32_si128(*(int *)(row1 +
+                                tx1*BYTES_PER_TEXEL))), zero);
+
+            // down, then across.  the weights add up to 256, so none
+            // of this goes past 16 bits.
+            __m128i column = _mm_srli_epi16(_mm_add_epi16(
+                        _mm_mullo_epi16(top, weight_y0),
+                        _mm_mullo_epi16(bottom, weight_y1)), 8);
+            __m128i across = _mm_mullo_epi16(column,
+                    _mm_set_epi16((short)fx, (short)fx, (short)fx,
+                        (short)fx, (short)(256 - fx), (short)(256 - fx),
+                        (short)(256 - fx), (short)(256 - fx)));
+            __m128i texel = _mm_srli_epi16(_mm_add_epi16(across,
+                        _mm_srli_si128(across, 8)), 8);
+
+            int alpha = _mm_extract_epi16(texel, DST_ALP)*alpha_scale >> 8;
+            alpha += alpha >> 7;
+
+            __m128i pixel = _mm_unpacklo_epi8(
+                    _mm_cvtsi32_si128(*(int *)dst), zero);
+
+            pixel = _mm_srli_epi16(_mm_add_epi16(
+                        _mm_mullo_epi16(pixel,
+                            _mm_set1_epi16((short)(256 - alpha))),
+                        _mm_mullo_epi16(texel,
+                            _mm_set1_epi16((short)alpha))), 8);
+            *(int *)dst = _mm_cvtsi128_si32(_mm_packus_epi16(pixel, pixel));
+        }
+    }
+#endif
+
+    for (; i < count; i++, tu += tu_step, dst += BYTES_PER_TEXEL) {
+        int t = tu < 0 ? 0 : tu > last ? last : tu;
+        int tx = t >> 16;
+        int fx = (t >> 8) & 255;
+        int tx1 = tx + 1 < size_x ? tx + 1 : tx;
+        unsigned char *a = row0 + tx*BYTES_PER_TEXEL;
+        unsigned char *b = row0 + tx1*BYTES_PER_TEXEL;
+        unsigned char *c = row1 + tx*BYTES_PER_TEXEL;
+        unsigned char *d = row1 + tx1*BYTES_PER_TEXEL;
+        int texel[BYTES_PER_TEXEL];
+        int k;
+
+        for (k = 0; k < BYTES_PER_TEXEL; k++) {
+            int left = (a[k]*(256 - fy) + c[k]*fy) >> 8;
+            int right = (b[k]*(256 - fy) + d[k]*fy) >> 8;
+
+            texel[k] = (left*(256 - fx) + right*fx) >> 8;
+        }
+
+        // 255 should be all the way
+        int alpha = texel[DST_ALP]*alpha_scale >> 8;
+        alpha += alpha >> 7;
+
+        for (k = 0; k < BYTES_PER_TEXEL; k++) {
+            dst[k] = (unsigned char)
+                ((dst[k]*(256 - alpha) + texel[k]*alpha) >> 8);
+        }
+    }
+}
+
+void draw_soft_slide(SOFT_FRAME *frame, unsigned char **tile,
+        TILE_LAYOUT *layout, double x, double y, double scale,
+        double ratio, double dissolve)
+{
+    int width = frame->width;
+    int height = frame->height;
+    int alpha_scale = (int)(dissolve*256 + 0.5);
+
+    if (alpha_scale <= 0 || scale <= 0 || width <= 0 || height <= 0) {
+        return;
+    }
+
+    // the frame is 1 across and this high, centered on 0.5, as in the
+    // projection of display_slides()
+    double half_height = height/(double)width/2;
+
+    // the level with no more than two texels to a pixel
+    double texels_per_pixel = layout->texture_size_x/(scale*width);
+    double texels_per_pixel_y = layout->texture_size_y*ratio/(scale*width);
+    int levels = get_mipmap_level_count(layout->tile_size_x,
+            layout->tile_size_y);
+    int level = 0;
+
+    if (texels_per_pixel_y > texels_per_pixel) {
+        texels_per_pixel = texels_per_pixel_y;
+    }
+    while (level < levels - 1 && texels_per_pixel >= 2) {
+        texels_per_pixel /= 2;
+        level++;
+    }
+
+    // the apron isn't drawn
+    double apron_s = TILE_APRON/(double)layout->tile_size_x;
+    double apron_t = TILE_APRON/(double)layout->tile_size_y;
+
+    for (int j = 0; j < layout->tile_count; j++) {
+        float x1, y1, x2, y2;
+        int size_x, size_y;
+        unsigned char *texels = get_mipmap_level(tile[j],
+                layout->tile_size_x, layout->tile_size_y, level,
+                &size_x, &size_y);
+
+        get_tile_position(layout, j, &x1, &y1, &x2, &y2);
+
+        // the pixels whose centers are on the tile, counting only one
+        // side of each edge so that tiles that meet don't both draw the
+        // pixels on the seam
+        int px1 = (int)ceil(((x1 - x)*scale + 0.5)*width - 0.5);
+        int px2 = (int)ceil(((x2 - x)*scale + 0.5)*width - 0.5);
+        int py1 = (int)ceil((half_height - (y2 - y)*scale/ratio)*width -
+                0.5);
+        int py2 = (int)ceil((half_height - (y1 - y)*scale/ratio)*width -
+                0.5);
+
+        if (px1 < 0) px1 = 0;
+        if (px2 > width) px2 = width;
+        if (py1 < 0) py1 = 0;
+        if (py2 > height) py2 = height;
+        if (px1 >= px2 || py1 >= py2) {
+            continue;
+        }
+
+        // where the centers of the pixels fall in the level, in texels.
+        // it's the same line of thinking as the texture coordinates in
+        // make_tile_vertex_buffer(), with the view transform undone.
+        double u_per_x = (1 - 2*apron_s)/(x2 - x1);
+        double v_per_y = (1 - 2*apron_t)/(y2 - y1);
+        double tu_step = u_per_x*size_x/(scale*width);
+        double tu0 = (apron_s + ((0.5/width - 0.5)/scale + x - x1)*u_per_x)*
+            size_x - 0.5;
+        double tv_step = v_per_y*size_y*ratio/(scale*width);
+        double tv0 = (1 - apron_t - ((half_height - 0.5/width)*ratio/scale +
+                    y - y1)*v_per_y)*size_y - 0.5;
+
+        int tu = (int)((tu0 + px1*tu_step)*65536);
+        int tu_fixed_step = (int)(tu_step*65536);
+
+        for (int py = py1; py < py2; py++) {
+            double tv = tv0 + py*tv_step;
+
+            if (tv < 0) {
+                tv = 0;
+            } else if (tv > size_y - 1) {
+                tv = size_y - 1;
+            }
+
+            int ty = (int)tv;
+            int fy = (int)((tv - ty)*256);
+            int ty1 = ty + 1 < size_y ? ty + 1 : ty;
+
+            draw_soft_span(frame->pixels +
+                    (py*width + px1)*BYTES_PER_TEXEL, px2 - px1,
+                    texels + ty*size_x*BYTES_PER_TEXEL,
+                    texels + ty1*size_x*BYTES_PER_TEXEL, fy, size_x,
+                    tu, tu_fixed_step, alpha_scale);
+        }
+    }
+}
@@ -0,0 +1,42 @@
+/*
+ * SoftRender.h
+ *
+ * Draws slides into a frame in memory, with no graphics board, the same
+ * way display_slide() does with Direct3D or OpenGL.
+ *
+ */
+
+#ifndef __SOFTRENDER_H__
+#define __SOFTRENDER_H__
+
+#include "scaletile.h"
+
+// 32-bit pixels, top row first, with the bytes in the same order as the
+// texels
+struct SOFT_FRAME {
+    int width;
+    int height;
+    unsigned char *pixels;
+};
+
+// false if there wasn't the memory, and the frame is left empty (0x0)
+bool set_soft_frame_size(SOFT_FRAME *frame, int width, int height);
+void free_soft_frame(SOFT_FRAME *frame);
+void clear_soft_frame(SOFT_FRAME *frame);
+
+// blends a slide's tiles (A8R8G8B8, with their mip chains) over the
+// frame.  the point "x", "y" of the slide (0 to 1 across and up) goes in
+// the middle of the frame, the slide is "scale" times as wide as the
+// frame and "ratio" times as wide as it is high, and "dissolve" is how
+// opaque it is, all as in display_slide().
+void draw_soft_slide(SOFT_FRAME *frame, unsigned char **tile,
+        TILE_LAYOUT *layout, double x, double y, double scale,
+        double ratio, double dissolve);
+
+// "hook" is called with each finished frame, for writing them out or
+// checking them.  NULL for none.
+typedef void (*SOFT_FRAME_HOOK)(SOFT_FRAME *frame, void *data);
+void set_soft_frame_hook(SOFT_FRAME_HOOK hook, void *data);
+void finish_soft_frame(SOFT_FRAME *frame);
+
+#endif /* __SOFTRENDER_H__ */
@@ -0,0 +1,201 @@
+/*
+ * StageTime.cpp
+ *
+ * Each stage has a histogram of its times in microseconds with buckets
+ * in the manner of an HDR histogram: one microsecond wide up to 64, and
+ * above that 32 buckets to each doubling, so every bucket is within about
+ * 3% of the times in it.  The workers, the strip threads and the drawing
+ * thread all record into them at once, so each bucket is just a counter
+ * bumped with InterlockedIncrement().
+ *
+ */
+
+#include <windows.h>
+#include <stdio.h>
+
+#include "stagetime.h"
+
+// buckets to each doubling past the linear part, which is twice as many
+#define STAGE_SUB_BUCKETS           32
+#define STAGE_LINEAR_BUCKETS        (STAGE_SUB_BUCKETS*2)
+
+// the last doubling, about 36 minutes; longer times go in its last bucket
+#define STAGE_MAXIMUM_SHIFT         26
+#define STAGE_BUCKET_COUNT \
+    ((STAGE_MAXIMUM_SHIFT + 2)*STAGE_SUB_BUCKETS)
+
+static char *stage_name[STAGE_COUNT] = {
+    "file_open",
+    "header",
+    "decode",
+    "horizontal_scale",
+    "vertical_scale",
+    "finish_image",
+    "tile_upload",
+    "filename_notice",
+    "present",
+};
+
+static bool enabled = false;
+static LARGE_INTEGER frequency;
+static volatile LONG bucket[STAGE_COUNT][STAGE_BUCKET_COUNT];
+
+void enable_stage_times()
+{
+    QueryPerformanceFrequency(&frequency);
+    enabled = frequency.QuadPart != 0;
+}
+
+bool stage_times_enabled()
+{
+    return enabled;
+}
+
+STAGE_CLOCK get_stage_clock()
+{
+    LARGE_INTEGER count;
+
+    if (!enabled) {
+        return 0;
+    }
+
+    QueryPerformanceCounter(&count);
+
+    return count.QuadPart;
+}
+
+static int
+get_bucket_index(LONGLONG microseconds)
+{
+    int shift = 0;
+
+    if (microseconds < 0) {
+        microseconds = 0;
+    }
+
+    while ((microseconds >> shift) >= STAGE_LINEAR_BUCKETS) {
+        shift++;
+    }
+    if (shift > STAGE_MAXIMUM_SHIFT) {
+        return STAGE_BUCKET_COUNT - 1;
+    }
+
+    return shift*STAGE_SUB_BUCKETS + (int)(microseconds >> shift);
+}
+
+// the smallest and largest times that go in bucket "index"
+static void
+get_bucket_range(int index, double *low, double *high)
+{
+    if (index < STAGE_LINEAR_BUCKETS) {
+        *low = index;
+        *high = index;
+    } else {
+        int shift = index/STAGE_SUB_BUCKETS - 1;
+        int sub = index - shift*STAGE_SUB_BUCKETS;
+
+        *low = (double)sub*(1 << shift);
+        *high = (double)(sub + 1)*(1 << shift) - 1;
+    }
+}
+
+void add_stage_ticks(int stage, STAGE_CLOCK ticks)
+{
+    if (!enabled) {
+        return;
+    }
+
+    LONGLONG microseconds = ticks*1000000/frequency.QuadPart;
+
+    InterlockedIncrement((LONG *)&bucket[stage][get_bucket_index(
+                microseconds)]);
+}
+
+void record_stage_time(int stage, STAGE_CLOCK start)
+{
+    if (!enabled) {
+        return;
+    }
+
+    add_stage_ticks(stage, get_stage_clock() - start);
+}
+
+// the largest time in the bucket that has the "fraction" point, in a
+// snapshot of the buckets holding "count" times
+static double
+get_percentile(LONG *count_in_bucket, LONG count, double fraction)
+{
+    LONG rank = (LONG)(count*fraction + 0.999999);
+    LONG seen = 0;
+    double low, high;
+
+    if (rank < 1) {
+        rank = 1;
+    }
+
+    for (int i = 0; i < STAGE_BUCKET_COUNT; i++) {
+        seen += count_in_bucket[i];
+        if (seen >= rank) {
+            get_bucket_range(i, &low, &high);
+            return high;
+        }
+    }
+
+    return 0;
+}
+
+void write_stage_times(FILE *out)
+{
+    LONG count_in_bucket[STAGE_BUCKET_COUNT];
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"unit\": \"microseconds\",\n");
+    fprintf(out, "  \"stages\": [\n");
+
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+        LONG count = 0;
+        double total = 0;
+        double low, high;
+        double maximum = 0;
+        int i;
+
+        // the threads may still be adding, so work from a copy
+        for (i = 0; i < STAGE_BUCKET_COUNT; i++) {
+            count_in_bucket[i] = bucket[stage][i];
+            count += count_in_bucket[i];
+            if (count_in_bucket[i] != 0) {
+                get_bucket_range(i, &low, &high);
+                total += count_in_bucket[i]*(low + high)/2;
+                maximum = high;
+            }
+        }
+
+        fprintf(out, "    {\"name\": \"%s\", \"count\": %ld",
+                stage_name[stage], count);
+        if (count > 0) {
+            fprintf(out, ", \"mean\": %.0f, \"p50\": %.0f, \"p90\": %.0f, "
+                    "\"p99\": %.0f, \"p999\": %.0f, \"max\": %.0f",
+                    total/count,
+                    get_percentile(count_in_bucket, count, 0.5),
+                    get_percentile(count_in_bucket, count, 0.9),
+                    get_percentile(count_in_bucket, count, 0.99),
+                    get_percentile(count_in_bucket, count, 0.999),
+                    maximum);
+        }
+
+        // the buckets with anything in them, as [low, high, count]
+        fprintf(out, ",\n      \"buckets\": [");
+        bool first = true;
+        for (i = 0; i < STAGE_BUCKET_COUNT; i++) {
+            if (count_in_bucket[i] != 0) {
+                get_bucket_range(i, &low, &high);
+                fprintf(out, "%s[%.0f, %.0f, %ld]", first ? "" : ", ",
+                        low, high, count_in_bucket[i]);
+                first = false;
+            }
+        }
+        fprintf(out, "]}%s\n", stage < STAGE_COUNT - 1 ? "," : "");
+    }
+
+    fprintf(out, "  ]\n}\n");
+}
@@ -0,0 +1,49 @@
+/*
+ * StageTime.h
+ *
+ * Histograms of how long each stage of getting a picture on the screen
+ * takes, for telling whether a stall was the disk, the decoding or the
+ * upload.
+ *
+ */
+
+#ifndef __STAGETIME_H__
+#define __STAGETIME_H__
+
+
+#include <windows.h>
+#include <stdio.h>
+
+#define STAGE_FILE_OPEN             0
+#define STAGE_HEADER                1
+#define STAGE_DECODE                2
+#define STAGE_HORIZONTAL_SCALE      3
+#define STAGE_VERTICAL_SCALE        4
+#define STAGE_FINISH_IMAGE          5
+#define STAGE_TILE_UPLOAD           6
+#define STAGE_FILENAME_NOTICE       7
+#define STAGE_PRESENT               8
+#define STAGE_COUNT                 9
+
+// in performance counter ticks
+typedef LONGLONG STAGE_CLOCK;
+
+// nothing is recorded until this is called
+void enable_stage_times();
+bool stage_times_enabled();
+
+// 0 when the times aren't enabled, so that the difference of two is too
+STAGE_CLOCK get_stage_clock();
+
+// adds the time since "start" to the stage's histogram
+void record_stage_time(int stage, STAGE_CLOCK start);
+
+// adds "ticks" as one time, for stages that are timed in pieces (a row
+// at a time) and added up
+void add_stage_ticks(int stage, STAGE_CLOCK ticks);
+
+// the histograms so far, as JSON
+void write_stage_times(FILE *out);
+
+
+#endif /* __STAGETIME_H__ */
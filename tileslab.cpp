@@ -0,0 +1,171 @@
+/*
+ * TileSlab.cpp
+ *
+ * One VirtualAlloc() for all of the tiles: the sets' pointer arrays and
+ * the list of free sets at the start, then every tile on its own cache
+ * line.  The pages are aligned and the tiles are together, which the
+ * SSE scaling likes and which takes fewer TLB entries than tiles spread
+ * over the heap, and setting up the tiles again reuses the pages rather
+ * than going back to the heap.  Large pages are tried first, but Windows
+ * only gives them to accounts with the "lock pages in memory" right, so
+ * usually it's ordinary ones.
+ *
+ */
+
+#include <windows.h>
+#include <stdio.h>
+
+#include "tileslab.h"
+#include "jessu.h"
+#include "memuse.h"
+
+#ifndef MEM_LARGE_PAGES
+#define MEM_LARGE_PAGES             0x20000000
+#endif
+
+typedef SIZE_T (WINAPI *GET_LARGE_PAGE_MINIMUM)(void);
+
+static size_t
+round_up(size_t bytes, size_t multiple)
+{
+    return (bytes + multiple - 1)/multiple*multiple;
+}
+
+// the size of a large page, or 0 if Windows doesn't have them
+static size_t
+get_large_page_bytes()
+{
+    HMODULE kernel = GetModuleHandle("kernel32.dll");
+    if (kernel == NULL) {
+        return 0;
+    }
+
+    GET_LARGE_PAGE_MINIMUM get_large_page_minimum = (GET_LARGE_PAGE_MINIMUM)
+        GetProcAddress(kernel, "GetLargePageMinimum");
+    if (get_large_page_minimum == NULL) {
+        return 0;
+    }
+
+    return get_large_page_minimum();
+}
+
+static bool
+allocate_slab_memory(TILE_SLAB *slab, size_t bytes)
+{
+    size_t large_page_bytes = get_large_page_bytes();
+
+    if (large_page_bytes != 0 && bytes >= large_page_bytes) {
+        size_t large_bytes = round_up(bytes, large_page_bytes);
+
+        slab->memory = (unsigned char *)VirtualAlloc(NULL, large_bytes,
+                MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+        if (slab->memory != NULL) {
+            slab->bytes = large_bytes;
+            slab->large_pages = true;
+            count_memory(THREAD_GL, (LONG)slab->bytes, "tile slab");
+            return true;
+        }
+    }
+
+    slab->memory = (unsigned char *)VirtualAlloc(NULL, bytes,
+            MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    if (slab->memory == NULL) {
+        return false;
+    }
+    slab->bytes = bytes;
+    slab->large_pages = false;
+    count_memory(THREAD_GL, (LONG)slab->bytes, "tile slab");
+
+    return true;
+}
+
+void free_tile_slab(TILE_SLAB *slab)
+{
+    if (slab->memory != NULL) {
+        VirtualFree(slab->memory, 0, MEM_RELEASE);
+        count_memory(THREAD_GL, -(LONG)slab->bytes, "tile slab");
+    }
+
+    slab->memory = NULL;
+    slab->bytes = 0;
+    slab->set_count = 0;
+    slab->tile_count = 0;
+    slab->tile_bytes = 0;
+    slab->free_set = NULL;
+    slab->free_count = 0;
+}
+
+bool set_tile_slab_size(TILE_SLAB *slab, int set_count, int tile_count,
+        int tile_bytes)
+{
+    int i, j;
+
+    if (slab->free_count != slab->set_count) {
+        jessu_printf(THREAD_GL, "Tile slab: %d sets still in use",
+                slab->set_count - slab->free_count);
+        return false;
+    }
+
+    tile_bytes = (int)round_up(tile_bytes, TILE_SLAB_ALIGNMENT);
+
+    size_t pointer_bytes = (size_t)set_count*tile_count*
+        sizeof(unsigned char *);
+    size_t header_bytes = round_up(pointer_bytes + set_count*sizeof(int),
+            TILE_SLAB_ALIGNMENT);
+    size_t bytes = header_bytes + (size_t)set_count*tile_count*tile_bytes;
+
+    if (bytes > slab->bytes) {
+        free_tile_slab(slab);
+        if (!allocate_slab_memory(slab, bytes)) {
+            jessu_printf(THREAD_GL, "Tile slab: can't get %d KB",
+                    (int)(bytes/1024));
+            return false;
+        }
+    }
+
+    slab->set_count = set_count;
+    slab->tile_count = tile_count;
+    slab->tile_bytes = tile_bytes;
+
+    unsigned char **pointer = (unsigned char **)slab->memory;
+    unsigned char *data = slab->memory + header_bytes;
+
+    for (i = 0; i < set_count; i++) {
+        for (j = 0; j < tile_count; j++) {
+            pointer[i*tile_count + j] = data +
+                ((size_t)i*tile_count + j)*tile_bytes;
+        }
+    }
+
+    // handed out from the start
+    slab->free_set = (int *)(slab->memory + pointer_bytes);
+    for (i = 0; i < set_count; i++) {
+        slab->free_set[i] = set_count - 1 - i;
+    }
+    slab->free_count = set_count;
+
+    jessu_printf(THREAD_GL, "Tile slab: %d sets of %d tiles of %d bytes, "
+            "%d KB%s", set_count, tile_count, tile_bytes,
+            (int)(slab->bytes/1024),
+            slab->large_pages ? " in large pages" : "");
+
+    return true;
+}
+
+unsigned char **get_tile_set(TILE_SLAB *slab)
+{
+    if (slab->free_count == 0) {
+        return NULL;
+    }
+
+    int set = slab->free_set[--slab->free_count];
+
+    return (unsigned char **)slab->memory + set*slab->tile_count;
+}
+
+void put_tile_set(TILE_SLAB *slab, unsigned char **tile)
+{
+    int set = (tile - (unsigned char **)slab->memory)/slab->tile_count;
+
+    slab->free_set[slab->free_count++] = set;
+}
@@ -0,0 +1,46 @@
+/*
+ * TileSlab.h
+ *
+ * The tile data for every slide and prefetch entry, carved out of one
+ * block of pages instead of a malloc() for each tile.
+ *
+ */
+
+#ifndef __TILESLAB_H__
+#define __TILESLAB_H__
+
+
+#include <windows.h>
+
+// each tile starts on a cache line
+#define TILE_SLAB_ALIGNMENT         64
+
+struct TILE_SLAB {
+    unsigned char *memory;      // from VirtualAlloc()
+    size_t bytes;
+    bool large_pages;
+
+    int set_count;
+    int tile_count;             // in each set
+    int tile_bytes;             // rounded up to TILE_SLAB_ALIGNMENT
+
+    // sets not handed out, by number
+    int *free_set;
+    int free_count;
+};
+
+// makes room for "set_count" sets of "tile_count" tiles of "tile_bytes"
+// each.  can only be done when all the sets are back; the pages are kept
+// if they're big enough.  returns false if there's not enough memory or
+// a set is still out.  "slab" starts all zero.
+bool set_tile_slab_size(TILE_SLAB *slab, int set_count, int tile_count,
+        int tile_bytes);
+void free_tile_slab(TILE_SLAB *slab);
+
+// a set of tiles: an array of "tile_count" pointers to tile data.  NULL
+// if they're all out.  these are for one thread at a time.
+unsigned char **get_tile_set(TILE_SLAB *slab);
+void put_tile_set(TILE_SLAB *slab, unsigned char **tile);
+
+
+#endif /* __TILESLAB_H__ */
@@ -0,0 +1,250 @@
+/*
+ * TraceFile.cpp
+ *
+ * Each thread records into a ring of its own, so recording is a couple of
+ * stores and never waits on another thread.  When a ring is full the
+ * oldest events go.  The strip threads come and go with every picture,
+ * so a ring is given back when its thread ends and the next new thread
+ * takes it over; every event keeps the id of the thread that recorded it,
+ * and a thread's name is an event too.
+ *
+ */
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "tracefile.h"
+
+// events each ring keeps, a power of two
+#define TRACE_RING_EVENTS           16384
+
+// rings for threads alive at once
+#define TRACE_MAXIMUM_RINGS         32
+
+struct TRACE_EVENT {
+    LONGLONG time;              // performance counter
+    char *name;                 // NOT ALLOCATED
+    int value;                  // for counters
+    DWORD thread_id;
+    char phase;                 // 'B', 'E', 'C' or 'M', as in the format
+};
+
+struct TRACE_RING {
+    volatile LONG in_use;
+
+    // how many events have ever been recorded in it.  only the thread
+    // using it changes this.
+    volatile LONG count;
+
+    // the name of the thread using it, in case its 'M' event is gone
+    DWORD owner_id;
+    char *owner_name;           // NOT ALLOCATED
+
+    TRACE_EVENT event[TRACE_RING_EVENTS];
+};
+
+static bool enabled = false;
+static LARGE_INTEGER frequency;
+static LONGLONG start_time;
+
+static TRACE_RING *ring[TRACE_MAXIMUM_RINGS];
+static volatile LONG ring_count;
+
+static __declspec(thread) TRACE_RING *my_ring = NULL;
+
+void start_trace()
+{
+    LARGE_INTEGER count;
+
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&count);
+    start_time = count.QuadPart;
+    enabled = frequency.QuadPart != 0;
+}
+
+bool trace_enabled()
+{
+    return enabled;
+}
+
+// the calling thread's ring, or NULL if we're out of them
+static TRACE_RING *
+get_my_ring()
+{
+    if (my_ring != NULL) {
+        return my_ring;
+    }
+
+    // one that a thread gave back
+    LONG count = ring_count;
+    for (int i = 0; i < count && i < TRACE_MAXIMUM_RINGS; i++) {
+        TRACE_RING *r = ring[i];
+
+        if (r != NULL &&
+                InterlockedCompareExchange((LONG *)&r->in_use, 1, 0) == 0) {
+
+            my_ring = r;
+            return my_ring;
+        }
+    }
+
+    LONG index = InterlockedIncrement((LONG *)&ring_count) - 1;
+    if (index >= TRACE_MAXIMUM_RINGS) {
+        return NULL;
+    }
+
+    TRACE_RING *r = (TRACE_RING *)calloc(1, sizeof(TRACE_RING));
+    if (r == NULL) {
+        return NULL;
+    }
+    r->in_use = 1;
+    ring[index] = r;
+
+    my_ring = r;
+    return my_ring;
+}
+
+static void
+add_trace_event(char phase, char *name, int value)
+{
+    if (!enabled) {
+        return;
+    }
+
+    TRACE_RING *r = get_my_ring();
+    if (r == NULL) {
+        return;
+    }
+
+    LARGE_INTEGER count;
+    QueryPerformanceCounter(&count);
+
+    TRACE_EVENT *event = &r->event[r->count & (TRACE_RING_EVENTS - 1)];
+    event->time = count.QuadPart;
+    event->name = name;
+    event->value = value;
+    event->thread_id = GetCurrentThreadId();
+    event->phase = phase;
+
+    // after the event, so that the writer never sees it half done
+    InterlockedIncrement((LONG *)&r->count);
+}
+
+void trace_begin(char *name)
+{
+    add_trace_event('B', name, 0);
+}
+
+void trace_end(char *name)
+{
+    add_trace_event('E', name, 0);
+}
+
+void trace_counter(char *name, int value)
+{
+    add_trace_event('C', name, value);
+}
+
+void set_trace_thread_name(char *name)
+{
+    add_trace_event('M', name, 0);
+
+    if (my_ring != NULL) {
+        my_ring->owner_id = GetCurrentThreadId();
+        my_ring->owner_name = name;
+    }
+}
+
+void end_trace_thread()
+{
+    if (my_ring != NULL) {
+        my_ring->owner_name = NULL;
+        InterlockedExchange((LONG *)&my_ring->in_use, 0);
+        my_ring = NULL;
+    }
+}
+
+static void
+write_thread_name(FILE *out, DWORD thread_id, char *name, bool first)
+{
+    fprintf(out, "%s\n    {\"name\": \"thread_name\", \"ph\": \"M\", "
+            "\"pid\": 1, \"tid\": %lu, \"args\": {\"name\": \"%s\"}}",
+            first ? "" : ",", thread_id, name);
+}
+
+// the events of one ring that are still there, oldest first.  the
+// threads keep recording, so the oldest few may be overwritten while
+// we're writing; those are newer than the rest and are still whole
+// events, they're just out of place at the start.
+static bool
+write_ring(FILE *out, TRACE_RING *r, bool first)
+{
+    LONG count = r->count;
+    LONG oldest = count > TRACE_RING_EVENTS ? count - TRACE_RING_EVENTS : 0;
+    DWORD thread_id = 0;
+    int depth = 0;
+
+    char *owner_name = r->owner_name;
+    if (owner_name != NULL) {
+        write_thread_name(out, r->owner_id, owner_name, first);
+        first = false;
+    }
+
+    for (LONG i = oldest; i < count; i++) {
+        TRACE_EVENT *event = &r->event[i & (TRACE_RING_EVENTS - 1)];
+
+        if (event->thread_id != thread_id) {
+            thread_id = event->thread_id;
+            depth = 0;
+        }
+
+        // the ends of spans that began before the oldest event
+        if (event->phase == 'E') {
+            if (depth == 0) {
+                continue;
+            }
+            depth--;
+        } else if (event->phase == 'B') {
+            depth++;
+        }
+
+        if (event->phase == 'M') {
+            write_thread_name(out, event->thread_id, event->name, first);
+            first = false;
+            continue;
+        }
+
+        double microseconds = (double)(event->time - start_time)*1000000/
+            frequency.QuadPart;
+
+        fprintf(out, "%s\n    {\"name\": \"%s\", \"ph\": \"%c\", "
+                "\"pid\": 1, \"tid\": %lu, \"ts\": %.3f",
+                first ? "" : ",", event->name, event->phase,
+                event->thread_id, microseconds);
+        if (event->phase == 'C') {
+            fprintf(out, ", \"args\": {\"value\": %d}", event->value);
+        }
+        fprintf(out, "}");
+        first = false;
+    }
+
+    return first;
+}
+
+void write_trace(FILE *out)
+{
+    bool first = true;
+    LONG count = ring_count;
+
+    fprintf(out, "{\n  \"displayTimeUnit\": \"ms\",\n");
+    fprintf(out, "  \"traceEvents\": [");
+
+    for (LONG i = 0; i < count && i < TRACE_MAXIMUM_RINGS; i++) {
+        if (ring[i] != NULL) {
+            first = write_ring(out, ring[i], first);
+        }
+    }
+
+    fprintf(out, "\n  ]\n}\n");
+}
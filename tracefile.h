@@ -0,0 +1,53 @@
+/*
+ * TraceFile.h
+ *
+ * A timeline of what each thread was doing, written as Chrome trace
+ * events so that it can be opened in chrome://tracing or Perfetto to see
+ * how the workers, the directory loader and the drawing thread overlap.
+ *
+ */
+
+#ifndef __TRACEFILE_H__
+#define __TRACEFILE_H__
+
+
+#include <stdio.h>
+
+// nothing is recorded until this is called
+void start_trace();
+bool trace_enabled();
+
+// "name" must be a string that stays around, such as a literal.  spans
+// on a thread must nest.
+void trace_begin(char *name);
+void trace_end(char *name);
+void trace_counter(char *name, int value);
+
+// shown for the calling thread.  also a literal.
+void set_trace_thread_name(char *name);
+
+// a thread that's about to exit gives its events to the next new thread
+// instead of holding on to them.  they're still written.
+void end_trace_thread();
+
+// the events so far, as Chrome trace JSON
+void write_trace(FILE *out);
+
+// a span as long as a block
+class Trace_span {
+public:
+    Trace_span(char *name) {
+        m_name = name;
+        trace_begin(m_name);
+    }
+
+    ~Trace_span() {
+        trace_end(m_name);
+    }
+
+private:
+    char *m_name;
+};
+
+
+#endif /* __TRACEFILE_H__ */
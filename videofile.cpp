@@ -0,0 +1,307 @@
+/*
+ * VideoFile.cpp
+ *
+ * Writes the frames of the software renderer to a YUV4MPEG2 or PPM
+ * stream.  Each frame is copied into one of a few slots and converted
+ * and written by a thread of its own, so drawing the next frame (and the
+ * workers loading the next pictures) goes on while this one is written.
+ *
+ */
+
+#include <windows.h>
+#include <stdio.h>
+#include <string.h>
+#include <io.h>
+#include <fcntl.h>
+
+#include "videofile.h"
+#include "scaletile.h"
+#include "jessu.h"
+
+// frames drawn but not yet written.  two lets the drawing and the
+// writing overlap, more only helps if the disk is uneven.
+#define VIDEO_FRAME_SLOTS           2
+
+struct VIDEO_SLOT {
+    unsigned char *pixels;
+    bool last;          // no frame, the file is being closed
+};
+
+static FILE *video_file = NULL;
+static bool video_is_ppm;
+static int video_width;
+static int video_height;
+
+static VIDEO_SLOT video_slot[VIDEO_FRAME_SLOTS];
+static int next_slot;           // the one write_video_frame() fills next
+static HANDLE free_slots;
+static HANDLE full_slots;
+static HANDLE video_thread;
+
+// what the writing thread converts each frame to
+static unsigned char *video_output;
+static int video_output_bytes;
+static int frames_written;
+
+// Y'CbCr, BT.601 with studio range, two by two pixels at a time for the
+// chroma
+static void
+convert_to_y4m(unsigned char *pixels, unsigned char *output)
+{
+    int width = video_width;
+    int height = video_height;
+    unsigned char *luma = output;
+    unsigned char *cb = luma + width*height;
+    unsigned char *cr = cb + width/2*height/2;
+
+    for (int y = 0; y < height; y += 2) {
+        unsigned char *top = pixels + y*width*BYTES_PER_TEXEL;
+        unsigned char *bottom = top + width*BYTES_PER_TEXEL;
+        unsigned char *luma_top = luma + y*width;
+        unsigned char *luma_bottom = luma_top + width;
+
+        for (int x = 0; x < width; x += 2) {
+            unsigned char *p[4];
+            int red = 0, green = 0, blue = 0;
+            int k;
+
+            p[0] = top + x*BYTES_PER_TEXEL;
+            p[1] = p[0] + BYTES_PER_TEXEL;
+            p[2] = bottom + x*BYTES_PER_TEXEL;
+            p[3] = p[2] + BYTES_PER_TEXEL;
+
+            for (k = 0; k < 4; k++) {
+                int r = p[k][DST_RED];
+                int g = p[k][DST_GRN];
+                int b = p[k][DST_BLU];
+
+                (k < 2 ? luma_top : luma_bottom)[x + (k & 1)] =
+                    (unsigned char)(((66*r + 129*g + 25*b + 128) >> 8) + 16);
+
+                red += r;
+                green += g;
+                blue += b;
+            }
+
+            red = (red + 2) >> 2;
+            green = (green + 2) >> 2;
+            blue = (blue + 2) >> 2;
+
+            *cb++ = (unsigned char)
+                (((-38*red - 74*green + 112*blue + 128) >> 8) + 128);
+            *cr++ = (unsigned char)
+                (((112*red - 94*green - 18*blue + 128) >> 8) + 128);
+        }
+    }
+}
+
+static void
+convert_to_ppm(unsigned char *pixels, unsigned char *output)
+{
+    int count = video_width*video_height;
+
+    for (int i = 0; i < count; i++) {
+        output[0] = pixels[DST_RED];
+        output[1] = pixels[DST_GRN];
+        output[2] = pixels[DST_BLU];
+        output += 3;
+        pixels += BYTES_PER_TEXEL;
+    }
+}
+
+static unsigned long __stdcall
+video_thread_proc(void *)
+{
+    bool failed = false;
+
+    for (int i = 0; ; i = (i + 1) % VIDEO_FRAME_SLOTS) {
+        VIDEO_SLOT *slot = &video_slot[i];
+
+        WaitForSingleObject(full_slots, INFINITE);
+
+        if (slot->last) {
+            break;
+        }
+
+        // keep taking the frames after a failure so that the renderer
+        // doesn't wait forever
+        if (!failed) {
+            if (video_is_ppm) {
+                fprintf(video_file, "P6\n%d %d\n255\n",
+                        video_width, video_height);
+                convert_to_ppm(slot->pixels, video_output);
+            } else {
+                fprintf(video_file, "FRAME\n");
+                convert_to_y4m(slot->pixels, video_output);
+            }
+
+            if (fwrite(video_output, video_output_bytes, 1,
+                        video_file) != 1) {
+
+                jessu_printf(THREAD_WORKER, "Can't write frame %d (%s)",
+                        frames_written, jessu_strerror());
+                failed = true;
+            } else {
+                frames_written++;
+            }
+        }
+
+        ReleaseSemaphore(free_slots, 1, NULL);
+    }
+
+    return 0;
+}
+
+// closes the file (or lets go of the standard output) and frees the
+// buffers, any of which may not have been allocated
+static void
+end_video_file()
+{
+    if (video_file == stdout) {
+        fflush(video_file);
+    } else {
+        fclose(video_file);
+    }
+    video_file = NULL;
+
+    for (int i = 0; i < VIDEO_FRAME_SLOTS; i++) {
+        if (video_slot[i].pixels != NULL) {
+            jessu_free(THREAD_GL, video_slot[i].pixels, "video frame");
+            video_slot[i].pixels = NULL;
+        }
+    }
+    if (video_output != NULL) {
+        jessu_free(THREAD_GL, video_output, "video output");
+        video_output = NULL;
+    }
+}
+
+bool open_video_file(char *filename, int width, int height,
+        int frames_per_second)
+{
+    int length = strlen(filename);
+
+    video_is_ppm = length >= 4 &&
+        _stricmp(filename + length - 4, ".ppm") == 0;
+
+    if (!video_is_ppm && (width % 2 != 0 || height % 2 != 0)) {
+        jessu_printf(THREAD_GL, "YUV4MPEG2 needs an even size, not %dx%d",
+                width, height);
+        return false;
+    }
+
+    if (strcmp(filename, "-") == 0) {
+        _setmode(_fileno(stdout), _O_BINARY);
+        video_file = stdout;
+    } else {
+        video_file = fopen(filename, "wb");
+        if (video_file == NULL) {
+            jessu_printf(THREAD_GL, "Can't open \"%s\" (%s)", filename,
+                    jessu_strerror());
+            return false;
+        }
+    }
+
+    video_width = width;
+    video_height = height;
+
+    if (video_is_ppm) {
+        video_output_bytes = width*height*3;
+    } else {
+        video_output_bytes = width*height*3/2;
+        fprintf(video_file, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n",
+                width, height, frames_per_second);
+    }
+
+    bool have_memory = true;
+    int i;
+
+    video_output = (unsigned char *)jessu_malloc(THREAD_GL,
+            video_output_bytes, "video output");
+    if (video_output == NULL) {
+        have_memory = false;
+    }
+    for (i = 0; i < VIDEO_FRAME_SLOTS; i++) {
+        video_slot[i].pixels = (unsigned char *)jessu_malloc(THREAD_GL,
+                width*height*BYTES_PER_TEXEL, "video frame");
+        if (video_slot[i].pixels == NULL) {
+            have_memory = false;
+        }
+        video_slot[i].last = false;
+    }
+    if (!have_memory) {
+        jessu_printf(THREAD_GL, "No memory for %dx%d video frames",
+                width, height);
+        end_video_file();
+        return false;
+    }
+
+    next_slot = 0;
+    frames_written = 0;
+    free_slots = CreateSemaphore(NULL, VIDEO_FRAME_SLOTS,
+            VIDEO_FRAME_SLOTS, NULL);
+    full_slots = CreateSemaphore(NULL, 0, VIDEO_FRAME_SLOTS, NULL);
+
+    DWORD thread_id;
+    video_thread = NULL;
+    if (free_slots != NULL && full_slots != NULL) {
+        video_thread = CreateThread(NULL, 0, video_thread_proc, NULL, 0,
+                &thread_id);
+    }
+    if (video_thread == NULL) {
+        jessu_printf(THREAD_GL, "Can't start the video thread");
+        if (free_slots != NULL) {
+            CloseHandle(free_slots);
+        }
+        if (full_slots != NULL) {
+            CloseHandle(full_slots);
+        }
+        end_video_file();
+        return false;
+    }
+
+    jessu_printf(THREAD_GL, "Writing %dx%d %s frames at %d FPS to \"%s\"",
+            width, height, video_is_ppm ? "PPM" : "YUV4MPEG2",
+            frames_per_second, filename);
+
+    return true;
+}
+
+void write_video_frame(SOFT_FRAME *frame, void *)
+{
+    if (frame->width != video_width || frame->height != video_height) {
+        jessu_printf(THREAD_GL, "Frame is %dx%d, not %dx%d",
+                frame->width, frame->height, video_width, video_height);
+        return;
+    }
+
+    VIDEO_SLOT *slot = &video_slot[next_slot];
+
+    WaitForSingleObject(free_slots, INFINITE);
+    memcpy(slot->pixels, frame->pixels,
+            video_width*video_height*BYTES_PER_TEXEL);
+    ReleaseSemaphore(full_slots, 1, NULL);
+
+    next_slot = (next_slot + 1) % VIDEO_FRAME_SLOTS;
+}
+
+void close_video_file()
+{
+    if (video_file == NULL) {
+        return;
+    }
+
+    // the writing thread stops when it gets to this slot
+    WaitForSingleObject(free_slots, INFINITE);
+    video_slot[next_slot].last = true;
+    ReleaseSemaphore(full_slots, 1, NULL);
+
+    WaitForSingleObject(video_thread, INFINITE);
+    CloseHandle(video_thread);
+    CloseHandle(free_slots);
+    CloseHandle(full_slots);
+
+    jessu_printf(THREAD_GL, "Wrote %d frames", frames_written);
+
+    end_video_file();
+}
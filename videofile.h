@@ -0,0 +1,27 @@
+/*
+ * VideoFile.h
+ *
+ * Writes the frames of the software renderer to a file, for making the
+ * slide show into a video without a window.
+ *
+ */
+
+#ifndef __VIDEOFILE_H__
+#define __VIDEOFILE_H__
+
+#include "softrender.h"
+
+// "filename" is "-" for the standard output.  a name ending in ".ppm"
+// gets PPM images one after the other, anything else YUV4MPEG2 (4:2:0,
+// which needs an even width and height).
+bool open_video_file(char *filename, int width, int height,
+        int frames_per_second);
+
+// a SOFT_FRAME_HOOK.  the frame is copied and written on a thread of its
+// own, so the next frame can be drawn while this one goes out.
+void write_video_frame(SOFT_FRAME *frame, void *data);
+
+// waits for the frames still being written
+void close_video_file();
+
+#endif /* __VIDEOFILE_H__ */